@@ -0,0 +1,76 @@
+#if !defined(ARENA_H)
+#define ARENA_H
+/*
+ * Scoped arena allocation, for short-lived work like a parse or a render.
+ *
+ * While an ArenaScope exists, the Bodies and other RefCounted objects this
+ * thread makes are allocated by bumping a pointer through the arena's chunks.
+ * Their destructors still run when their last reference goes, but freeing
+ * their memory only counts it. The chunks are released together when the
+ * scope ends, so the work costs little more than the pointer bumps.
+ *
+ * A value that outlives the scope is an escape. Each chunk stays until its
+ * escaped blocks have been freed too, so an escape is safe, but it wastes the
+ * rest of its chunk. Copy a result out within an ArenaScope::Pause, where
+ * allocation is normal again. In debug builds, an escape fails an assertion
+ * unless the scope was made to allow escapes. Things made to last for the
+ * whole process, like literal and interned strings, are always made in a Pause.
+ *
+ * Arenas need the slab allocator. SLAB_ALLOC is off in the default build, and then
+ * ArenaScope and Pause do nothing: allocation is always normal, and live() is zero.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<assert.h>
+#if	defined(SLAB_ALLOC)
+#include	<slab.h>
+#endif
+
+class	ArenaScope
+{
+public:
+#if	defined(SLAB_ALLOC)
+	ArenaScope(bool allow_escapes = false)
+			: escapes_allowed(allow_escapes)
+			{ SlabArenaOpen(&arena); }
+	~ArenaScope()
+			{
+				long	escaped = SlabArenaClose(&arena);
+				assert(escapes_allowed || escaped == 0);
+				(void)escaped;
+			}
+	long		live() const		// How many blocks from this arena are still in use
+			{ return SlabArenaLive(&arena); }
+
+	class	Pause			// Allocate normally while this exists
+	{
+	public:
+		Pause() : cache(SlabCurrentCache()), arena(cache ? cache->arena : 0) { if (arena) cache->arena = 0; }
+		~Pause() { if (arena) cache->arena = arena; }
+	private:
+		SlabCache*	cache;
+		SlabArena*	arena;
+		Pause(const Pause&);
+		Pause&		operator=(const Pause&);
+	};
+
+private:
+	SlabArena	arena;
+	bool		escapes_allowed;
+#else
+	ArenaScope(bool /* allow_escapes */ = false) {}
+	long		live() const { return 0; }
+
+	class	Pause
+	{
+	public:
+		Pause() {}
+	};
+#endif
+
+private:
+	ArenaScope(const ArenaScope&);		// Not copyable
+	ArenaScope&	operator=(const ArenaScope&);
+};
+
+#endif	// ARENA_H
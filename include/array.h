@@ -8,16 +8,25 @@
  * - Slices share Arrays with thread-safety and garbage collection using atomic reference counting
  *
  * A shared array Body cannot be mutated, it's always copied first to ensure it has only one Slice.
+ * A length that doesn't fit in the Index type throws std::length_error.
  *
  * (c) Copyright Clifford Heath 2023. See LICENSE file for usage rights.
  */
 #include	<cstdlib>
 #include	<cstdint>
 #include	<functional>
+#include	<new>
+#include	<stdexcept>
+#include	<utility>
 
 #include	<refcount.h>
+#if	defined(SLAB_ALLOC)
+#include	<slab.h>
+#endif
 
-#define ArrayIndexBits	32
+#if	!defined(ArrayIndexBits)
+#define ArrayIndexBits	32		// Define as 16 for compact Arrays of up to 65535 elements
+#endif
 typedef typename std::conditional<(ArrayIndexBits <= 16), uint16_t, uint32_t>::type  ArrayIndex;
 
 template<typename E, typename I = ArrayIndex>	class	ArrayBody;
@@ -36,24 +45,41 @@ public:
 			: body(0), offset(0), num_elements(0) {}
 	ArrayR(const ArrayR& s1)		// Normal copy constructor
 			: body(s1.body), offset(s1.offset), num_elements(s1.num_elements) {}
+	ArrayR(ArrayR&& s1)			// Move constructor, leaving s1 empty
+			: body(s1.body.pass()), offset(s1.offset), num_elements(s1.num_elements)
+			{ s1.offset = s1.num_elements = 0; }
 	ArrayR(const Element* data, Index size, Index allocate = 0)	// construct by copying data
 			: body(0), offset(0), num_elements(size)
 			{
 				if (allocate < size)
 					allocate = size;
-				body = new Body(data, true, size, allocate);
+				body = Body::create(data, true, size, allocate);
 				num_elements = size;
 			}
 	ArrayR(Body* _body)		// New reference to same Body; used for static strings
 			: body(_body), offset(0), num_elements(_body->length()) {}
 	ArrayR& operator=(const ArrayR& s1) // Assignment operator
 			{ body = s1.body; offset = s1.offset; num_elements = s1.num_elements; return *this; }
+	ArrayR& operator=(ArrayR&& s1)	// Move assignment, leaving s1 empty
+			{
+				if (this != &s1)
+				{
+					body = s1.body.pass();
+					offset = s1.offset;
+					num_elements = s1.num_elements;
+					s1.offset = s1.num_elements = 0;
+				}
+				return *this;
+			}
+	Self&&		pass() { return std::move(static_cast<Self&>(*this)); }	// Pass this on without counting a new reference
 	ArrayR(const Element data)	// construct array of one element only
-			: body(new Body(&data, true, 1)), offset(0), num_elements(1)
+			: body(Body::create(&data, true, 1)), offset(0), num_elements(1)
 			{}
 
 	Index		length() const
 			{ return num_elements; }
+	void		share() const	// Call before handing this Array to another thread. The elements are shared too
+			{ body.share(); }
 	bool		isEmpty() const
 			{ return length() == 0; }
 	inline bool	isShared() const
@@ -77,7 +103,8 @@ public:
 			  Unshare();
 			  return body->data()[offset+elem_num]; }
 	const Element&	elem_ref(int elem_num) const
-			{ return elem_mut(elem_num); }
+			{ assert(elem_num >= 0 && elem_num < num_elements && body);
+			  return body->data()[offset+elem_num]; }
 	const Element*	asElements() const
 			{ return body ? body->data()+offset : 0; }
 
@@ -163,13 +190,13 @@ public:
 				 && offset+num_elements == addend.offset)	// And this ends where the addend starts
 					return Self(body, offset, num_elements+addend.num_elements);
 
-				Self		newarray(asElements(), num_elements, num_elements+addend.length());
+				Self		newarray(asElements(), num_elements, Body::checkLength((size_t)num_elements+addend.length()));
 				newarray += addend;
 				return newarray;
 			}
 	Self		operator+(const Element& addend) const
 			{
-				Self	newarray(asElements(), num_elements, num_elements+1);
+				Self	newarray(asElements(), num_elements, Body::checkLength((size_t)num_elements+1));
 				newarray += addend;
 				return newarray;
 			}
@@ -274,7 +301,7 @@ public:
 				return *this;
 			}
 	ArrayR&		append(const ArrayR& addend)	// Append an ArrayR to the end
-			{ return insert(num_elements, addend.asElements(), addend.length()); }
+			{ return insert(num_elements, addend); }
 	ArrayR&		append(const Element& addend)	// Append an element to the end
 			{ return push(addend); }
 	ArrayR&		reverse()
@@ -432,14 +459,39 @@ public:
 	// Self	uniq(std::function<int(const Element& e1, const Element& e2)> comparator) const;
 	// void		sort(std::function<int(const Element& e1, const Element& e2)> comparator);
 
-#if 0	// Not yet implemented
-	void		transform(const std::function<ArrayR(const Element*& cp, const Element* ep)> xform, int after = -1)
+	/*
+	 * At every Element after the given point, xform can consume any number of elements
+	 * (up to ep), appending their replacements to the output array. To quit, leaving the
+	 * remainder untransformed, return without advancing cp (what was appended is kept).
+	 * Any callable will do, so the compiler can inline the work for each element.
+	 */
+	template<typename Xform, typename = decltype(std::declval<Xform&>()(std::declval<const Element*&>(), (const Element*)0, std::declval<Self&>()))>
+	void		transform(Xform xform, int after = -1)
 			{
-				Unshare();
-				body->transform(xform, after);
-				num_elements = body->length();
+				if (num_elements == 0)
+					return;				// body may be null
+				const Element*	dp = asElements();
+				const Element*	ep = dp+num_elements;
+				const Element*	cp = dp+((Index)(after+1) < num_elements ? after+1 : num_elements);
+				Self		output(dp, cp-dp, num_elements);	// Preallocate the same size
+
+				while (cp < ep)
+				{
+					const Element*	next = cp;
+					xform(next, ep, output);
+					if (next == cp)
+						break;		// Stopped transforming
+					cp = next;
+				}
+				for (; cp < ep; cp++)
+					output.append(*cp);	// The untransformed remainder
+				*this = output;
+			}
+	// The same, but xform returns a whole replacement for what it consumed:
+	void		transform(const std::function<Self(const Element*& cp, const Element* ep)> xform, int after = -1)
+			{
+				transform([&](const Element*& cp, const Element* ep, Self& output) { output.append(xform(cp, ep)); }, after);
 			}
-#endif
 
 	ArrayR(Body* body, Index offs, Index len)
 			: body(body), offset(offs), num_elements(len)
@@ -455,13 +507,19 @@ private:
 	Index		offset;		// Character number of the first element of this substring
 	Index		num_elements;	// How many element in this substring
 
-	void		Unshare(Index extra = 0)	// Get our own copy of Body that we can safely mutate
+	void		Unshare(Index extra = 0)	// Get our own copy of Body that we can safely mutate, with room for extra elements
 			{
+				Index	allocate = Body::checkLength((size_t)num_elements+extra);
 				if (body && body->GetRefCount() <= 1)
-					return;
+				{
+					if ((size_t)body->length()+extra <= body->capacity())
+						return;
+					// Not enough room. Reallocate the whole block, not just the elements
+					allocate = Body::grownAllocation(body->capacity(), (size_t)body->length()+extra);
+				}
 
 				// Copy only this slice of the body's data, and reset our offset to zero
-				body = new Body(asElements(), true, num_elements, num_elements+extra);
+				body = Body::create(asElements(), true, num_elements, allocate);
 				offset = 0;
 			}
 };
@@ -476,6 +534,8 @@ public:
 	: Base() {}
 	Array(const Array& s1)		// Normal copy constructor
 	: Base(s1) {}
+	Array(Array&& s1)		// Move constructor
+	: Base(std::move(s1)) {}
 	Array(const Element* data, Index size, Index allocate = 0)	// construct by copying data
 	: Base(data, size, allocate) {}
 	Array(const Base& s1)
@@ -488,9 +548,16 @@ public:
 	Array(const Element data)	// construct array of one element only
 			: Base(data)
 			{}
-
+	Array&		operator=(const Array& s1)
+			{ Base::operator=(s1); return *this; }
+	Array&		operator=(Array&& s1)
+			{ Base::operator=(std::move(s1)); return *this; }
 };
 
+// An Array defined by number of bits in the index. ArrayB<E, 16> holds up to 65535 elements:
+template<typename Element, unsigned int IndexBits = ArrayIndexBits>
+using ArrayB = Array<Element, typename std::conditional<(IndexBits <= 16), uint16_t, uint32_t>::type>;
+
 template<typename E, typename I> class	ArrayBody
 : public RefCounted			// This object will be deleted when the ref_count decrements to zero
 {
@@ -500,14 +567,17 @@ public:
 
 	~ArrayBody()
 			{
-				if (start
+				if (inline_data)
+					destroyInline(num_alloc);
+				else if (start
 				 && num_alloc > 0)		// Don't delete borrowed data
-					delete[] start;
+					deleteElements(start, num_alloc);
 			}
 	ArrayBody()
-			: start(0), num_elements(0), num_alloc(0) { }
+			: inline_data(false), start(0), num_elements(0), num_alloc(0) { }
 	ArrayBody(const Element* data, bool copy, Index length, Index allocate = 0)
-			: start(0)
+			: inline_data(false)
+			, start(0)
 			, num_elements(0)
 			, num_alloc(0)
 			{
@@ -529,8 +599,86 @@ public:
 				}
 			}
 
+	/*
+	 * Make a new Body the same way as the constructor, except that copied
+	 * elements are stored in the same memory block, following the Body.
+	 * Such a Body can still grow, but the data will then be moved to a
+	 * separate block, so it's better to create a new Body (see grownAllocation).
+	 */
+	static ArrayBody* create(const Element* data, bool copy, Index length, Index allocate = 0)
+			{
+				if (!copy)
+					return new ArrayBody(data, copy, length, allocate);
+				allocate = roundAllocation(allocate < length ? length : allocate);
+				Element*	storage;
+				void*	mem = allocateBody<ArrayBody>(allocate, storage);
+				ArrayBody*	body = new(mem) ArrayBody(data, length, allocate, storage);
+				body->inline_data = storage == dataFollowing<ArrayBody>(mem);
+				return body;
+			}
+	static void*	operator new(size_t size)	// A Body that doesn't copy its data
+			{ return allocateBytes(size); }
+	static void*	operator new(size_t, void* mem)	// Placement, for create()
+			{ return mem; }
+	static void	operator delete(void* mem, size_t size)	// The size of the Body, without any following data
+			{ deallocate(mem, size); }
+	void		share()		// The elements go to other threads too
+			{
+				for (Index i = 0; i < num_elements; i++)
+					RefShare(start[i]);
+				RefCounted::share();
+			}
+
+	// Allocate and free separate element storage, as resize does:
+	static Element*	newElements(size_t count)
+			{
+#if	defined(SLAB_ALLOC)
+				Element*	elements = (Element*)SlabAllocate(count*sizeof(Element));
+				for (size_t i = 0; i < count; i++)
+					new(elements+i) Element();
+				return elements;
+#else
+				return new Element[count];
+#endif
+			}
+	static void	deleteElements(Element* elements, size_t count)
+			{
+#if	defined(SLAB_ALLOC)
+				if (!elements)
+					return;
+				for (size_t i = 0; i < count; i++)
+					elements[i].~Element();
+				SlabFree(elements, count*sizeof(Element));
+#else
+				(void)count;		// delete[] knows how many
+				delete[] elements;
+#endif
+			}
+
+	// How many elements to allocate to grow to minimum, given the current allocation
+	static size_t	grownAllocation(Index current, size_t minimum)
+			{
+				minimum = roundAllocation(minimum);
+				size_t	grown = current;
+				if (grown)	// Minimum growth 50% rounded up to nearest 16
+					grown = ((grown*3/2) | 0xF) + 1;
+				if (grown > maxLength())
+					grown = maxLength();
+				return grown < minimum ? minimum : grown;
+			}
+
+	static constexpr size_t	maxLength()	// The most elements an Index can count
+			{ return (Index)~(Index)0; }
+	static Index	checkLength(size_t length)	// Throw std::length_error if the length won't fit in an Index
+			{
+				if (length > maxLength())
+					throw std::length_error("Array length overflows its Index type");
+				return (Index)length;
+			}
+
 	bool		isStatic() const	// This body or its data are transient (borrowed) not allocated
 			{ return num_alloc == 0 && num_elements > 0; }
+	Index		capacity() const { return num_alloc; }
 
 	const Element&	operator[](int elem_num) const { assert(elem_num >= 0 && elem_num < num_elements); return start[elem_num]; }
 	Element&	operator[](int elem_num) { assert(elem_num >= 0 && elem_num < num_elements); return start[elem_num]; }
@@ -542,14 +690,13 @@ public:
 	// Mutating methods. Must only be called when refcount <= 1 (i.e., unshared)
 	void		insert(Index pos, const Element* elements, Index num)	// Insert a subarray
 			{
-				assert(ref_count <= 1);
+				assert(GetRefCount() <= 1);
 				if (num <= 0)
 					return;
 
 				assert(pos >= 0);		// Insertion point not before beginning
 				assert(pos <= num_elements);	// Insertion point not after the end
-				Index new_size = num_elements+num;
-				assert(new_size >= num_elements); // Ensure the Index didn't wrap
+				Index new_size = checkLength((size_t)num_elements+num);
 
 				resize(new_size);
 
@@ -563,7 +710,7 @@ public:
 			}
 	void		remove(Index at, int len = -1)		// Delete a subslice from the middle
 			{
-				assert(ref_count <= 1);
+				assert(GetRefCount() <= 1);
 				if (len == 0)
 					return;
 				assert(len >= -1);
@@ -578,39 +725,98 @@ public:
 				num_elements -= len;		// len says how many we deleted.
 			}
 
-#if 0	// Not yet implemented
-	/*
-	 * At every Element after the given point, the passed transform function can
-	 * extract any number of elements (up to ep) and return a replacement ArrayR for those elements
-	 * To quit, leaving the remainder untransformed, return without advancing cp
-	 * (but a returned Array will still be inserted).
-	 * None of the returned Arrays will be retained, so they can use static Bodys (or the same Body)
-	 */
-	void		transform(const std::function<A(const A*& cp, const A* ep)> xform, int after = -1);
-#endif
-
 protected:
+	bool		inline_data;	// The data follows this Body, in the same memory block (fits in RefCounted's padding)
 	Element*	start;		// start of the character data
 	Index		num_elements;	// Number of elements
 	Index		num_alloc;	// How many elements are allocated. 0 means data is not allocated so must not be freed
 
+	ArrayBody(const Element* data, Index length, Index allocate, Element* storage)	// Construct in the storage from create()
+			: inline_data(true)
+			, start(storage)
+			, num_elements(length)
+			, num_alloc(allocate)
+			{
+				// Copy using the copy constructor belonging to Element
+				for (Index i = 0; i < allocate; i++)
+					if (i < length)
+						new(start+i) Element(data[i]);
+					else
+						new(start+i) Element();
+			}
+
+	static size_t	roundAllocation(size_t minimum)	// round up to multiple of 8, if the Index allows
+			{
+				checkLength(minimum);
+				size_t	rounded = minimum ? ((minimum-1)|0x7)+1 : 0;
+				return rounded > maxLength() ? maxLength() : rounded;
+			}
+
+	// Allocate memory for a B and storage for allocate elements (not constructed), following the B if possible.
+	// Freeing a B only passes its own size, so with the slab allocator, both must fit in one small block.
+	template<typename B>
+	static void*	allocateBody(size_t allocate, Element*& storage)
+			{
+				size_t	bytes = dataOffset<B>() + allocate*sizeof(Element);
+#if	defined(SLAB_ALLOC)
+				if (bytes > SlabMaxSize)
+				{
+					storage = (Element*)allocateBytes(allocate*sizeof(Element));
+					return allocateBytes(sizeof(B));
+				}
+#endif
+				void*	mem = allocateBytes(bytes);
+				storage = dataFollowing<B>(mem);
+				return mem;
+			}
+	static void*	allocateBytes(size_t bytes)
+			{
+#if	defined(SLAB_ALLOC)
+				return SlabAllocate(bytes);
+#else
+				return ::operator new(bytes);
+#endif
+			}
+	static void	deallocate(void* mem, size_t bytes)
+			{
+#if	defined(SLAB_ALLOC)
+				SlabFree(mem, bytes);
+#else
+				(void)bytes;
+				::operator delete(mem);
+#endif
+			}
+	template<typename B>
+	static Element*	dataFollowing(void* mem)
+			{ return (Element*)((char*)mem + dataOffset<B>()); }
+	template<typename B>
+	static constexpr size_t	dataOffset()
+			{ return (sizeof(B)+alignof(Element)-1)/alignof(Element)*alignof(Element); }
+
+	void		destroyInline(Index allocated)
+			{
+				for (Index i = 0; i < allocated; i++)
+					start[i].~Element();
+			}
+
 	void		resize(size_t minimum)	// Change the memory allocation
 			{
 				if (minimum <= num_alloc)
 					return;		// Never release memory on a downsize
 
-				minimum = ((minimum-1)|0x7)+1;	// round up to multiple of 8
-				if (num_alloc)	// Minimum growth 50% rounded up to nearest 16
-					num_alloc = ((num_alloc*3/2) | 0xF) + 1;
-				if (num_alloc < minimum)
-					num_alloc = minimum;		// Still not enough, get enough
-				Element*	newdata = new Element[num_alloc];
+				Index		old_alloc = num_alloc;
+				num_alloc = grownAllocation(num_alloc, minimum);
+				Element*	newdata = newElements(num_alloc);
 				if (start)
 				{
 					for (Index i = 0; i < num_elements; i++)
 						newdata[i] = start[i];
-					delete[] start;
+					if (inline_data)	// The old data's memory is part of this Body, so stays
+						destroyInline(old_alloc);
+					else
+						deleteElements(start, old_alloc);
 				}
+				inline_data = false;
 				start = newdata;
 			}
 
@@ -618,6 +824,7 @@ protected:
 	ArrayBody& operator=(const ArrayBody& s1) // Assignment operator; ONLY for no-copy bodies
 			{
 				assert(s1.num_alloc == 0);	// Must not do this if we would make two references to allocated data
+				assert(!inline_data);
 				start = s1.start;
 				num_elements = s1.num_elements;
 				num_alloc = 0;
@@ -65,6 +65,22 @@ int		UCS4HexDigit(UCS4 ch);		// Digit value 0-9, a-f/A-F or -1 if not digit
 UCS4		UCS4ToUpper(UCS4 ch);		// To upper case
 UCS4		UCS4ToLower(UCS4 ch);		// To lower case
 UCS4		UCS4ToTitle(UCS4 ch);		// To Title or upper case
+/*
+ * Fold case, so that characters that differ only in case are the same.
+ * This is the simple (one-to-one) folding, using the case conversion
+ * tables: converting to upper case first merges variants like final sigma.
+ * It's inline so that the many characters with no case need no call.
+ */
+inline UCS4	UCS4ToFold(UCS4 ch)
+		{
+			if (ch < 0x80)
+				return ch >= 'A' && ch <= 'Z' ? ch+('a'-'A') : ch;
+			if (ch > 0xFFFF)
+				return ch;		// There's no case conversion outside the BMP
+			if (ch >= 0x2500 && ch < 0xFF21)
+				return ch;		// Nor between the circled letters and the fullwidth ones (including CJK)
+			return UCS4ToLower(UCS4ToUpper(ch));
+		}
 inline bool	UCS4IsWhite(UCS4 ch)
 		{
 			return ch == ' '
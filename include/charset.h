@@ -0,0 +1,75 @@
+#if !defined(CHARSET_H)
+#define CHARSET_H
+/*
+ * Sets of Unicode characters, for findAny and findNot.
+ *
+ * A CharSet is built once, then tested against many characters. ASCII
+ * members are kept in a bitmap, and others in sorted ranges. Searching
+ * for a set with no non-ASCII members runs at the speed of UTF8FindClass.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<cstring>
+
+#include	<char_encoding.h>
+#include	<array.h>
+
+template<typename Index> class StrValI;
+
+struct	CharRange
+{
+	UCS4		first;
+	UCS4		last;		// Inclusive
+};
+
+class	CharSet
+{
+public:
+	CharSet() : ascii{0, 0} {}
+	CharSet(const UTF8* cp, const UTF8* ep)	// Each character in the UTF-8 data
+			: ascii{0, 0} { add(cp, ep); }
+	explicit CharSet(const UTF8* cp)	// Each character in the NUL-terminated UTF-8
+			: ascii{0, 0} { add(cp, cp+strlen(cp)); }
+	template<typename Index>
+	CharSet(const StrValI<Index>& s)	// Each character of the StrVal
+			: ascii{0, 0}
+			{
+				Index		bytes;
+				const UTF8*	cp = s.asUTF8(bytes);
+				add(cp, cp+bytes);
+			}
+
+	CharSet&	add(UCS4 ch)
+			{ return add(ch, ch); }
+	CharSet&	add(UCS4 first, UCS4 last);	// Add an inclusive range
+	CharSet&	add(const UTF8* cp, const UTF8* ep);
+
+	bool		contains(UCS4 ch) const
+			{
+				if (ch < 0x80)
+					return (ascii[ch>>6] >> (ch&63)) & 1;
+				return rangeAt(ch) >= 0;
+			}
+	bool		isASCII() const			// Are all members ASCII?
+			{ return ranges.length() == 0; }
+
+	// Return the start of the first or last character in [cp, ep) that is (or isn't) in the set, or 0:
+	const UTF8*	findAny(const UTF8* cp, const UTF8* ep) const
+			{ return find(cp, ep, true); }
+	const UTF8*	findNot(const UTF8* cp, const UTF8* ep) const
+			{ return find(cp, ep, false); }
+	const UTF8*	rfindAny(const UTF8* cp, const UTF8* ep) const
+			{ return rfind(cp, ep, true); }
+	const UTF8*	rfindNot(const UTF8* cp, const UTF8* ep) const
+			{ return rfind(cp, ep, false); }
+
+private:
+	uint64_t	ascii[2];	// Bitmap of ASCII members
+	Array<CharRange> ranges;	// Sorted, disjoint, non-adjacent ranges above ASCII
+
+	int		rangeAt(UCS4 ch) const;	// Index of the range containing ch, or -1
+	const UTF8*	find(const UTF8* cp, const UTF8* ep, bool wanted) const;
+	const UTF8*	rfind(const UTF8* cp, const UTF8* ep, bool wanted) const;
+};
+
+#endif	// CHARSET_H
@@ -6,18 +6,24 @@
  * When you try to change a CowMap that has any other reference,
  * the entire map is copied before your change is attempted.
  *
- * Internally, it's just a std::map, which is a red-black tree.
+ * Internally, it's just a std::map, which is a red-black tree. A CowHashMap
+ * uses a std::unordered_map instead, which for StrVal keys uses the hash that
+ * each StrBody caches, so it doesn't need to compare whole strings at every
+ * level of the tree. Its iteration order is unspecified.
  */
 #include	<cstdlib>
 #include	<cstdint>
 #include	<functional>
 #include	<map>
+#include	<unordered_map>
 
 #include	<refcount.h>
 #include	<strval.h>
 
 template<typename V, typename K> class CowMapBody;
+template<typename V, typename K> class CowHashMapBody;
 template<typename V, typename K = StrVal, typename Body = CowMapBody<V, K>> class CowMap;
+template<typename V, typename K = StrVal> using CowHashMap = CowMap<V, K, CowHashMapBody<V, K>>;
 
 template<
 	typename V,
@@ -37,6 +43,8 @@ public:
 			: body(new Body()) { }
 	CowMap(const CowMap& s1)		// Normal copy constructor
 			: body(s1.body) { }
+	CowMap(CowMap&& s1)			// Move constructor, leaving s1 empty
+			: body(s1.body.pass()) { }
 	CowMap(const Key* keys, const Value* values, int size)	// construct by copying data
 			: body(0)
 			{
@@ -46,11 +54,14 @@ public:
 			}
 	CowMap& operator=(const CowMap& s1)	// Assignment operator
 			{ body = s1.body; return *this; }
+	CowMap& operator=(CowMap&& s1)		// Move assignment, leaving s1 empty
+			{ body = s1.body.pass(); return *this; }
+	CowMap&& pass() { return std::move(*this); }	// Pass this map on without counting a new reference
 
 	Value	operator[](const Key& k)
 			{
-				auto	it = (*body).find(k);
-				if (it != (*body).end())
+				auto	it = contents().find(k);
+				if (it != contents().end())
 					return it->second;
 				return Value();
 			}
@@ -59,13 +70,15 @@ public:
 				auto search = find(k);
 				return search != end();
 			}
-	Iter	find(const Key& k) { return body->find(k); }
+	Iter	find(const Key& k) { return contents().find(k); }
 	Iter	begin() const
-			{ return body->begin(); }
+			{ return contents().begin(); }
 	Iter	end() const
-			{ return body->end(); }
+			{ return contents().end(); }
 	size_t	size() const
-			{ return body->size(); }
+			{ return contents().size(); }
+	void	share() const	// Call before handing this map to another thread. The keys and values are shared too
+			{ body.share(); }
 
 	// Mutating methods:
 	void	clear() { body = new Body(); }
@@ -77,7 +90,7 @@ public:
 			{
 				auto search = find(k);
 				if (search != end())
-					body->erase(k);
+					remove(k);
 				insert(k, v);
 				return k;
 			}
@@ -157,12 +170,22 @@ public:
 			}
 
 private:
-	Ref<Body>	body;		// The storage structure for the elements
+	Ref<Body>	body;		// The storage structure for the elements, null after a move
 
+	const Body&	contents() const
+			{
+				static const Body	empty;
+				return body ? *body : empty;
+			}
 	void		Unshare()	// Get our own copy of Body that we can safely mutate
 			{
 				if (body && body->GetRefCount() <= 1)
 					return;
+				if (!body)
+				{
+					body = new Body();
+					return;
+				}
 
 				// Copy the old body's data
 				Body* newbody = new Body();
@@ -186,5 +209,39 @@ public:
 	using	Key = K;
 
 	CowMapBody() { }
+	void	share()		// The keys and values go to other threads too
+			{
+				for (auto& kv : *this)
+				{
+					RefShare(kv.first);
+					RefShare(kv.second);
+				}
+				RefCounted::share();
+			}
+};
+
+template<
+	typename V,
+	typename K
+> class	CowHashMapBody
+	: public std::unordered_map<K, V>
+	, public RefCounted
+{
+	using	Base = std::unordered_map<K, V>;
+public:
+	using	Iter = typename Base::const_iterator;
+	using	Value = V;
+	using	Key = K;
+
+	CowHashMapBody() { }
+	void	share()		// The keys and values go to other threads too
+			{
+				for (auto& kv : *this)
+				{
+					RefShare(kv.first);
+					RefShare(kv.second);
+				}
+				RefCounted::share();
+			}
 };
 #endif // COWMAP_H
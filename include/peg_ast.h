@@ -8,6 +8,7 @@
  */
 #include	<char_encoding.h>
 #include	<peg.h>
+#include	<strintern.h>
 #include	<utf8_ptr.h>
 
 #include	<cstdio>
@@ -94,10 +95,25 @@ public:
 	PegCaptureRule(const char* _name, PegexpT _pegexp, const char** _captures)
 	: PegRuleNoCapture<PegexpT>(_name, _pegexp)
 	, captures(_captures)
-	{}
+	{
+		// Intern the capture names once here, not under the intern lock on every capture:
+		for (int i = 0; captures && captures[i]; i++)
+			capture_names.push(StrIntern::intern(captures[i], strlen(captures[i])));
+	}
 
 	// Labelled atoms or rules matching these capture names should be returned in the parse match:
 	const char**	captures;	// Pointer to zero-terminated array of string pointers.
+	StringArray	capture_names;	// The same, interned
+
+	int capture_number(const char* label, int label_len)	// -1 if not captured
+	{
+		if (!captures)
+			return -1;
+		for (int i = 0; captures[i]; i++)
+			if (0 == strncmp(captures[i], label, label_len) && captures[i][label_len] == '\0')
+				return i;
+		return -1;
+	}
 
 	bool is_captured(const char* label)	// label maybe not nul-terminated!
 	{
@@ -108,6 +124,12 @@ public:
 				return true;
 		return false;
 	}
+
+	StrVal capture_name(const char* label, int label_len)
+	{		// A label that only starts with a capture name (namespace, name) is not that name
+		int	i = capture_number(label, label_len);
+		return i >= 0 ? capture_names[i] : StrVal(label, label_len);
+	}
 };
 
 /*
@@ -146,7 +168,7 @@ public:
 
 	int		capture(PatternP name, int name_len, Match r, bool in_repetition)
 	{
-		StrVal		key(name, name_len);
+		StrVal		key = rule->capture_name(name, name_len);	// Interned with the rule
 		Variant		value(r.var);
 		Variant		existing;
 
@@ -3,23 +3,193 @@
 /*
  * Thread-safe reference counting with delete on last release
  *
+ * The count is biased towards the thread that made the object: that thread
+ * counts with plain loads and stores, and only other threads use atomic
+ * operations, on a separate shared count. When the owner's count reaches
+ * zero the two counts merge, and from then on all threads use the shared
+ * count, so the last release from any thread deletes the object.
+ *
+ * A reference counted by the owner may be released by another thread, which
+ * takes the shared count below zero. That thread then queues the object for
+ * the owner, which merges the counts at its next Release (or when it calls
+ * collect(), or ends). If the owner has already ended, the releasing thread
+ * merges the counts itself. A thread that ends leaves its number for a new
+ * thread to adopt, along with the counts of the objects it still owns.
+ *
+ * Calling share() before handing an object to another thread merges the
+ * counts straight away, so the object needn't wait for its owner.
+ *
+ * An object that's never freed, such as the Body of a string literal, may be
+ * made immortal. Counting references to it then changes nothing.
+ *
+ * With SLAB_ALLOC defined, RefCounted objects use the slab allocator. The
+ * library and all code using it must be compiled alike, so each refers to a
+ * symbol that only a library compiled the same way defines.
+ *
  * (c) Copyright Clifford Heath 2022. See LICENSE file for usage rights.
  */
 #include	<assert.h>
+#include	<stdint.h>
+#include	<limits.h>
 #include	<atomic>
+#if	defined(SLAB_ALLOC)
+#include	<slab.h>
+extern int	StrppBuiltWithSlabAlloc;	// Defined in slab.cpp
+#define	STRPP_ALLOC_CHECK	StrppBuiltWithSlabAlloc
+#else
+extern int	StrppBuiltWithoutSlabAlloc;
+#define	STRPP_ALLOC_CHECK	StrppBuiltWithoutSlabAlloc
+#endif
+#if	defined(__GNUC__)
+__attribute__((used)) static int* const	StrppAllocCheck = &STRPP_ALLOC_CHECK;	// Kept, so it must link
+#endif
+
+class	RefCounted;
+struct	RefCountNode;			// A queued object
+
+struct	RefCountThread			// The number and merge queue of one thread
+{
+	uint32_t		id;
+	std::atomic<RefCountNode*>	queue;	// Objects released below zero by other threads, or a marker
+	RefCountThread*		next_abandoned;	// Threads that have ended, for new threads to adopt
+};
+
+struct	RefCountLocal			// This thread's number, kept apart for quick access
+{
+	uint32_t		id;		// Zero until this thread first counts
+	RefCountThread*		thread;
+};
+
+inline RefCountLocal&	RefCountCurrent()
+{
+	static thread_local RefCountLocal	local;
+	return local;
+}
+
+uint32_t	RefCountThreadStart();	// Adopt or make this thread's number
+void		RefCountMergeQueue(RefCountNode* node);
 
 class	RefCounted
 {
 public:
+#if	defined(SLAB_ALLOC)
+	static void*	operator new(size_t size) { return SlabAllocate(size); }
+	static void*	operator new(size_t, void* mem) { return mem; }	// Placement
+	static void	operator delete(void* mem, size_t size) { SlabFree(mem, size); }	// The size of the most-derived class
+#endif
 	virtual		~RefCounted() { }
-			RefCounted() : ref_count(0) {}
-	void		AddRef() { (void)ref_count++; assert(ref_count != 0); /* Check for overflow */ }
-	void		Release() { assert(ref_count > 0); if (--ref_count == 0) delete this; }
+			RefCounted() : owner(currentThread()), biased(0), shared(0)
+			{
+				if (owner.load(std::memory_order_relaxed) == Detached)
+				{	// Made while its thread ends, so it's never biased
+					owner.store(0, std::memory_order_relaxed);
+					shared.store(Merged, std::memory_order_relaxed);
+				}
+			}
+	void		AddRef()
+			{
+				uint32_t	o = owner.load(std::memory_order_relaxed);
+				if (o == currentThread())
+				{	// Only this thread changes the biased count
+					int	n = biased.load(std::memory_order_relaxed)+1;
+					assert(n > 0);	// Check for overflow
+					biased.store(n, std::memory_order_relaxed);
+				}
+				else if (o != Immortal)
+					shared.fetch_add(SharedOne, std::memory_order_relaxed);
+			}
+	void		Release()
+			{
+				uint32_t	o = owner.load(std::memory_order_relaxed);
+				if (o == currentThread())
+				{
+					int	n = biased.load(std::memory_order_relaxed)-1;
+					assert(n >= 0);
+					biased.store(n, std::memory_order_relaxed);
+					if (n == 0)
+					{
+						RefCountThread*	thread = RefCountCurrent().thread;
+						merge();	// This may be deleted now, and if it's queued, collecting deletes it
+						if (thread->queue.load(std::memory_order_relaxed))
+							collect();	// Other threads have released some of ours
+					}
+				}
+				else if (o != Immortal)
+				{
+					int	s = shared.load(std::memory_order_relaxed);
+					if (s & Merged)
+					{	// Merged stays set, so there's nothing to queue
+						if (shared.fetch_sub(SharedOne, std::memory_order_acq_rel) == (SharedOne|Merged))
+							delete this;
+						return;
+					}
+					// Count down, and if that goes below zero before merging, mark it to be queued
+					int	n;
+					do {
+						n = s-SharedOne;
+						if (n < 0 && (n & Merged) == 0)
+							n |= Queued;
+					} while (!shared.compare_exchange_weak(s, n, std::memory_order_acq_rel, std::memory_order_relaxed));
+					if (n == Merged)
+						delete this;
+					else if ((n & ~s) & Queued)
+						handOff();	// The owner counted the reference this thread released
+				}
+			}
+	static void	collect();	// Merge the objects that other threads have queued for this one.
+					// The owner's last release of any object does this too
+	virtual void	share()		// Call from the owning thread before another thread may take a reference
+			{
+				if (owner.load(std::memory_order_relaxed) != currentThread())
+					return;		// Already shared, or only the owner can share it
+				int	n = biased.load(std::memory_order_relaxed);
+				owner.store(0, std::memory_order_relaxed);
+				biased.store(0, std::memory_order_relaxed);
+				shared.fetch_add(n*SharedOne | Merged, std::memory_order_acq_rel);
+			}
+	bool		isMerged() const	// Have the counts merged, so it may be used from any thread?
+			{ return owner.load(std::memory_order_relaxed) == 0; }
+	void		makeImmortal()	// Call before any other thread can see it. It will never be deleted
+			{ owner.store(Immortal, std::memory_order_relaxed); }
+	bool		isImmortal() const
+			{ return owner.load(std::memory_order_relaxed) == Immortal; }
 			// Only for debugging, may be instantly stale unless == 1:
-	int		GetRefCount() volatile const { return (int)ref_count; }
+	int		GetRefCount() volatile const
+			{
+				if (owner.load(std::memory_order_relaxed) == Immortal)
+					return INT_MAX;		// Always shared, so never changed in place
+				int	s = shared.load(std::memory_order_relaxed);
+				return biased.load(std::memory_order_relaxed) + (s & ~(Merged|Queued))/SharedOne;
+			}
+
+	static const uint32_t	Detached = ~(uint32_t)1;	// The number of a thread that has ended. Owns nothing
+
+private:
+	// The shared count is kept in units of SharedOne, and may be negative until merged.
+	// Queued is set while the object waits for its owner to merge it, and keeps it from being deleted.
+	enum { Merged = 1, Queued = 2, SharedOne = 4 };
+	static const uint32_t	Immortal = ~(uint32_t)0;	// The owner of an immortal object. Not a thread number
 
-protected:
-        std::atomic<int>	ref_count;
+	std::atomic<uint32_t>	owner;		// Owning thread, zero once the counts have merged, or Immortal
+	std::atomic<int>	biased;		// Changed only by the owner, so loads and stores suffice
+	std::atomic<int>	shared;		// Count by other threads, and the Merged and Queued flags
+
+	void		merge()		// The owner has released its last reference
+			{
+				owner.store(0, std::memory_order_relaxed);
+				if (shared.fetch_or(Merged, std::memory_order_acq_rel) == 0)
+					delete this;	// No other thread has a reference, and it's not queued
+			}
+	void		handOff();		// Queue this for its owner, or merge it if the owner has ended
+	bool		mergeQueued();		// Merge a queued object, and say if it's unused. Only for the owner's thread
+	friend void	RefCountMergeQueue(RefCountNode* node);
+
+	// A small number for each thread, assigned on first use. Zero is never used.
+	static uint32_t	currentThread()
+			{
+				uint32_t	id = RefCountCurrent().id;
+				return id ? id : RefCountThreadStart();
+			}
 };
 
 template <class T>
@@ -33,6 +203,7 @@ public:
 			Ref() : ptr(0) {}
 			Ref(T* o) { if (o) o->AddRef(); ptr = o; }
 			Ref(const Ref& other) { T* o = other; if (o) o->AddRef(); ptr = o; }
+			Ref(Ref&& other) : ptr(other.ptr) { other.ptr = 0; }	// Take the reference, with no atomic operation
 	Ref&		operator=(const Ref& other)
 			{
 				T*      o = other;
@@ -44,6 +215,18 @@ public:
 					old->Release();
 				return *this;
 			}
+	Ref&		operator=(Ref&& other)
+			{
+				if (this != &other)
+				{
+					T*      old = ptr;
+					ptr = other.ptr;
+					other.ptr = 0;
+					if (old)
+						old->Release();
+				}
+				return *this;
+			}
 	Ref&		operator=(T* other)
 			{
 				if (other)
@@ -56,6 +239,7 @@ public:
 			}
 
 			operator T*() const { return ptr; }
+	Ref&&		pass() { return static_cast<Ref&&>(*this); }	// Pass our reference on, leaving this null
 	T*		operator->() const { return ptr; }
 	T&		operator*() const { return *ptr; }
 
@@ -84,8 +268,23 @@ public:
 				T*      o = (T*)ptr;
 				return o ? o->GetRefCount() : 0;
 			}
+	void		share() const	// Allow other threads to take references (see RefCounted::share)
+			{
+				if (ptr)
+					ptr->share();
+			}
 };
 
+// Share anything that has share(), such as the elements of a container. Do nothing for other types.
+template<typename T>
+inline auto	RefShare(const T& value, int) -> decltype(value.share(), void())
+{ value.share(); }
+template<typename T>
+inline void	RefShare(const T&, long) {}
+template<typename T>
+inline void	RefShare(const T& value)
+{ RefShare(value, 0); }
+
 template<class T>
 inline bool
 operator==(const Ref<T>& r1, const Ref<T>& r2)
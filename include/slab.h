@@ -0,0 +1,166 @@
+#if !defined(SLAB_H)
+#define SLAB_H
+/*
+ * Slab allocation of small blocks, with a cache for each thread.
+ *
+ * A block of up to SlabMaxSize bytes is rounded up to one of SlabClasses
+ * sizes, and carved from a chunk of blocks of that size. Each thread has its
+ * own chunks and free lists, so allocation and freeing by one thread needs no
+ * lock or atomic operation. A block freed by another thread is pushed onto an
+ * atomic list, which the owning thread collects when its own list runs out.
+ *
+ * When a thread ends, its cache waits for a new thread to adopt it, so chunks
+ * are never returned to the system. Larger blocks come from malloc, so the
+ * size must be passed to SlabFree to say which kind of block it is.
+ *
+ * While a SlabArena is open, this thread's small blocks are instead taken in
+ * sequence from the arena's chunks, and freeing them only counts them. Each
+ * chunk is released when the arena has closed and all its blocks are freed.
+ *
+ * When compiled with SLAB_ALLOC, RefCounted objects and ArrayBody data use this.
+ * The library and all code using it must agree on that, or a block may be freed
+ * by the wrong allocator, so refcount.h makes a disagreement fail to link.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<cstddef>
+#include	<cstdlib>
+#include	<cstdint>
+#include	<atomic>
+
+const size_t	SlabChunkSize = 65536;	// Chunks are aligned to their size, so a block can find its chunk
+const size_t	SlabChunkHeader = 64;	// Bytes before the first block in a chunk
+const size_t	SlabMaxSize = 4096;	// Larger blocks come from malloc
+const int	SlabClasses = 32;
+
+struct	SlabArena;
+struct	SlabArenaChunk;
+
+struct	SlabBlock
+{
+	SlabBlock*	next;
+};
+
+struct	SlabCache			// The free lists of one thread
+{
+	SlabBlock*		free[SlabClasses];	// Blocks freed by the owning thread
+	std::atomic<SlabBlock*>	remote[SlabClasses];	// Blocks freed by other threads
+	size_t			allocations;		// How many blocks this cache has allocated
+	SlabCache*		next_abandoned;		// Caches of threads that have ended
+	SlabArena*		arena;			// The innermost open arena, if any
+	SlabArenaChunk*		spare_chunks;		// Arena chunks to reuse
+	int			num_spare_chunks;
+
+	SlabBlock*		refill(int size_class);	// Collect remote frees or carve a new chunk
+};
+
+struct	SlabChunk			// At the start of every chunk
+{
+	SlabCache*	cache;		// The cache whose blocks these are, or null in an arena chunk
+	int		size_class;	// SlabArenaClass in an arena chunk
+};
+
+const int	SlabArenaClass = -2;
+const int	SlabMaxSpareChunks = 16;	// Arena chunks each thread keeps for reuse
+
+struct	SlabArenaChunk : SlabChunk
+{
+	SlabCache*		owner;		// The cache of the thread whose arena this is
+	std::atomic<bool>	open;		// Is the arena still counting frees by its owner?
+	long			allocated;	// Blocks allocated here, counted by the owner
+	long			freed;		// Blocks freed here by the owner while the arena was open
+	std::atomic<long>	remaining;	// Blocks still to be freed, less the owner's uncounted allocations
+	SlabArenaChunk*		next;		// The arena's previous chunk
+};
+
+struct	SlabArena
+{
+	char*		next;		// Free space in the current chunk
+	char*		end;
+	SlabArenaChunk*	chunks;		// The current chunk, and the earlier ones
+	SlabArena*	outer;		// The arena that was open when this one opened
+
+	void*		allocate(size_t bytes)
+			{
+				bytes = (bytes+15) & ~(size_t)15;
+				if ((size_t)(end-next) < bytes)
+					newChunk();
+				void*	mem = next;
+				next += bytes;
+				chunks->allocated++;
+				return mem;
+			}
+	void		newChunk();
+};
+
+// Sizes are multiples of 16 up to 256, then four sizes in each power of two
+inline int	SlabSizeClass(size_t bytes)
+{
+	if (bytes <= 256)
+		return bytes ? (int)(bytes-1)/16 : 0;
+	size_t		n = bytes-1;
+	int		shift = 8;
+	while ((n >> shift) > 1)
+		shift++;
+	return 16 + (shift-8)*4 + (int)((n >> (shift-2)) & 3);
+}
+
+inline size_t	SlabClassSize(int size_class)
+{
+	if (size_class < 16)
+		return (size_class+1)*16;
+	int		shift = 8 + (size_class-16)/4;
+	return ((size_t)1 << shift) + ((size_t)((size_class-16)%4 + 1) << (shift-2));
+}
+
+inline SlabChunk* SlabChunkOf(void* mem)
+{ return (SlabChunk*)((uintptr_t)mem & ~(uintptr_t)(SlabChunkSize-1)); }
+
+inline SlabCache*& SlabCurrentCache()	// Null until this thread first allocates
+{
+	static thread_local SlabCache*	cache;
+	return cache;
+}
+
+SlabCache*	SlabThreadCache();		// This thread's cache, adopted or made on first use
+void*		SlabAllocateLarge(size_t bytes);
+void		SlabFreeElsewhere(void* mem);	// An arena block, or one that belongs to another thread
+size_t		SlabAllocations();		// How many blocks this thread has allocated
+void		SlabArenaOpen(SlabArena* arena);	// Allocate from this arena until it's closed
+long		SlabArenaClose(SlabArena* arena);	// Returns how many of its blocks are still in use
+long		SlabArenaLive(const SlabArena* arena);	// How many of its blocks are in use
+
+inline void*	SlabAllocate(size_t bytes)
+{
+	if (bytes > SlabMaxSize)
+		return SlabAllocateLarge(bytes);
+	SlabCache*	cache = SlabCurrentCache();
+	if (!cache)
+		cache = SlabThreadCache();
+	cache->allocations++;
+	if (cache->arena)
+		return cache->arena->allocate(bytes);
+	int		size_class = SlabSizeClass(bytes);
+	SlabBlock*	block = cache->free[size_class];
+	if (!block)
+		block = cache->refill(size_class);
+	cache->free[size_class] = block->next;
+	return block;
+}
+
+inline void	SlabFree(void* mem, size_t bytes)	// bytes as allocated
+{
+	if (!mem)
+		return;
+	if (bytes > SlabMaxSize)
+		return free(mem);
+	SlabChunk*	chunk = SlabChunkOf(mem);
+	SlabCache*	cache = chunk->cache;
+	if (!cache || cache != SlabCurrentCache())
+		return SlabFreeElsewhere(mem);
+	SlabBlock*	block = (SlabBlock*)mem;
+	block->next = cache->free[chunk->size_class];
+	cache->free[chunk->size_class] = block;
+}
+
+#endif	// SLAB_H
@@ -1,89 +1,323 @@
 #if !defined(STRFORMAT_H)
 #define STRFORMAT_H
+/*
+ * printf-style formatting of a VariantArray.
+ *
+ * A StrFormat parses its format string once, into slices of literal text
+ * each followed by a conversion, so it can be applied to many argument lists.
+ * Each application sizes its output buffer once, beforehand.
+ *
+ * A conversion is %[n$][flags][width][.precision]c where:
+ * - n$ selects argument n (from 1), instead of the next one
+ * - the flags are '-' (left justify) or '0' (pad numbers with zeroes)
+ * - width and precision are decimal numbers, or '*' to take the next argument
+ * - c is s (string, precision is the maximum characters), c (character),
+ *   d, i or u (decimal), x or X (hexadecimal), o (octal), or % for itself.
+ *   Precision of a number is the minimum number of digits.
+ * Widths are measured in characters, not bytes. An argument that doesn't suit
+ * its conversion is shown as JSON.
+ * REVISIT: f, e and g await a floating point Variant, and are literal text till then.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
 
-template<typename Index>
-StrVal	StrValI<Index>::format(StrVal f, VariantArray args)
+class	StrFormat
 {
-	StrVal	result;		// Output string
-	int	size, prec;	// Size and precision
-	bool	leading_zeroes;	// Whether to pad with leading zeroes
-	int	d;		// A digit
-	int	a = 0;		// Arg index
-	int	numbered_arg;
-
-	Index	m = f.length();
-	for (Index i = 0; i < m; i++)
+public:
+	StrFormat(StrVal f)
+			: format(f)
+			{ parse(); }
+
+	StrVal		apply(const VariantArray& args) const
+			{
+				StrBuilder	result;
+				appendTo(result, args);
+				return result.take();
+			}
+	StrVal		operator()(const VariantArray& args) const
+			{ return apply(args); }
+
+	void		appendTo(StrBuilder& out, const VariantArray& args) const
+			{
+				StrValIndex	bytes;
+				const char*	fp = format.asUTF8(bytes);
+
+				out.reserve(maxLength(args));
+				int		next_arg = 0;
+				for (int i = 0; i < specs.length(); i++)
+				{
+					const Spec&	spec = specs.elem_ref(i);
+					out.appendBytes(fp+spec.literal_start, spec.literal_bytes);
+					if (!spec.conversion)
+						continue;
+
+					int		width = spec.width;
+					int		precision = spec.precision;
+					bool		left = spec.left_justify;
+					if (width == Star)
+					{
+						width = intArg(args, next_arg++);
+						if (width < 0)
+						{		// A negative width means left-justify, as in printf
+							left = true;
+							width = -width;
+						}
+					}
+					if (precision == Star && (precision = intArg(args, next_arg++)) < 0)
+						precision = None;
+					int		arg = spec.arg >= 0 ? spec.arg : next_arg++;
+					if (arg >= args.length())
+						continue;	// Missing argument
+					convert(out, spec, width, precision, left, args.elem_ref(arg));
+				}
+			}
+
+private:
+	enum { None = -1, Star = -2 };	// Special values of width, precision and arg
+
+	struct Spec
 	{
-		UCS4	c = f[i];
-		if (c != '%' || i == m-1)
-		{
-			result += c;
-			continue;
-		}
-		c = f[++i];	// Skip the %
-
-		if (i+2 < m && (d = Digit(c, 10)) > 0 && f[i+1] == '$')
-		{		// Extract the argument sequence digit
-			numbered_arg = d;
-			i += 2;
-			c = f[++i];	// Skip ASD
-		}
-
-		// Get the size
-		size = 0;
-		leading_zeroes = false;
-		if (c == '*')
-			size = -1;
-		else if ((d = Digit(c, 10)) >= 0)
-		{
-			if (d == 0)
-				leading_zeroes = true;
-			size = d;
-			while (i < m && (d = Digit(c = f[++i], 10)) >= 0)
-				size = size*10 + d;
-		}
-
-		// Get the precision
-		prec = 0;
-		if (i < m && f[i] == '.')	// REVISIT: assert(f[i] == c)
-		{
-			c = f[++i];
-			if (c == '*')
-				prec = -1;
-			else if ((d = Digit(c, 10)) >= 0)
+		uint32_t	literal_start;	// Byte offset of the literal text before this conversion
+		uint32_t	literal_bytes;
+		char		conversion;	// 0 if there's only literal text
+		bool		left_justify;
+		bool		zero_pad;
+		int		width;		// None, Star, or the minimum characters
+		int		precision;	// None, Star, or the precision
+		int		arg;		// Argument index, or None to use the next
+	};
+
+	StrVal		format;
+	Array<Spec>	specs;
+
+	void		parse()
+			{
+				StrValIndex	bytes;
+				const char*	fp = format.asUTF8(bytes);
+				const char*	ep = fp+bytes;
+				const char*	lp = fp;		// Start of the literal text
+				for (const char* cp = fp; cp < ep; )
+				{
+					if (*cp++ != '%' || cp == ep)
+						continue;
+					Spec		spec = { (uint32_t)(lp-fp), (uint32_t)(cp-1-lp), 0, false, false, None, None, None };
+					if (*cp == '%')
+					{		// Include the '%' in the literal text
+						spec.literal_bytes++;
+						specs += spec;
+						lp = ++cp;
+						continue;
+					}
+
+					const char*	np = cp;
+					int		n = number(np, ep);
+					if (n > 0 && np < ep && *np == '$')
+					{		// A numbered argument
+						spec.arg = n-1;
+						cp = np+1;
+					}
+					for (; cp < ep && (*cp == '-' || *cp == '0'); cp++)
+						if (*cp == '-')
+							spec.left_justify = true;
+						else
+							spec.zero_pad = true;
+					if (cp < ep && *cp == '*')
+					{
+						spec.width = Star;
+						cp++;
+					}
+					else
+						spec.width = number(cp, ep);
+					if (cp < ep && *cp == '.')
+					{
+						if (++cp < ep && *cp == '*')
+						{
+							spec.precision = Star;
+							cp++;
+						}
+						else if ((spec.precision = number(cp, ep)) == None)
+							spec.precision = 0;
+					}
+					if (cp == ep || !strchr("scdiuxXo", *cp))
+						continue;	// Not a conversion, so it's literal text
+					spec.conversion = *cp++;
+					specs += spec;
+					lp = cp;
+				}
+				Spec		tail = { (uint32_t)(lp-fp), (uint32_t)(ep-lp), 0, false, false, None, None, None };
+				if (tail.literal_bytes > 0)
+					specs += tail;
+			}
+
+	static int	number(const char*& cp, const char* ep)	// None if there are no digits
+			{
+				if (cp == ep || *cp < '0' || *cp > '9')
+					return None;
+				int		n = 0;
+				while (cp < ep && *cp >= '0' && *cp <= '9' && n < 100000000)
+					n = n*10 + (*cp++ - '0');
+				return n;
+			}
+
+	static bool	isInteger(const Variant& v)
 			{
-				prec = d;
-				while (i < m && (d = Digit(c = f[++i], 10)) >= 0)
-					prec = prec*10 + d;
+				return v.type() == Variant::Integer || v.type() == Variant::Long || v.type() == Variant::LongLong;
 			}
-		}
-
-		if (size == -1)
-			size = args[a++].as_int();
-		if (prec == -1)
-			prec = args[a++].as_int();
-
-		// Get the conversion character
-		switch (c)
-		{
-		case 's':
-			// REVISIT: Handle size and prec
-			result += args[a++].as_strval();
-			break;
-
-		case 'd':
-		case 'f':
-		case 'g':
-			// REVISIT: Handle size and prec
-			result += args[a++].as_json();
-			break;
-
-		default:
-			break;
-		}
-	}
-
-	return result;
+
+	static int64_t	integer(const Variant& v)
+			{
+				switch (v.type())
+				{
+				case Variant::Integer:	return v.as_int();
+				case Variant::Long:	return v.as_long();
+				case Variant::LongLong:	return v.as_longlong();
+				default:		return 0;
+				}
+			}
+
+	static int	intArg(const VariantArray& args, int arg)
+			{ return arg < args.length() ? (int)integer(args.elem_ref(arg)) : 0; }
+
+	// An upper bound on the bytes needed for these arguments, except that a container's JSON is estimated
+	size_t		maxLength(const VariantArray& args) const
+			{
+				size_t		length = 0;
+				int		next_arg = 0;
+				for (int i = 0; i < specs.length(); i++)
+				{
+					const Spec&	spec = specs.elem_ref(i);
+					length += spec.literal_bytes;
+					if (!spec.conversion)
+						continue;
+					int		width = spec.width;
+					int		precision = spec.precision;
+					if (width == Star)
+						width = intArg(args, next_arg++);
+					if (precision == Star)
+						precision = intArg(args, next_arg++);
+					length += width < 0 ? -(size_t)width : width;
+					if (precision > 0)
+						length += precision;
+					int		arg = spec.arg >= 0 ? spec.arg : next_arg++;
+					if (arg >= args.length())
+						continue;
+					const Variant&	v = args.elem_ref(arg);
+					if (v.type() != Variant::String)
+						length += UTF8MaxInteger + 2;		// Enough for a number
+					else if (spec.conversion == 's' || spec.conversion == 'c')
+						length += v.as_strval().numBytes();
+					else
+						length += v.as_strval().jsonBytes() + 2;	// Quoted as JSON
+				}
+				return length;
+			}
+
+	// Append text, padded to the width
+	static void	pad(StrBuilder& out, const char* cp, size_t bytes, int chars, int width, bool left)
+			{
+				if (!left)
+					for (; chars < width; chars++)
+						out.appendChar(' ');
+				out.appendBytes(cp, bytes);
+				if (left)
+					for (; chars < width; chars++)
+						out.appendChar(' ');
+			}
+
+	static void	convert(StrBuilder& out, const Spec& spec, int width, int precision, bool left, const Variant& v)
+			{
+				int		radix = 10;
+				bool		upper = false;
+				switch (spec.conversion)
+				{
+				case 's':
+				{
+					if (v.type() != Variant::String)
+						break;
+					StrVal		s = v.as_strval();
+					if (precision >= 0 && precision < s.length())
+						s = s.substr(0, precision);
+					StrValIndex	bytes;
+					const char*	cp = s.asUTF8(bytes);
+					return pad(out, cp, bytes, s.length(), width, left);
+				}
+
+				case 'c':
+				{
+					UCS4		ch = isInteger(v) ? (UCS4)integer(v)
+							: v.type() == Variant::String && v.as_strval().length() > 0 ? v.as_strval()[0]
+							: 0;
+					char		buf[7];
+					char*		cp = buf;
+					UTF8Put(cp, ch);
+					return pad(out, buf, cp-buf, 1, width, left);
+				}
+
+				case 'X':	upper = true;	// FALL THROUGH
+				case 'x':	radix = 16; goto number;
+				case 'o':	radix = 8; goto number;
+				case 'd': case 'i': case 'u':
+				number:
+				{
+					if (!isInteger(v))
+						break;
+					int64_t		i = integer(v);
+					bool		negative = i < 0 && radix == 10 && spec.conversion != 'u';
+					uint64_t	magnitude = negative ? 0-(uint64_t)i : (uint64_t)i;
+					char		digits[UTF8MaxInteger+2];
+					char*		dp = digits;	// The digits are from dp to ep
+					char*		ep = digits;
+					if (radix == 10)
+						UTF8PutInteger(ep, magnitude);
+					else
+					{
+						const char*	hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+						dp = ep = digits+sizeof(digits);
+						do {
+							*--dp = hex[magnitude % radix];
+							magnitude /= radix;
+						} while (magnitude);
+					}
+					int		num_digits = ep-dp;
+					int		zeroes = precision > num_digits ? precision-num_digits : 0;
+					int		total = negative + zeroes + num_digits;
+					if (spec.zero_pad && !left && precision < 0 && width > total)
+					{		// Pad with zeroes after any sign
+						zeroes += width-total;
+						total = width;
+					}
+					if (!left)
+						for (; total < width; total++)
+							out.appendChar(' ');
+					if (negative)
+						out.appendChar('-');
+					for (int z = 0; z < zeroes; z++)
+						out.appendChar('0');
+					out.appendBytes(dp, num_digits);
+					if (left)
+						for (; total < width; total++)
+							out.appendChar(' ');
+					return;
+				}
+
+				default:
+					return;
+				}
+
+				// The argument doesn't suit the conversion, so use its JSON form:
+				StrBuilder	json;
+				v.append_json(json);
+				StrVal		s = json.take();
+				StrValIndex	bytes;
+				const char*	cp = s.asUTF8(bytes);
+				pad(out, cp, bytes, s.length(), width, left);
+			}
+};
+
+template<typename Index>
+StrVal	StrValI<Index>::format(StrVal f, VariantArray args)
+{
+	return StrFormat(f).apply(args);
 }
 
 #endif // STRFORMAT_H
@@ -0,0 +1,38 @@
+#if !defined(STRINTERN_H)
+#define STRINTERN_H
+/*
+ * Interned strings.
+ *
+ * StrIntern keeps one canonical StrVal for each distinct string it's given,
+ * so strings that are used over and over share one Body. Interned StrVals
+ * compare equal by Body identity, and two different interned StrVals of the
+ * same length are known to differ without looking at the data.
+ *
+ * There's a single thread-safe table for the process. Strings stay in it
+ * until purge() finds that nothing else refers to them. If a limit is set,
+ * the table purges itself when it fills up, and when it's still full, new
+ * strings are returned without being interned.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strval.h>
+
+class	StrIntern
+{
+public:
+	static StrVal	intern(const char* data, size_t bytes);	// The canonical StrVal for these bytes
+	static StrVal	intern(const StrVal& s)
+			{
+				if (s.isInterned())
+					return s;
+				StrValIndex	bytes;
+				const char*	cp = s.asUTF8(bytes);
+				return intern(cp, bytes);
+			}
+
+	static size_t	size();				// How many strings are interned?
+	static size_t	purge();			// Drop strings that are used nowhere else, return how many
+	static void	setLimit(size_t max_strings);	// Zero (the default) means no limit
+};
+
+#endif	// STRINTERN_H
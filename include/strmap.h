@@ -0,0 +1,87 @@
+#if !defined(STRMAP_H)
+#define STRMAP_H
+/*
+ * Strings on memory-mapped files.
+ *
+ * StrMapFile maps a file read-only and returns a StrVal of its contents,
+ * without copying them. The mapping belongs to a StrMappedBodyI, so slices
+ * share it, and it's unmapped when the last of them goes. Anything that reads
+ * a const char* (Pegexp, Peg sources, rx) can use asUTF8() of the whole file,
+ * which is followed by a NUL in the mapping. Changing a mapped string copies it.
+ *
+ * The characters are counted when the StrVal is made, which reads the file
+ * through once. The file must be no larger than the Index allows (4GB with
+ * 32-bit indices), and must not be truncated while it's mapped.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strval.h>
+#include	<error.h>
+
+typedef enum {
+	StrMapNormal,		// No special treatment
+	StrMapSequential,	// Read in order, so read ahead aggressively and drop pages soon after use
+	StrMapRandom,		// Read in no particular order, so don't read ahead
+	StrMapWillNeed,		// Will be needed soon, so start reading it in
+	StrMapDontNeed		// Not needed for now. The pages may be dropped, and read again if needed
+} StrMapAdvice;
+
+// Map a regular file read-only, with at least one zero byte after its data.
+// Sets data to 0 for an empty file. Files of more than max_bytes fail with EFBIG.
+ErrNum		StrMapRegion(const char* path, size_t max_bytes, const char*& data, size_t& bytes, size_t& mapped_bytes);
+void		StrUnmapRegion(const char* data, size_t mapped_bytes);
+ErrNum		StrAdviseRegion(const char* data, size_t bytes, StrMapAdvice advice);	// Rounded out to whole pages
+
+template<typename Index>
+class StrMappedBodyI
+: public StrBodyI<Index>
+{
+	using Body = StrBodyI<Index>;
+public:
+	~StrMappedBodyI()
+			{ StrUnmapRegion(this->start, mapped_bytes); }
+	StrMappedBodyI(const char* data, size_t bytes, size_t mapped)
+			: mapped_bytes(mapped)
+			{
+				this->start = (char*)data;
+				this->num_elements = Body::checkBytes(bytes)+1;	// Including the NUL that follows
+				this->is_mapped = true;
+			}
+
+private:
+	size_t		mapped_bytes;	// Including the pages of zeroes after the data
+};
+typedef	StrMappedBodyI<>	StrMappedBody;
+
+// Map the file and return its contents. On failure, return an empty string and set *err_return.
+template<typename Index = StrValIndex>
+StrValI<Index>	StrMapFile(const char* path, ErrNum* err_return = 0, StrMapAdvice advice = StrMapNormal)
+{
+	const char*	data;
+	size_t		bytes;
+	size_t		mapped_bytes;
+	ErrNum		e = StrMapRegion(path, StrBodyI<Index>::maxLength()-1, data, bytes, mapped_bytes);
+	if (err_return)
+		*err_return = e;
+	if (e || bytes == 0)
+		return StrValI<Index>();
+
+	StrAdviseRegion(data, bytes, StrMapSequential);	// Counting the characters reads it through
+	StrValI<Index>	s(new StrMappedBodyI<Index>(data, bytes, mapped_bytes));
+	if (advice != StrMapSequential)
+		StrAdviseRegion(data, bytes, advice);
+	return s;
+}
+
+// Advise the system how the mapped pages under this string will be used. Strings not on a mapped file are ignored.
+template<typename Index>
+ErrNum		StrMapAdvise(const StrValI<Index>& s, StrMapAdvice advice)
+{
+	if (!s.isMapped())
+		return ErrNum();
+	Index		bytes;
+	const char*	data = s.asUTF8(bytes);
+	return StrAdviseRegion(data, bytes, advice);
+}
+
+#endif	// STRMAP_H
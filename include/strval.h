@@ -20,17 +20,42 @@
 #include	<cstdlib>
 #include	<cstdint>
 #include	<cstring>
+#include	<atomic>
 #include	<functional>
 #include	<type_traits>
+#include	<utility>
 
 #include	<error.h>
 #include	<array.h>
 #include	<refcount.h>
+#include	<arena.h>
 #include	<char_encoding.h>
+#include	<utf8_scan.h>
+#include	<utf8_number.h>
+#include	<charset.h>
 
-#define	StrValIndexBits	32
+#if	!defined(StrValIndexBits)
+#define	StrValIndexBits	32		// Define as 16 for compact strings of up to 65534 bytes
+#endif
 typedef typename std::conditional<(StrValIndexBits <= 16), uint16_t, uint32_t>::type StrValIndex;
-const	StrValIndex	StrValIndexRawBinaryMarker = ((StrValIndex)-1);	// Marker num_chars for non-UTF8 data
+
+// Strings of up to this many bytes are stored inside a StrVal, not in a Body.
+// With 16-bit indices it's StrValInlineMax-4, so the StrVal is 8 bytes smaller.
+#define	StrValInlineMax	14
+
+// Large non-ASCII bodies index the byte offset of every StrBodyCheckpointInterval'th character
+#if	!defined(StrBodyCheckpointInterval)
+#define	StrBodyCheckpointInterval	64
+#endif
+
+// Concatenations of at least StrRopeThreshold bytes make a rope, not a copy. Shorter leaves get merged.
+#if	!defined(StrRopeThreshold)
+#define	StrRopeThreshold	1024
+#endif
+#if	!defined(StrRopeLeafMax)
+#define	StrRopeLeafMax		256
+#endif
+const	StrValIndex	StrValIndexRawBinaryMarker = ((StrValIndex)-1);	// Marker num_chars for non-UTF8 data (see StrBodyI::RawBinaryMarker)
 typedef enum {
 	StrStatic,		// UTF-8 data that's not owned by the Body, may not be NUL-terminated and will not alter
 	StrUTF8,		// UTF-8 data that is allocated internally
@@ -54,6 +79,9 @@ template<typename Index = StrValIndex> struct StrBookmark
 	Index		byte_num;
 };
 template<typename Index = StrValIndex> class StrBodyI;
+template<typename Index = StrValIndex> class StrRopeI;
+template<typename Index = StrValIndex> class StrMappedBodyI;
+class	StrIntern;
 
 typedef	StrValI<>	StrVal;
 typedef	StrRefI<>	StrRef;
@@ -61,6 +89,131 @@ typedef	StrBodyI<>	StrBody;
 class	Variant;
 typedef	Array<Variant>	VariantArray;
 
+/*
+ * A StrVal of a string literal, neither copied nor counted at run time:
+ *	StrVal	greeting = StrValLiteral("Hello, world");
+ * The characters are counted at compile time, and the Body is made on first use
+ * and never freed, so copies of it share it without counting references.
+ * The literal must be valid UTF-8.
+ */
+#define	StrValLiteral(text)	\
+	([]() -> StrVal {	\
+		static constexpr size_t	chars = StrLiteralChars("" text, sizeof(text)-1);	\
+		static StrBody*		body = StrBody::literal(text, sizeof(text)-1, chars);	\
+		return StrVal(body);	\
+	}())
+
+// Count the characters in UTF-8 data, at compile time for a literal. Every byte but a continuation byte starts one:
+constexpr size_t
+StrLiteralChars(const char* data, size_t bytes)
+{
+	return bytes == 0 ? 0
+		: bytes == 1 ? ((data[0] & 0xC0) != 0x80)
+		: StrLiteralChars(data, bytes/2) + StrLiteralChars(data+bytes/2, bytes-bytes/2);	// Only log2(bytes) deep
+}
+
+/*
+ * A StrSink collects the output of a streaming transform. Characters and bytes
+ * are appended directly into a growing buffer, which the Body adopts as its data
+ * when the transform is done.
+ */
+class	StrSink
+{
+public:
+	~StrSink()	{ ArrayBody<char>::deleteElements(buf, limit-buf+1); }
+	StrSink(bool raw = false, size_t expected = 0)
+			: buf(0), op(0), limit(0), raw_binary(raw)
+			{ if (expected) grow(expected); }
+
+	size_t		length() const { return op-buf; }
+	void		appendChar(UCS4 ch)		// Append a character, as UTF-8 unless the data is raw binary
+			{
+				room(6);
+				if (raw_binary)
+					*op++ = ch;
+				else
+					UTF8Put(op, ch);
+			}
+	void		appendBytes(const char* data, size_t bytes)
+			{
+				room(bytes);
+				memcpy(op, data, bytes);
+				op += bytes;
+			}
+	void		append(const char* s)
+			{ appendBytes(s, strlen(s)); }
+	template<typename Index>
+	void		append(const StrValI<Index>& s)
+			{
+				Index		bytes;
+				const char*	cp = s.asUTF8(bytes);
+				appendBytes(cp, bytes);
+			}
+	void		appendInt(long long value)	// Append in decimal
+			{
+				room(UTF8MaxInteger);
+				UTF8PutInteger(op, value < 0 ? 0-(unsigned long long)value : value, value < 0);
+			}
+	void		appendDouble(double value)	// Append the shortest form that converts back exactly
+			{
+				room(UTF8MaxDouble);
+				UTF8PutDouble(op, value);
+			}
+
+	// To write directly, reserve space for up to bytes, then commit to where the writing ended
+	char*		reserve(size_t bytes)
+			{ room(bytes); return op; }
+	void		commit(char* end)
+			{ assert(end >= op && end <= limit); op = end; }
+
+private:
+	template<typename Index> friend class StrBodyI;
+	friend class	StrBuilder;
+	char*		buf;		// Allocated as ArrayBody elements, and adopted by the Body
+	char*		op;		// Where the next byte goes
+	char*		limit;		// End of the allocation, less one byte for a NUL
+	bool		raw_binary;
+
+	StrSink(const StrSink&) = delete;
+	StrSink& operator=(const StrSink&) = delete;
+
+	void		room(size_t bytes)
+			{ if ((size_t)(limit-op) < bytes) grow(bytes); }
+	void		grow(size_t bytes)
+			{
+				size_t	used = op-buf;
+				size_t	size = (limit-buf)*2;
+				if (size < used+bytes)
+					size = used+bytes;
+				char*	newbuf = ArrayBody<char>::newElements(size+1);
+				if (used)
+					memcpy(newbuf, buf, used);
+				ArrayBody<char>::deleteElements(buf, limit-buf+1);
+				buf = newbuf;
+				op = buf+used;
+				limit = buf+size;
+			}
+};
+
+/*
+ * Build a string piece by piece, growing the buffer geometrically, and take()
+ * the result. The buffer becomes the data of the new Body without being copied.
+ */
+class	StrBuilder
+: public StrSink
+{
+public:
+	StrBuilder(size_t expected = 0) : StrSink(false, expected) {}
+
+	StrBuilder&	operator+=(UCS4 ch) { appendChar(ch); return *this; }
+	StrBuilder&	operator+=(const char* s) { append(s); return *this; }
+	template<typename Index>
+	StrBuilder&	operator+=(const StrValI<Index>& s) { append(s); return *this; }
+
+	void		clear() { op = buf; }
+	StrVal		take();				// Return what was built, and start again
+};
+
 template<typename Index> class StrBodyI
 : public ArrayBody<char, Index>
 {
@@ -70,31 +223,92 @@ template<typename Index> class StrBodyI
 	using Body::num_elements;
 	using Body::start;
 	using Body::num_alloc;
-	using Body::ref_count;
+	using Body::inline_data;
 
 public:
 	static	StrBodyI nullBody;
+	static	Index	checkpoint_threshold;	// Bodies of fewer bytes don't build a checkpoint index
+	static const Index	RawBinaryMarker = (Index)-1;	// Marker num_chars for non-UTF8 data
+
+	static Index	checkBytes(size_t bytes)	// Throw std::length_error unless the bytes and a NUL fit in an Index
+			{ return Body::checkLength(bytes+1)-1; }
 
-	~StrBodyI()	{}
-	StrBodyI()	: num_chars(0) {}
+	~StrBodyI()	{ delete[] checkpoints.load(); }
+	StrBodyI()	: num_chars(0), is_ascii(false), is_rope(false), is_interned(false), is_mapped(false), checkpoints(0), hash_code(0) {}
 	StrBodyI(const char* data, StrDataType dt, Index length = 0, Index allocate = 0)
-			: Body(data, dt != StrStatic, (length == 0 ? strlen(data) : length)+1, allocate)
+			: Body(data, dt != StrStatic, Body::checkLength((length == 0 ? strlen(data) : (size_t)length)+1), allocate)
 			, num_chars(0)
+			, is_ascii(false)
+			, is_rope(false)
+			, is_interned(false)
+			, is_mapped(false)
+			, checkpoints(0)
+			, hash_code(0)
 			{
-				// REVISIT: Need a Panic() function when a string passes the allowed maximum size
-				// assert(num_elements < StrValIndexRawBinaryMarker);
 				if (dt != StrStatic && length != 0)
 					start[num_elements-1] = '\0';	// Perhaps we didn't copy a NUL, so add one
 				if (dt == StrRawBinary)
-					num_chars = StrValIndexRawBinaryMarker;	// one byte = one char, don't count them
+					num_chars = RawBinaryMarker;	// one byte = one char, don't count them
+			}
+
+	// A Body for literal data that's never changed or freed, with chars counted in advance (see StrValLiteral)
+	static StrBodyI* literal(const char* data, size_t length, size_t chars)
+			{
+				ArenaScope::Pause	pause;	// It lasts for the whole process
+				return new StrBodyI(Literal, data, checkBytes(length), chars);
+			}
+
+	// Make a new Body as the constructor would, but with copied data following it in one allocation
+	static StrBodyI* create(const char* data, StrDataType dt, size_t length = 0, size_t allocate = 0)
+			{
+				Index	bytes = checkBytes(length == 0 ? strlen(data) : length);
+				if (dt == StrStatic)
+					return new StrBodyI(data, dt, bytes);	// Borrowed data, not copied
+				allocate = Body::roundAllocation(allocate < (size_t)bytes+1 ? (size_t)bytes+1 : allocate);
+				char*	storage;
+				void*	mem = Body::template allocateBody<StrBodyI>(allocate, storage);
+				StrBodyI*	body = new(mem) StrBodyI(data, dt, bytes, allocate, storage);
+				body->inline_data = storage == Body::template dataFollowing<StrBodyI>(mem);
+				return body;
+			}
+	// The same, but fill(char* data) writes the length bytes of data in place
+	template<typename Fill>
+	static StrBodyI* create(size_t length, StrDataType dt, Fill fill)
+			{
+				Index	allocate = Body::roundAllocation(checkBytes(length)+1);
+				char*	data;
+				void*	mem = Body::template allocateBody<StrBodyI>(allocate, data);
+				fill(data);
+				StrBodyI*	body = new(mem) StrBodyI(data, dt, length, allocate, data);	// Copies the data onto itself
+				body->inline_data = data == Body::template dataFollowing<StrBodyI>(mem);
+				return body;
 			}
 
 	inline bool	isShared() const			// It's not just this StrVal using this Body
-			{ return ref_count > 1; }
+			{ return this->GetRefCount() > 1; }
 	bool		isNulTerminated() const			// If we allocated memory, it's always terminated
 			{ return num_alloc > 0 || start[num_elements-1] == '\0'; }
 	bool		isRawBinary() const
-			{ return num_chars == StrValIndexRawBinaryMarker; }
+			{ return num_chars == RawBinaryMarker; }
+	bool		isASCII()				// Known to contain only 7-bit ASCII
+			{ numChars(); return is_ascii; }
+	bool		isRope() const				// A StrRopeI, with no data of its own
+			{ return is_rope; }
+	bool		isInterned() const			// The canonical Body for its data, from StrIntern
+			{ return is_interned; }
+	bool		isMapped() const			// A read-only file mapping, owned by this Body (see strmap.h)
+			{ return is_mapped; }
+	StrBodyI*	flat();					// This Body, or if it's a rope, a Body with the same data
+	uint64_t	hash()					// Hash of the data (not a rope), computed once while it's unchanged
+			{
+				uint64_t	h = hash_code.load(std::memory_order_relaxed);
+				if (h == 0)
+				{		// Threads sharing this Body all compute the same value
+					h = UTF8Hash(start, start+num_elements-1);
+					hash_code.store(h, std::memory_order_relaxed);
+				}
+				return h;
+			}
 
 	Index		numChars()
 			{
@@ -123,6 +337,15 @@ public:
 				if (char_num > end_char)	// Check char_num is in range.
 					goto bad_offset;
 
+				// Large bodies have an index, which is faster than any bookmark:
+				if (const Index* index = checkpointIndex())
+				{
+					char*	cp = start+index[char_num/StrBodyCheckpointInterval];
+					for (Index n = char_num%StrBodyCheckpointInterval; n > 0; n--)
+						cp += UTF8Len(cp);
+					return cp;
+				}
+
 				char*		up;		// starting pointer for forward search
 				int		start_char;	// starting char number for forward search
 				char*		ep;		// starting pointer for backward search
@@ -181,57 +404,29 @@ private:		// Prevent accidental use of Array insert by outsiders
 public:	void		insertBytes(Index pos, const char* addend, Index len)
 			{
 				Body::insert(pos, addend, len);
-				if (!isRawBinary())
-					num_chars = 0;	// Force a re-count
+				uncount();
 			}
+	/*
+	 * Each character after the given point (and before any stop) is passed to xform,
+	 * which may consume any number of characters (up to ep), appending its output
+	 * to the StrSink. To quit, leaving the remainder untransformed, return without
+	 * advancing cp (but anything appended to the sink is kept). Any callable will
+	 * do, so the compiler can inline the work for each character.
+	 */
+	template<typename Xform, typename = decltype(std::declval<Xform&>()(std::declval<const char*&>(), (const char*)0, std::declval<StrSink&>()))>
+	void		transform(Xform xform, int after = -1);
+	// The same, but xform returns a whole replacement for what it consumed:
 	void		transform(const std::function<Val(const char*& cp, const char* ep)> xform, int after = -1);
+	void		adopt(StrSink& sink);			// Replace our data by what the sink collected
 	void		toLower()
-			{
-				char		one_char[7];
-				bool		nonASCII = false;
-				StrBodyI	temp_body;	// No StrVal reference may have a longer lifetime
-				transform(
-					[&](const char*& cp, const char* ep) -> Val
-					{
-						// REVISIT: Handle StrRawBinary data
-						UCS4	ch = getChar(cp);
-						ch = UCS4ToLower(ch);		// Transform it
-						nonASCII |= !UCS4IsASCII(ch);
-						char*	op = one_char;		// Pack it into our local buffer
-						UTF8Put(op, ch);
-						*op = '\0';
-						// Assign this to the body in our closure
-						temp_body = StrBodyI(one_char, StrStatic, op-one_char);
-						return Val(&temp_body);
-					}
-				);
-				if (!isRawBinary() && nonASCII)	// Need to convert to UTF8 mode
-					num_chars = 0;	// Count the UTF8 bytes we wrote
-			}
+			{ convertCase(false); }
 	void		toUpper()
-			{
-				bool		nonASCII = false;
-				char		one_char[7];
-				StrBodyI	temp_body;	// No StrVal reference may have a longer lifetime
-				transform(
-					[&](const char*& cp, const char* ep) -> Val
-					{
-						UCS4	ch = getChar(cp);
-						ch = UCS4ToUpper(ch);		// Transform it
-						nonASCII |= !UCS4IsASCII(ch);
-						char*	op = one_char;		// Pack it into our local buffer
-						UTF8Put(op, ch);
-						*op = '\0';
-
-						// Assign this to the body in our closure
-						temp_body = StrBodyI(one_char, StrStatic, op-one_char);
-						return Val(&temp_body);
-					}
-				);
-				if (!isRawBinary() && nonASCII)	// Need to convert to UTF8 mode
-					num_chars = 0;	// Count the UTF8 bytes we wrote
-			}
-	void		toJSON();
+			{ convertCase(true); }
+	void		convertCase(bool upper);
+	static char*	convertCaseInPlace(char* cp, const char* ep, bool upper);	// Stops where a character would change length
+	void		toJSON(bool ascii_only = false);
+	// Escape [cp, ep) for a JSON string into op, or if op is null, just count. Returns the output length:
+	static size_t	escapeJSON(char* op, const char* cp, const char* ep, bool raw, bool ascii_only);
 
 	StrBodyI& operator=(const StrBodyI& s1)	 // Assignment operator; ONLY for no-copy bodies
 			{
@@ -239,29 +434,100 @@ public:	void		insertBytes(Index pos, const char* addend, Index len)
 				start = s1.start;
 				this->AddRef();			// Ensure we don't get deleted
 				num_chars = s1.num_chars;
+				is_ascii = s1.is_ascii;
+				delete[] checkpoints.exchange(0);
+				hash_code = 0;
 				num_elements = s1.num_elements;
 				num_alloc = 0;
 				return *this;
 			}
 
 protected:
-	Index		num_chars;	// zero if not yet counted, StrValIndexRawBinaryMarker if locale-8bit
+	enum LiteralTag { Literal };
+	StrBodyI(LiteralTag, const char* data, Index length, Index chars)	// Never freed, so copies needn't count
+			: Body(data, false, length+1)
+			, num_chars(chars)
+			, is_ascii(chars == length)
+			, is_rope(false)
+			, is_interned(false)
+			, is_mapped(false)
+			, checkpoints(0)
+			, hash_code(0)
+			{
+				this->makeImmortal();
+			}
+	StrBodyI(const char* data, StrDataType dt, Index length, Index allocate, char* storage)	// Used by create()
+			: Body(data, length, allocate, storage)
+			, num_chars(dt == StrRawBinary ? RawBinaryMarker : 0)
+			, is_ascii(false)
+			, is_rope(false)
+			, is_interned(false)
+			, is_mapped(false)
+			, checkpoints(0)
+			, hash_code(0)
+			{
+				start[num_elements++] = '\0';
+			}
+
+	friend class StrRopeI<Index>;
+	friend class StrMappedBodyI<Index>;
+	friend class StrIntern;
+	Index		num_chars;	// zero if not yet counted, RawBinaryMarker if locale-8bit
+	bool		is_ascii;	// Set when counting finds only ASCII. False if not yet counted
+	bool		is_rope : 1;	// This is a StrRopeI
+	bool		is_interned : 1;	// Never modified; no other interned Body has the same data
+	bool		is_mapped : 1;	// This is a StrMappedBodyI
+	std::atomic<Index*>	checkpoints;	// Byte offsets of every StrBodyCheckpointInterval'th char, or 0
+	std::atomic<uint64_t>	hash_code;	// UTF8Hash of the data, or 0 if not yet computed
 	void		countChars()
 			{
 				if (isRawBinary())
 					return;
 
-				const char*	cp = start;		// Progress pointer when reading data
-				char*		ep = start+num_elements-1;	// Marker for end of data
-				while (cp < ep)
+				// Counts illegal UTF-8 characters, and truncates a character that overlaps the end
+				num_chars = UTF8CountChars(start, start+num_elements-1, &is_ascii);
+			}
+	void		uncount()		// The data has changed, so discard what we know about it
+			{
+				if (!isRawBinary())
+					num_chars = 0;	// Force a re-count
+				is_ascii = false;
+				delete[] checkpoints.exchange(0);
+				hash_code = 0;
+			}
+
+	/*
+	 * Return the checkpoint index, building it if this body deserves one.
+	 * A shared Body is immutable, but more than one thread might build the
+	 * index at the same time. Only one will be kept.
+	 */
+	const Index*	checkpointIndex()
+			{
+				Index*	index = checkpoints.load(std::memory_order_acquire);
+				if (index
+				 || num_elements-1 < checkpoint_threshold
+				 || isRawBinary()
+				 || num_chars == num_elements-1)	// One byte per char doesn't need an index
+					return index;
+
+				index = new Index[num_chars/StrBodyCheckpointInterval+1];	// On the heap, never in an arena
+				const char*	cp = start;
+				for (Index c = 0; ; c++)
 				{
-					UCS4		ch = UTF8Get(cp);
-					if (ch == UCS4_NONE		// Illegal encoding not handled by UTF8_ILLEGAL
-					 || cp > ep)			// Overlaps the end of data
-						break;			// An error occurred before the end of the data; truncate it.
-					// Count illegal UTF-8 characters here
-					num_chars++;
+					if (c%StrBodyCheckpointInterval == 0)
+						index[c/StrBodyCheckpointInterval] = cp-start;
+					if (c == num_chars)
+						break;
+					cp += UTF8Len(cp);
 				}
+
+				Index*	expected = 0;
+				if (!checkpoints.compare_exchange_strong(expected, index, std::memory_order_acq_rel))
+				{		// Another thread beat us to it
+					delete[] index;
+					index = expected;
+				}
+				return index;
 			}
 
 	UCS4		getChar(const char*& cp) const	// Return next character, next advancing cp
@@ -279,13 +545,45 @@ protected:
 			}
 };
 
-template<typename Index> class StrBodyI<Index> StrBodyI<Index>::nullBody("", StrStatic, 0, 0);
+template<typename Index> class StrBodyI<Index> StrBodyI<Index>::nullBody(Literal, "", 0, 0);
+template<typename Index> Index StrBodyI<Index>::checkpoint_threshold = 1024;
+template<typename Index> const Index StrBodyI<Index>::RawBinaryMarker;
 
-// A StrVal defined by number of bits in the index:
+// A StrVal defined by number of bits in the index. StrValB<16> holds up to 65534 bytes:
 template<unsigned int IndexBits = StrValIndexBits>
-class StrValB
-: public StrValI<typename std::conditional<(IndexBits <= 16), uint16_t, uint32_t>::type>
+using StrValB = StrValI<typename std::conditional<(IndexBits <= 16), uint16_t, uint32_t>::type>;
+
+/*
+ * StrRefBaseI holds what a StrRefI and a StrValI both have: a counted reference
+ * to a StrBody, and which of its characters are included. A StrValI holding a
+ * short string inline has no Body, so neither derives from the other. A copy
+ * from one to the other makes a Body when it needs to.
+ */
+template<typename Index>
+class StrRefBaseI
 {
+	using Body = StrBodyI<Index>;
+public:
+	Index		length() const { return num_chars; }	// Number of chars
+	bool		isEmpty() const { return length() == 0; } // equals empty string?
+	operator bool() const { return !isEmpty(); }
+	void		share() const { body.share(); }	// Call before handing this string to another thread
+
+protected:
+	friend class StrRefI<Index>;
+	friend class StrValI<Index>;
+	friend class StrRopeI<Index>;
+	~StrRefBaseI() {}
+	StrRefBaseI(Body* s1, Index offs, Index len)	// offs/len not bounds-checked!
+			: body(s1), offset(offs), num_chars(len) {}
+	StrRefBaseI(const StrRefBaseI& s1) = default;
+	StrRefBaseI(StrRefBaseI&& s1)	// Take the reference, leaving s1 empty
+			: body(s1.body.pass()), offset(s1.offset), num_chars(s1.num_chars)
+			{ s1.offset = s1.num_chars = 0; }
+
+	Ref<Body>	body;		// The storage structure for the character data
+	Index		offset;		// What char number we start at
+	Index		num_chars;	// How many chars we include in this slice
 };
 
 /*
@@ -294,80 +592,97 @@ class StrValB
  */
 template<typename Index>
 class StrRefI
+: public StrRefBaseI<Index>
 {
 	using Body = StrBodyI<Index>;
+	using Base = StrRefBaseI<Index>;
+	using Base::body;
+	using Base::offset;
+	using Base::num_chars;
 public:
 	~StrRefI() {}			// Destructor
 	StrRefI()			// Empty string
-			: body(&Body::nullBody)
-			, offset(0)
-			, num_chars(0)
+			: Base(&Body::nullBody, 0, 0)
 			{}
 	StrRefI(const StrRefI& s1)	// Normal copy constructor
-			: body(s1.body), offset(s1.offset), num_chars(s1.num_chars)
+			: Base(s1)
+			{
+				if (!body)	// s1 was moved from
+					body = &Body::nullBody;
+			}
+	StrRefI(StrRefI&& s1)		// Move constructor, leaving s1 empty
+			: Base(std::move(s1))
 			{
+				if (!body)
+					body = &Body::nullBody;
 			}
+	StrRefI(const StrValI<Index>& s1);	// Copy from a StrVal, making a Body if it's inline
+	StrRefI(StrValI<Index>&& s1);	// Move from a StrVal, leaving it empty
 
 	StrRefI(const char* data, StrDataType dt = StrUTF8)	// construct by copying NUL-terminated data
-			: body(data == 0 || data[0] == '\0' ? &Body::nullBody : new Body(data, dt))
-			, offset(0)
-			, num_chars(body->numChars())
+			: Base(data == 0 || data[0] == '\0' ? &Body::nullBody : Body::create(data, dt), 0, 0)
 			{
+				num_chars = body->numChars();
 			}
-	StrRefI(const char* data, Index length, size_t allocate = 0) // construct from length-terminated char data
-			: body(0)
-			, offset(0)
-			, num_chars(0)
+	StrRefI(const char* data, size_t length, size_t allocate = 0) // construct from length-terminated char data
+			: Base(0, 0, 0)
 			{
 				if (allocate <= length)
 					allocate = 0;
 				if (length == 0)
 					body = &Body::nullBody;	// Don't use strlen!
 				else
-					body = new Body(data, StrUTF8, length, allocate);
+					body = Body::create(data, StrUTF8, length, allocate);
 				num_chars = body->numChars();
 			}
 	StrRefI(UCS4 character)		// construct from single-character string
-			: body(0), offset(0), num_chars(0)
+			: Base(0, 0, 0)
 			{
 				// REVISIT: Handle StrRawBinary data
 				char	one_char[7];
 				char*	op = one_char;		// Pack it into our local buffer
 				UTF8Put(op, character);
 				*op = '\0';
-				body = new Body(one_char, StrUTF8, op-one_char);
+				body = Body::create(one_char, StrUTF8, op-one_char);
 				num_chars = 1;
 			}
 	StrRefI(Body* s1)		// New reference to same string body; used for static strings
-			: body(s1), offset(0), num_chars(s1->numChars()) { }
+			: Base(s1, 0, s1->numChars()) { }
 
 	StrRefI& operator=(const StrRefI& s1) // Assignment operator
 			{
-				body = s1.body;
+				body = s1.body ? (Body*)s1.body : &Body::nullBody;
 				offset = s1.offset;
 				num_chars = s1.num_chars;
 				return *this;
 			}
-
-	Index		length() const { return num_chars; }	// Number of chars
-	bool		isEmpty() const { return length() == 0; } // equals empty string?
-	operator bool() const { return !isEmpty(); }
+	StrRefI& operator=(StrRefI&& s1) // Move assignment, leaving s1 empty
+			{
+				if (this == &s1)
+					return *this;
+				if (s1.body)
+					body = s1.body.pass();
+				else		// s1 was moved from
+					body = &Body::nullBody;
+				offset = s1.offset;
+				num_chars = s1.num_chars;
+				s1.offset = s1.num_chars = 0;
+				return *this;
+			}
+	StrRefI&&	pass() { return std::move(*this); }	// Pass this string on without counting a new reference
 
 protected:
+	friend class StrRopeI<Index>;
 	StrRefI(Body* s1, Index offs, Index len)	// offs/len not bounds-checked!
-			: body(s1), offset(offs), num_chars(len) {}
-
-	Ref<Body>	body;		// The storage structure for the character data
-	Index		offset;		// What char number we start at
-	Index		num_chars;	// How many chars we include in this slice
+			: Base(s1, offs, len) {}
 };
 
 template<typename Index>
 class StrValI
-: public StrRefI<Index>
+: public StrRefBaseI<Index>
 {
 	using Bookmark = StrBookmark<Index>;
-	using Base = StrRefI<Index>;
+	using Base = StrRefBaseI<Index>;
 	using Body = StrBodyI<Index>;
 protected:
 	using Base::body;
@@ -382,35 +697,109 @@ public:
 		// Then there's the issue of Unicode normalization (de/composition), which should use transform()
 		CompareNatural		// Natural comparison, with numeric strings by value
 	} CompareStyle;
+	enum { InlineMax = sizeof(Index) < 4 ? StrValInlineMax-4 : StrValInlineMax };	// Bytes stored without a Body
 
 	static const StrValI	null;
 
 	~StrValI() {}			// Destructor
-	StrValI() : Base() {}		// Empty string
+	StrValI() : Base(&Body::nullBody, 0, 0), mark() {}	// Empty string
 	StrValI(const StrValI& s1)	// Normal copy constructor
-			: Base(s1)
+			: Base((Body*)0, s1.offset, s1.num_chars)
+			, mark()
 			{
-				if (s1.body->isStatic())	// Must not copy a reference to a non-allocated body
-					Unshare();
+				copyFrom(s1);
+			}
+	StrValI(StrValI&& s1)		// Move constructor, leaving s1 empty
+			: Base((Body*)0, s1.offset, s1.num_chars)
+			, mark()
+			{
+				moveFrom(s1);
 			}
 	StrValI(const StrRefI<Index>& s1)	// Copy from StrRef
 			: Base(s1)
+			, mark()
+			{
+			}
+	StrValI(StrRefI<Index>&& s1)	// Move from StrRef, leaving it empty
+			: Base(std::move(s1))
+			, mark()
 			{
 			}
 
 	StrValI(const char* data, StrDataType dt = StrUTF8)	// construct by copying NUL-terminated data
-			: Base(data, dt)
+			: Base((Body*)0, 0, 0)
+			, mark()
 			{
+				size_t	len = data && dt == StrUTF8 ? strlen(data) : 0;
+				if (len > 0 && len <= InlineMax)
+					setInline(data, len);
+				else
+				{
+					body = data == 0 || data[0] == '\0' ? &Body::nullBody : Body::create(data, dt);
+					num_chars = body->numChars();
+				}
 			}
-	StrValI(const char* data, Index length, size_t allocate = 0) // construct from length-terminated char data
-			: Base(data, length, allocate)
+	StrValI(const char* data, size_t length, size_t allocate = 0) // construct from length-terminated char data
+			: Base((Body*)0, 0, 0)
 			, mark()
 			{
+				if (allocate <= length)
+					allocate = 0;
+				if (length == 0)
+					body = &Body::nullBody;	// Don't use strlen!
+				else if (length <= InlineMax && allocate <= InlineMax)
+				{
+					setInline(data, length);
+					return;
+				}
+				else
+					body = Body::create(data, StrUTF8, length, allocate);
+				num_chars = body->numChars();
 			}
 	StrValI(UCS4 character)		// construct from single-character string
-			: Base(character)
-			{}
-	StrValI(Body* s1) : Base(s1) {}	// New reference to same string body; used for static strings
+			: Base((Body*)0, 0, 0)
+			, mark()
+			{
+				// REVISIT: Handle StrRawBinary data
+				char	one_char[7];
+				char*	op = one_char;		// Pack it into our local buffer
+				UTF8Put(op, character);
+				setInline(one_char, op-one_char);
+			}
+	StrValI(Body* s1) : Base(s1, 0, s1->numChars()), mark() {}	// New reference to same string body; used for static strings
+
+	StrValI&	operator=(const StrValI& s1)
+			{
+				if (this != &s1)
+				{
+					offset = s1.offset;
+					num_chars = s1.num_chars;
+					copyFrom(s1);
+				}
+				return *this;
+			}
+	StrValI&	operator=(StrValI&& s1)	// Move assignment, leaving s1 empty
+			{
+				if (this != &s1)
+				{
+					offset = s1.offset;
+					num_chars = s1.num_chars;
+					moveFrom(s1);
+				}
+				return *this;
+			}
+	StrValI&&	pass() { return std::move(*this); }	// Pass this string on without counting a new reference
+
+	bool		isInline() const	// Is the string stored in this StrVal, not a Body?
+			{ return !body; }
+	bool		isRope() const		// Is the string a concatenation of slices of other Bodies?
+			{ return body && body->isRope(); }
+	bool		isLiteral() const	// Is the data a literal, shared without counting (see StrValLiteral)?
+			{ return body && body->isImmortal(); }
+	bool		isMapped() const	// Is the data in a file mapped by its Body (see StrMapFile)?
+			{ return body && body->isMapped(); }
+	bool		isInterned() const	// Is this the canonical StrVal from StrIntern?
+			{ return body && body->isInterned() && offset == 0 && length() == body->numChars(); }
 
 	Index		numBytes() const
 			{
@@ -424,13 +813,18 @@ public:
 			{
 				if (charNum == length())
 					return '\0';
+				if (isRope() && charNum >= 0 && charNum < length())
+					return Rope::charAt(body, offset+charNum);	// No need to flatten
 				const char*	cp = nthChar(charNum);
 				if (!cp)
 					return UCS4_NONE;
-				return body->isRawBinary() ? *cp : UTF8Get(cp);
+				return isRawBinary() ? *cp : UTF8Get(cp);
 			}
 	const char*	asUTF8()	// Null terminated. Must unshare data if it's a substring with elided suffix
 			{
+				if (isInline())
+					return local.bytes;
+				flatten();
 				if (offset+length() < body->numChars() // Substring ends before body does
 				 || !body->isNulTerminated())		// Body wasn't terminated anyhow
 				 	copyBody();
@@ -447,7 +841,13 @@ public:
 	// Comparisons:
 	int		compare(const StrValI&, CompareStyle = CompareRaw) const;
 	inline bool	operator==(const StrValI& comparand) const {
-				return length() == comparand.length() && compare(comparand) == 0;
+				if (length() != comparand.length())
+					return false;
+				if (isSameSlice(comparand))
+					return true;
+				if (isInterned() && comparand.isInterned())
+					return false;	// Different interned strings
+				return compare(comparand) == 0;
 			}
 	inline bool	operator!=(const StrValI& comparand) const { return !(*this == comparand); }
 	inline bool	operator<(const StrValI& comparand) const { return compare(comparand) < 0; }
@@ -455,7 +855,10 @@ public:
 	inline bool	operator>=(const StrValI& comparand) const { return compare(comparand) >= 0; }
 	inline bool	operator>(const StrValI& comparand) const { return compare(comparand) > 0; }
 	bool		equalCI(const StrValI& s) const		// Case independent equality
-			{ return compare(s, CompareCI) == 0; }
+			{ return length() == s.length() && compare(s, CompareCI) == 0; }
+	size_t		hash() const;				// Hash of the bytes. A whole Body caches it
+	size_t		hashCI() const;				// Hash that's the same for strings that are equalCI
+	StrValI		sortKey(CompareStyle style = CompareRaw) const;	// Bytes whose raw order is this style's order
 
 	// Ensure StrVal meets the requirements for a std::map:
 	static bool	compare(const StrValI& c1, const StrValI& c2);
@@ -481,6 +884,13 @@ public:
 				else
 					len = length()-at;
 
+				if (isInline())
+				{		// Short strings have short substrings
+					const char*	cp = nthChar(at);
+					StrValI		sub;
+					sub.setInline(cp, nthChar(at+len)-cp);
+					return sub;
+				}
 				return StrValI(body, offset+at, len);
 			}
 	StrValI		head(Index chars) const
@@ -494,130 +904,52 @@ public:
 	// Search for a character:
 	int		find(UCS4 ch, int after = -1) const
 			{
-				Index		n = after+1;		// First Index we'll look at
-				const char*	up;
-				while ((up = nthChar(n)) != 0)
-				{
-					if (ch == getChar(up))
-						return n;		// Found at n
-					n++;
-				}
-
-				return -1;				// Not found
+				char		buf[8];
+				Index		bytes = charBytes(ch, buf);
+				return bytes ? findBytes(buf, bytes, after) : -1;
 			}
 	int		rfind(UCS4 ch, int before = -1) const
 			{
-				Index		n = (before == -1 ? length() : before)-1; // First Index we'll look at
-				const char*	bp;
-				while ((bp = nthChar(n)) != 0)
-				{
-					if (ch == getChar(bp))
-						return n;		// Found at n
-					n--;
-				}
-
-				return -1;				// Not found
+				char		buf[8];
+				Index		bytes = charBytes(ch, buf);
+				return bytes ? rfindBytes(buf, bytes, 1, before) : -1;
 			}
 
 	// Search for substrings:
 	int		find(const StrValI& s1, int after = -1) const
 			{
-				Index		n = after+1;		// First Index we'll look at
-				Index		last_start = length()-s1.length();	// Last possible start position
-				const char*	s1start = s1.nthChar(0);
-				const char*	up;
-				while (n <= last_start && (up = nthChar(n)) != 0)
-				{
-					// REVISIT: Only works if the StrDataType matches
-					if (memcmp(up, s1start, s1.numBytes()) == 0)
-						return n;
-					n++;
-				}
-				return -1;
+				Index		bytes;
+				const char*	needle = s1.asUTF8(bytes);
+				// REVISIT: Only works if the StrDataType matches
+				return findBytes(needle, bytes, after);
 			}
 	int		rfind(const StrValI& s1, int before = -1) const
 			{
-				Index		n = before == -1 ? length()-s1.length() : before-1;	// First Index we'll look at
-				if (n > length()-s1.length())
-					n = length()-s1.length();
-
-				const char*	s1start = s1.nthChar(0);
-				const char*	bp;
-				while ((bp = nthChar(n)) != 0)
-				{
-					// REVISIT: Only works if the StrDataType matches
-					if (memcmp(bp, s1start, s1.numBytes()) == 0)
-						return n;
-					n--;
-				}
-				return -1;
+				Index		bytes;
+				const char*	needle = s1.asUTF8(bytes);
+				// REVISIT: Only works if the StrDataType matches
+				return rfindBytes(needle, bytes, s1.length(), before);
 			}
 
 	// Search for characters in set:
+	int		findAny(const CharSet& set, int after = -1) const
+			{ return findInSet(set, true, after); }
+	int		rfindAny(const CharSet& set, int before = -1) const
+			{ return rfindInSet(set, true, before); }
 	int		findAny(const StrValI& s1, int after = -1) const
-			{
-				Index		n = after+1;		// First Index we'll look at
-				const char*	up;
-				while ((up = nthChar(n)) != 0)
-				{
-					UCS4	ch = getChar(up);
-					for (Index i = 0; i < s1.length(); i++)
-						if (ch == s1[i])
-							return n;	// Found at n
-					n++;
-				}
-
-				return -1;				// Not found
-			}
+			{ return findInSet(CharSet(s1), true, after); }
 	int		rfindAny(const StrValI& s1, int before = -1) const
-			{
-				Index		n = before == -1 ? length()-1 : before-1;	// First Index we'll look at
-				const char*	bp;
-				while ((bp = nthChar(n)) != 0)
-				{
-					UCS4	ch = getChar(bp);
-					for (Index i = 0; i < s1.length(); i++)
-						if (ch == s1[i])
-							return n;
-					n--;
-				}
-				return -1;
-			}
+			{ return rfindInSet(CharSet(s1), true, before); }
 
 	// Search for characters not in set:
+	int		findNot(const CharSet& set, int after = -1) const
+			{ return findInSet(set, false, after); }
+	int		rfindNot(const CharSet& set, int before = -1) const
+			{ return rfindInSet(set, false, before); }
 	int		findNot(const StrValI& s1, int after = -1) const
-			{
-				Index		n = after+1;		// First Index we'll look at
-				const char*	up;
-				while ((up = nthChar(n)) != 0)
-				{
-					UCS4	ch = getChar(up);
-					for (Index i = 0; i < s1.length(); i++)
-						if (ch == s1[i])
-							goto next;	// Found at n
-					return n;
-				next:
-					n++;
-				}
-
-				return -1;				// Not found
-			}
+			{ return findInSet(CharSet(s1), false, after); }
 	int		rfindNot(const StrValI& s1, int before = -1) const
-			{
-				Index		n = (before == -1 ? length() : before)-1;	// First Index we'll look at
-				const char*	bp;
-				while ((bp = nthChar(n)) != 0)
-				{
-					UCS4	ch = getChar(bp);
-					for (Index i = 0; i < s1.length(); i++)
-						if (ch == s1[i])
-							goto next;	// Found at n
-					return n;
-				next:
-					n--;
-				}
-				return -1;
-			}
+			{ return rfindInSet(CharSet(s1), false, before); }
 
 	// Add, producing a new StrValI:
 	StrValI		operator+(const char* addend) const
@@ -625,10 +957,19 @@ public:
 	StrValI		operator+(const StrValI& addend) const
 			{
 				// Handle the rare but important case of extending a slice with a contiguous slice of the same body
-				if (static_cast<Body*>(body) == static_cast<Body*>(addend.body)	// From the same body
+				if (body
+				 && static_cast<Body*>(body) == static_cast<Body*>(addend.body)	// From the same body
 				 && offset+length() == addend.offset)	// And this ends where the addend starts
 					return StrValI(body, offset, length()+addend.num_chars);
 
+				if (useRope(addend)				// The result is long, so build a rope
+				 || numBytes()+addend.numBytes() <= InlineMax)	// The result is short, so build it inline
+				{
+					StrValI		str(*this);
+					str += addend;
+					return str;
+				}
+
 				const char*	cp = nthChar(0);
 				Index		len = numBytes();
 				// REVISIT: Handle StrRawBinary data in one string but not the other
@@ -640,20 +981,13 @@ public:
 	StrValI		operator+(UCS4 addend) const
 			{
 				// REVISIT: Handle StrRawBinary data more efficiently (no double-conversion)
-				// Convert addend using a stack-local buffer to save allocation here.
-				char	buf[7];				// Enough for 6-byte content plus a NUL
-				char*	cp = buf;
-				UTF8Put(cp, addend);
-				*cp = '\0';
-				Body	body(buf, StrStatic, cp-buf, 1);
-
-				return operator+(StrValI(&body));
+				return operator+(StrValI(addend));	// A single character is always inline
 			}
 
 	// Add, StrValI is modified:
 	StrValI&	operator+=(const StrValI& addend)
 			{
-				if (length() == 0 && !addend.isStatic())
+				if (length() == 0 && !addend.isBorrowed())
 					return *this = addend;		// Just assign, we were empty anyhow
 
 				append(addend);
@@ -662,21 +996,14 @@ public:
 	StrValI&	operator+=(UCS4 addend)
 			{
 				// REVISIT: Handle StrRawBinary data more efficiently (no double-conversion)
-				// Convert addend using a stack-local buffer to save allocation here.
-				char	buf[7];				// Enough for 6-byte content plus a NUL
-				char*	cp = buf;
-				UTF8Put(cp, addend);
-				*cp = '\0';
-				Body	body(buf, StrStatic, cp-buf, 1);
-
-				operator+=(StrValI(&body));
-				return *this;
+				return operator+=(StrValI(addend));	// A single character is always inline
 			}
 	StrValI		operator*(int repeats)
 			{
 				const char*	first_byte = nthChar(0);
-				const char*	end_byte = nthChar(length());	// Pre-allocate enough memory
-				StrValI	res("", 0, (end_byte-first_byte)*repeats+1);
+				const char*	end_byte = nthChar(length());	// Pre-allocate enough memory, unless we'll make a rope
+				size_t		bytes = (end_byte-first_byte)*repeats;
+				StrValI	res("", 0, bytes < StrRopeThreshold ? bytes+1 : 0);
 
 				for (int i = 0; i < repeats; i++)
 					res += *this;
@@ -685,8 +1012,12 @@ public:
 
 	StrValI&	insert(Index pos, const StrValI& addend)
 			{
+				if (&addend == this)		// Keep our Body alive while we Unshare
+					return insert(pos, StrValI(addend));
+
 				// Handle the rare but important case of extending a slice with a contiguous slice of the same body
 				if (pos == length()			// Appending at the end
+				 && body
 				 && static_cast<Body*>(body) == static_cast<Body*>(addend.body)	// From the same body
 				 && offset+pos == addend.offset)	// And addend starts where we end
 				{
@@ -694,11 +1025,43 @@ public:
 					return *this;
 				}
 
-				Unshare();
+				if (useRope(addend))
+				{		// Insert without copying the data
+					Piece	whole = Rope::normalise(Piece(*this));	// The copies make Bodies for inline strings
+					Piece	piece = Rope::normalise(Piece(addend));
+					if (pos == length())
+						whole = Rope::concat(whole, piece);
+					else if (pos == 0)
+						whole = Rope::concat(piece, whole);
+					else
+						whole = Rope::concat(
+							Rope::concat(Rope::slice(whole, 0, pos), piece),
+							Rope::slice(whole, pos, length()-pos)
+						);
+					return *this = StrValI(whole);
+				}
 
 				// REVISIT: Handle StrRawBinary data
 				Index		addend_length;		// Get length in bytes
 				const char*	ap = addend.asUTF8(addend_length);
+
+				// If the result is short and we'd have to copy anyway, keep it inline:
+				const char*	cp = nthChar(0);
+				const char*	ip = nthChar(pos);
+				const char*	ep = nthChar(length());
+				if (ep-cp+addend_length <= InlineMax
+				 && (isInline() || body->isShared() || isStatic())
+				 && !isRawBinary() && !addend.isRawBinary())
+				{
+					char	buf[InlineMax];
+					memcpy(buf, cp, ip-cp);
+					memcpy(buf+(ip-cp), ap, addend_length);
+					memcpy(buf+(ip-cp)+addend_length, ip, ep-ip);
+					setInline(buf, ep-cp+addend_length);
+					return *this;
+				}
+
+				Unshare(addend_length);
 				body->insertBytes(nthChar(pos)-nthChar(0), ap, addend_length);
 				// REVISIT: update or nullify the bookmark if after insertion point
 				num_chars += addend.length();
@@ -712,27 +1075,57 @@ public:
 	StrValI		asLower() const { StrValI lower(*this); lower.toLower(); return lower; }
 	StrValI		asUpper() const { StrValI upper(*this); upper.toUpper(); return upper; }
 	StrValI&	toLower()
-			{
-				Unshare();	// REVISIT: Unshare only when first change must be made
-				body->toLower();
-				num_chars = body->numChars();
-				return *this;
-			}
+			{ return convertCase(false); }
 	StrValI&	toUpper()
+			{ return convertCase(true); }
+	// See StrBodyI::transform. The template form streams output to a StrSink.
+	template<typename Xform, typename = decltype(std::declval<Xform&>()(std::declval<const char*&>(), (const char*)0, std::declval<StrSink&>()))>
+	StrValI&	transform(Xform xform, int after = -1)
 			{
-				Unshare();	// REVISIT: Unshare only when first change must be made
-				body->toUpper();
+				Unshare();
+				body->transform(xform, after);
 				num_chars = body->numChars();
+				mark = Bookmark();
 				return *this;
 			}
 	StrValI&	transform(const std::function<StrValI(const char*& cp, const char* ep)> xform, int after = -1);
-	StrValI		asJSON() const { StrValI json(*this); json.toJSON(); return json; }
-	StrValI&	toJSON()
+	// Escape as the content of a JSON string. ascii_only escapes all non-ASCII characters too:
+	StrValI		asJSON(bool ascii_only = false) const { StrValI json(*this); json.toJSON(ascii_only); return json; }
+	StrValI&	toJSON(bool ascii_only = false)
 			{
-				Unshare();
-				body->toJSON();
-				num_chars = body->numChars();
-				return *this;
+				Index		bytes;
+				const char*	cp = asUTF8(bytes);
+				bool		raw = isRawBinary();
+				size_t		json_bytes = Body::escapeJSON(0, cp, cp+bytes, raw, ascii_only);
+				if (json_bytes == bytes)
+					return *this;		// Nothing needs escaping
+				if (json_bytes <= InlineMax && !raw)
+				{
+					char	buf[InlineMax];
+					Body::escapeJSON(buf, cp, cp+bytes, raw, ascii_only);
+					setInline(buf, json_bytes);
+					return *this;
+				}
+
+				// Escape straight into the new Body, rather than copying this first:
+				return *this = StrValI(Body::create(json_bytes, raw ? StrRawBinary : StrUTF8,
+					[&](char* op) { Body::escapeJSON(op, cp, cp+bytes, raw, ascii_only); }));
+			}
+	void		appendJSON(StrSink& sink, bool ascii_only = false) const	// Append what asJSON() would return
+			{
+				Index		bytes;
+				const char*	cp = asUTF8(bytes);
+				size_t		json_bytes = Body::escapeJSON(0, cp, cp+bytes, isRawBinary(), ascii_only);
+				if (json_bytes == bytes)
+					return sink.appendBytes(cp, bytes);
+				char*		op = sink.reserve(json_bytes);
+				sink.commit(op+Body::escapeJSON(op, cp, cp+bytes, isRawBinary(), ascii_only));
+			}
+	size_t		jsonBytes(bool ascii_only = false) const	// How many bytes asJSON() would return
+			{
+				Index		bytes;
+				const char*	cp = asUTF8(bytes);
+				return Body::escapeJSON(0, cp, cp+bytes, isRawBinary(), ascii_only);
 			}
 
 	/*
@@ -760,37 +1153,281 @@ public:
 				Index*	scanned = 0	// characters scanned
 			) const;
 
-	static StrVal	format(StrVal f, VariantArray args);
+	// As for asInt32, but 64 bits:
+	int64_t		asInt64(ErrNum* err_return = 0, int radix = 0, Index* scanned = 0) const;
 
-protected:
-	StrValI(Body* s1, Index offs, Index len)	// offs/len not bounds-checked!
-			: Base(s1, offs, len) { }
-	const char*	nthChar(Index char_num) const	// Return a pointer to the start of the nth character
+	// A '-' sign is allowed, but reports STRERR_NUMBER_OVERFLOW (and the value wraps):
+	uint64_t	asUInt64(ErrNum* err_return = 0, int radix = 0, Index* scanned = 0) const;
+
+	/*
+	 * Convert a decimal number with optional fraction and exponent (or
+	 * inf, infinity or nan) to the nearest double. Errors are reported as
+	 * for asInt32, and an out-of-range number returns an infinity with
+	 * STRERR_NUMBER_OVERFLOW.
+	 */
+	double		asDouble(ErrNum* err_return = 0, Index* scanned = 0) const;
+
+	// Decimal strings for numbers. fromDouble uses the fewest digits that asDouble converts back exactly
+	static StrValI	fromInt(int64_t value)
 			{
-				if (char_num < 0 || char_num > length())
-					return 0;
-				Bookmark	unsaved = mark;
-				return body->nthChar(offset+char_num, unsaved);
+				char	buf[UTF8MaxInteger];
+				char*	cp = buf;
+				UTF8PutInteger(cp, value < 0 ? 0-(uint64_t)value : value, value < 0);
+				return StrValI(buf, cp-buf);
+			}
+	static StrValI	fromUInt(uint64_t value)
+			{
+				char	buf[UTF8MaxInteger];
+				char*	cp = buf;
+				UTF8PutInteger(cp, value);
+				return StrValI(buf, cp-buf);
+			}
+	static StrValI	fromDouble(double value)
+			{
+				char	buf[UTF8MaxDouble];
+				char*	cp = buf;
+				UTF8PutDouble(cp, value);
+				return StrValI(buf, cp-buf);
+			}
+
+	static StrVal	format(StrVal f, VariantArray args);
+
+protected:
+	StrValI(Body* s1, Index offs, Index len)	// offs/len not bounds-checked!
+			: Base(s1, offs, len), mark() { }
+	const char*	nthChar(Index char_num) const	// Return a pointer to the start of the nth character
+			{
+				if (char_num < 0 || char_num > length())
+					return 0;
+				if (isInline())
+					return inlineChar(char_num);
+				if (isRope())
+				{		// Use the rope's flat copy
+					Bookmark	unsaved;
+					return body->flat()->nthChar(offset+char_num, unsaved);
+				}
+				Bookmark	unsaved = mark;
+				return body->nthChar(offset+char_num, unsaved);
 			}
 	const char*	nthChar(Index char_num)	// Return a pointer to the start of the nth character
 			{
 				if (char_num < 0 || char_num > length())
 					return 0;
+				if (isInline())
+					return inlineChar(char_num);
+				flatten();
 				return body->nthChar(offset+char_num, mark);
 			}
 	bool		isStatic() const
-			{ return body->isStatic(); }
+			{ return body && body->isStatic(); }
+	bool		isBorrowed() const	// The data isn't ours and may go away, unlike a literal
+			{ return isStatic() && !body->isImmortal() && !body->isMapped(); }
 
 private:
-	Bookmark	mark;
+	friend class StrRefI<Index>;
+	using Rope = StrRopeI<Index>;
+	using Piece = StrRefI<Index>;
 
+	/*
+	 * A string of up to InlineMax bytes is kept here, with no Body
+	 * (body is null and offset is zero). A Body is only made when the
+	 * string grows, or when it's needed to make a StrRef. An inline string
+	 * needs no bookmark because it's too short to be worth one.
+	 */
+	union {
+		Bookmark	mark;
+		struct {
+			char		bytes[InlineMax+1];	// NUL terminated
+			uint8_t		num_bytes;
+		}		local;
+	};
+
+	class		NaturalKeyReader;	// Reads a CompareNatural sort key without making it
+	void		putKeyChar(char*& op, UCS4 ch) const;	// Store a character of a sort key
+
+	bool		isRawBinary() const
+			{ return body && body->isRawBinary(); }
+	bool		isSameSlice(const StrValI& s) const	// Starts at the same place in the same Body
+			{ return body && static_cast<Body*>(body) == static_cast<Body*>(s.body) && offset == s.offset; }
 	UCS4		getChar(const char*& cp) const
 			{
-				if (body->isRawBinary())
+				if (isRawBinary())
 					return *cp++;
 				return UTF8Get(cp);
 			}
-	void		copyBody()
+	StrValI&	convertCase(bool upper)
+			{
+				if (isInline())
+				{
+					char*	ep = local.bytes+local.num_bytes;
+					if (Body::convertCaseInPlace(local.bytes, ep, upper) == ep)
+						return *this;
+				}
+				Unshare();	// REVISIT: Unshare only when first change must be made
+				body->convertCase(upper);
+				mark = Bookmark();		// Characters may have changed length
+				return *this;
+			}
+	Index		charBytes(UCS4 ch, char* buf) const	// Encode ch as it appears in our data
+			{
+				char*		op = buf;
+				if (!isRawBinary())
+					UTF8Put(op, ch);
+				else if (ch <= 0xFF || ch == (UCS4)(char)ch)	// As getChar returns it
+					*op++ = (char)ch;
+				return op-buf;				// Zero if ch can't occur
+			}
+
+	/*
+	 * Byte searches return a character number. A needle that starts with an
+	 * ASCII or lead byte is only found at the start of a character, so the
+	 * characters before a hit can just be counted. Any other needle might be
+	 * found inside a character, so the hit must be checked.
+	 */
+	bool		startsAtChar(const char* needle, Index bytes) const
+			{ return isRawBinary() || bytes == 0 || UTF8Is1st(*needle); }
+	Index		charsBetween(const char* cp, const char* ep) const
+			{ return isRawBinary() ? ep-cp : UTF8CountChars(cp, ep); }
+	int		findBytes(const char* needle, Index bytes, int after) const
+			{
+				if (after < -1 || after+1 > (int)length())
+					return -1;
+				Index		n = after+1;		// First Index we'll look at
+				const char*	sp = nthChar(n);
+				const char*	ep = nthChar(length());
+				bool		at_char = startsAtChar(needle, bytes);
+				for (;;)
+				{
+					const char*	hit = UTF8Find(sp, ep, needle, bytes);
+					if (!hit)
+						return -1;
+					n += charsBetween(sp, hit);
+					if (at_char)
+						return n;
+					sp = nthChar(n);
+					if (sp == hit)
+						return n;
+					if (sp < hit)			// The character n contains the hit
+						sp = nthChar(++n);
+				}
+			}
+	int		rfindBytes(const char* needle, Index bytes, Index needle_chars, int before) const
+			{
+				if (needle_chars > length())
+					return -1;
+				int		n = before == -1 ? length()-needle_chars : before-1;	// Last possible start
+				if (n > (int)(length()-needle_chars))
+					n = length()-needle_chars;
+				if (n < 0)
+					return -1;
+
+				const char*	start = nthChar(0);
+				const char*	np = nthChar(n);
+				const char*	ep = nthChar(length());
+				const char*	limit = ep-np > bytes ? np+bytes : ep;
+				for (;;)
+				{
+					const char*	hit = UTF8RFind(start, limit, needle, bytes);
+					if (!hit)
+						return -1;
+					if (startsAtChar(needle, bytes))
+						return n-charsBetween(hit, np);
+					Index	h = charsBetween(start, hit);
+					if (nthChar(h) == hit)
+						return h;
+					limit = hit+bytes-1;		// The hit was inside a character, look before it
+				}
+			}
+	int		findInSet(const CharSet& set, bool wanted, int after) const
+			{
+				if (after < -1 || after+1 > (int)length())
+					return -1;
+				Index		n = after+1;		// First Index we'll look at
+				const char*	sp = nthChar(n);
+				const char*	ep = nthChar(length());
+				if (isRawBinary())
+				{
+					for (const char* cp = sp; cp < ep; n++)
+						if (set.contains(getChar(cp)) == wanted)
+							return n;
+					return -1;
+				}
+				const char*	hit = wanted ? set.findAny(sp, ep) : set.findNot(sp, ep);
+				return hit ? (int)(n+charsBetween(sp, hit)) : -1;
+			}
+	int		rfindInSet(const CharSet& set, bool wanted, int before) const
+			{
+				int		n = before == -1 || before > (int)length() ? length() : before;	// Index after the last we'll look at
+				if (n <= 0)
+					return -1;
+				const char*	sp = nthChar(0);
+				const char*	ep = nthChar(n);
+				if (isRawBinary())
+				{
+					while (--n >= 0)
+						if (set.contains((UCS4)sp[n]) == wanted)
+							return n;
+					return -1;
+				}
+				const char*	hit = wanted ? set.rfindAny(sp, ep) : set.rfindNot(sp, ep);
+				return hit ? (int)(n-charsBetween(hit, ep)) : -1;
+			}
+	const char*	inlineChar(Index char_num) const
+			{
+				const char*	cp = local.bytes;
+				if (num_chars == local.num_bytes)	// All ASCII
+					return cp+char_num;
+				while (char_num-- > 0)
+					cp += UTF8Len(cp);
+				return cp;
+			}
+	void		setInline(const char* data, size_t bytes)
+			{
+				assert(bytes <= InlineMax);
+				memmove(local.bytes, data, bytes);	// data may be in local already
+				local.bytes[bytes] = '\0';
+				local.num_bytes = bytes;
+				body = 0;
+				offset = 0;
+				num_chars = UTF8CountChars(local.bytes, local.bytes+bytes);
+			}
+	Body*		inlineBody(Index extra = 0) const	// Make a Body holding our inline string, with room for extra bytes
+			{
+				if (local.num_bytes == 0 && extra == 0)
+					return &Body::nullBody;
+				return Body::create(local.bytes, StrUTF8, local.num_bytes, extra ? local.num_bytes+extra+1 : 0);
+			}
+	void		copyFrom(const StrValI& s1)	// offset and num_chars are already copied
+			{
+				if (s1.isInline())
+				{
+					body = 0;
+					local = s1.local;
+					return;
+				}
+				body = s1.body;
+				mark = s1.mark;
+				if (s1.isBorrowed())	// Must not copy a reference to a non-allocated body
+					Unshare();
+			}
+	void		moveFrom(StrValI& s1)	// offset and num_chars are already copied
+			{
+				if (s1.isInline() || s1.isBorrowed())
+					return copyFrom(s1);	// There's no reference we can take
+				body = s1.body.pass();
+				mark = s1.mark;
+				s1.setEmpty();
+			}
+	void		setEmpty()		// Make an empty inline string, as a moved-from StrVal is left
+			{
+				body = 0;
+				offset = 0;
+				num_chars = 0;
+				local.bytes[0] = '\0';
+				local.num_bytes = 0;
+			}
+
+	void		copyBody(size_t allocate = 0)
 			{
 				// Copy only this slice of the body's data, and reset our offset to zero
 				Bookmark	savemark(mark);			// copy the bookmark
@@ -798,19 +1435,70 @@ private:
 				const char*	ep = nthChar(length());		// end of this substring
 				Index		prefix_bytes = cp - body->nthChar(0, mark); // How many leading bytes of the body we are eliding
 
-				body = new Body(cp, body->isRawBinary() ? StrRawBinary : StrUTF8, ep-cp);
+				body = Body::create(cp, body->isRawBinary() ? StrRawBinary : StrUTF8, ep-cp, allocate);
 				mark.char_num = savemark.char_num - offset;	// Restore the bookmark
 				mark.byte_num = savemark.byte_num - prefix_bytes;
 				offset = 0;
 			}
 
-	void		Unshare()
+	bool		useRope(const StrValI& addend) const	// Should adding this make a rope?
+			{
+				if (length() == 0 || addend.length() == 0
+				 || isRawBinary() || addend.isRawBinary())
+					return false;
+				return isRope() || addend.isRope()
+					|| numBytes()+addend.numBytes() >= StrRopeThreshold;
+			}
+	void		flatten()	// If we're on a rope, move to its flat copy
+			{
+				if (!isRope())
+					return;
+				body = body->flat();
+				mark = Bookmark();
+			}
+
+	void		Unshare(Index extra = 0)	// Ensure we have our own Body, with room for extra bytes
 			{
+				if (isInline())
+				{		// Move our string into a Body so it can be modified there
+					body = inlineBody(extra);
+					mark = Bookmark();
+					return;
+				}
+				flatten();
 				// A substring on Unallocated memory which is the last remaining ref
-				// cannot be terminated correctly, so must be copied even if unshared
-				bool	must_copy_static = body->isStatic() && offset+length() < body->numChars();
+				// cannot be terminated correctly, so must be copied even if unshared.
+				// A mapped file is read-only, so it's always copied.
+				bool	must_copy_static = body->isStatic()
+						&& (body->isMapped() || offset+length() < body->numChars());
 				if (must_copy_static || body->isShared())
-					copyBody();
+					copyBody(extra ? (size_t)numBytes()+extra+1 : 0);
+				else if (extra && (size_t)body->length()+extra > body->capacity())
+					copyBody(Body::grownAllocation(body->capacity(), (size_t)body->length()+extra));	// Reallocate the whole block
+			}
+
+	// Finish a number conversion: check for trailing text and count the characters scanned
+	ErrNum		numberStatus(UTF8NumberStatus status, const char* start, const char* cp, const char* ep, Index* scanned) const
+			{
+				ErrNum		e;
+				switch (status)
+				{
+				case UTF8NumberOK:
+					for (const char* np = cp;
+					     cp < ep && UCS4IsWhite(isRawBinary() ? (UCS4)(unsigned char)*np++ : UTF8Get(np));
+					     cp = np)
+						;
+					if (cp != ep)
+						e = STRERR_TRAIL_TEXT;
+					break;
+				case UTF8NumberNoDigits:	e = STRERR_NO_DIGITS; break;
+				case UTF8NumberNotNumber:	e = STRERR_NOT_NUMBER; break;
+				case UTF8NumberOverflow:	e = STRERR_NUMBER_OVERFLOW; break;
+				case UTF8NumberIllegalRadix:	e = STRERR_ILLEGAL_RADIX; break;
+				}
+				if (scanned)
+					*scanned = isRawBinary() ? cp-start : UTF8CountChars(start, cp);
+				return e;
 			}
 
 	static int HexAlpha(UCS4 ch)
@@ -842,6 +1530,273 @@ private:
 template<typename Index>
 const class StrValI<Index>	StrValI<Index>::null;
 
+template<typename Index>
+StrRefI<Index>::StrRefI(const StrValI<Index>& s1)
+: Base(s1)
+{
+	if (s1.isInline())
+		body = s1.inlineBody();
+}
+
+template<typename Index>
+StrRefI<Index>::StrRefI(StrValI<Index>&& s1)
+: Base(0, s1.offset, s1.num_chars)
+{
+	if (s1.isInline())
+	{
+		body = s1.inlineBody();
+		return;
+	}
+	body = s1.body.pass();
+	s1.setEmpty();
+}
+
+/*
+ * A rope is a Body with no data of its own, only the concatenation of two
+ * pieces (StrRefs). A piece is either a leaf (a slice of a normal Body) or a
+ * whole rope. Ropes are balanced like AVL trees, so concatenation, insertion
+ * and slicing make O(log n) new ropes, and copy no data except when merging
+ * short leaves. A StrVal can use a window onto a rope like any other Body;
+ * that window is normalised (turned into leaves and whole ropes) when it's
+ * used to build another rope.
+ *
+ * Single characters can be fetched from a rope directly. Anything needing
+ * contiguous data uses a flat copy, made once and kept by the rope.
+ */
+template<typename Index>
+class StrRopeI
+: public StrBodyI<Index>
+{
+	using Body = StrBodyI<Index>;
+	using Piece = StrRefI<Index>;
+	using Bookmark = StrBookmark<Index>;
+	using Body::num_chars;
+	using Body::is_rope;
+public:
+	~StrRopeI()
+			{
+				if (Body* f = flattened.load())
+					f->Release();
+			}
+
+	static Piece	concat(const Piece& p1, const Piece& p2);	// Both must be normalised
+	static Piece	slice(const Piece& p, Index at, Index len);	// Normalised slice of a normalised piece
+	static Piece	normalise(const Piece& p)
+			{
+				if (!isRope(p) || (p.offset == 0 && p.num_chars == p.body->numChars()))
+					return p;
+				return slice(Piece((Body*)p.body), p.offset, p.num_chars);
+			}
+	static UCS4	charAt(Body* body, Index char_num);	// Fetch a character without flattening
+	Body*		flatten();
+	void		share()		// The pieces and the flat copy go to other threads too
+			{
+				Body::share();
+				left.body.share();
+				right.body.share();
+				if (Body* f = flattened.load(std::memory_order_acquire))
+					f->share();
+			}
+
+private:
+	Piece		left;
+	Piece		right;
+	Index		num_bytes;	// Total data size
+	uint8_t		height;		// Leaves have height zero
+	std::atomic<Body*>	flattened;	// The flat copy, once it's needed
+
+	StrRopeI(const Piece& l, const Piece& r)
+			: left(l)
+			, right(r)
+			, num_bytes(Body::checkBytes((size_t)numBytes(l)+numBytes(r)))
+			, height((heightOf(l) > heightOf(r) ? heightOf(l) : heightOf(r))+1)
+			, flattened(0)
+			{
+				is_rope = true;
+				num_chars = l.num_chars+r.num_chars;
+			}
+
+	static bool	isRope(const Piece& p)
+			{ return p.body->isRope(); }
+	static StrRopeI* rope(const Piece& p)
+			{ return static_cast<StrRopeI*>((Body*)p.body); }
+	static int	heightOf(const Piece& p)
+			{ return isRope(p) ? rope(p)->height : 0; }
+	static const char* leafData(const Piece& p, Index& bytes)
+			{
+				if (p.offset == 0 && p.num_chars == p.body->numChars())
+				{		// The whole Body
+					bytes = p.body->length()-1;
+					return p.body->data();
+				}
+				Bookmark	mark;
+				const char*	cp = p.body->nthChar(p.offset, mark);
+				bytes = p.body->nthChar(p.offset+p.num_chars, mark) - cp;
+				return cp;
+			}
+	static Index	numBytes(const Piece& p)
+			{
+				Index	bytes;
+				if (isRope(p))
+					return rope(p)->num_bytes;
+				leafData(p, bytes);
+				return bytes;
+			}
+	static Piece	node(const Piece& l, const Piece& r)
+			{
+				StrRopeI*	n = new StrRopeI(l, r);
+				return Piece(n, 0, n->num_chars);
+			}
+	static Piece	leaves(const Piece& p1, const Piece& p2)	// Join two leaves, merging them if short
+			{
+				Index		b1, b2;
+				if (p1.num_chars+p2.num_chars > StrRopeLeafMax)
+					return node(p1, p2);
+				const char*	d1 = leafData(p1, b1);
+				const char*	d2 = leafData(p2, b2);
+				if (b1+b2 > StrRopeLeafMax)
+					return node(p1, p2);
+				char		buf[StrRopeLeafMax];
+				memcpy(buf, d1, b1);
+				memcpy(buf+b1, d2, b2);
+				return Piece(Body::create(buf, StrUTF8, b1+b2));
+			}
+	static void	copyTo(char*& op, const Piece& p)
+			{
+				if (isRope(p))
+				{
+					copyTo(op, rope(p)->left);
+					copyTo(op, rope(p)->right);
+					return;
+				}
+				Index		bytes;
+				const char*	cp = leafData(p, bytes);
+				memcpy(op, cp, bytes);
+				op += bytes;
+			}
+};
+
+typedef	StrRopeI<>	StrRope;
+
+/*
+ * Join two balanced trees. If one is more than one taller, descend its
+ * inner side to find a subtree of the right height to join with, then
+ * rotate on the way back up if the result is out of balance.
+ */
+template<typename Index>
+StrRefI<Index> StrRopeI<Index>::concat(const Piece& p1, const Piece& p2)
+{
+	if (p1.num_chars == 0)
+		return p2;
+	if (p2.num_chars == 0)
+		return p1;
+	int		h1 = heightOf(p1);
+	int		h2 = heightOf(p2);
+	if (h1 > h2+1)
+	{
+		StrRopeI*	r = rope(p1);
+		Piece		c = concat(r->right, p2);
+		if (heightOf(c) <= heightOf(r->left)+1)
+			return node(r->left, c);
+		StrRopeI*	cr = rope(c);		// c is too tall by one
+		if (heightOf(cr->left) > heightOf(cr->right))
+		{		// Double rotation
+			StrRopeI*	crl = rope(cr->left);
+			return node(node(r->left, crl->left), node(crl->right, cr->right));
+		}
+		return node(node(r->left, cr->left), cr->right);
+	}
+	if (h2 > h1+1)
+	{
+		StrRopeI*	r = rope(p2);
+		Piece		c = concat(p1, r->left);
+		if (heightOf(c) <= heightOf(r->right)+1)
+			return node(c, r->right);
+		StrRopeI*	cr = rope(c);
+		if (heightOf(cr->right) > heightOf(cr->left))
+		{
+			StrRopeI*	crr = rope(cr->right);
+			return node(node(cr->left, crr->left), node(crr->right, r->right));
+		}
+		return node(cr->left, node(cr->right, r->right));
+	}
+	if (h1 == 0 && h2 == 0)
+		return leaves(p1, p2);
+	return node(p1, p2);
+}
+
+template<typename Index>
+StrRefI<Index> StrRopeI<Index>::slice(const Piece& p, Index at, Index len)
+{
+	if (!isRope(p))
+		return Piece((Body*)p.body, p.offset+at, len);
+	if (at == 0 && len == p.num_chars)
+		return p;
+
+	StrRopeI*	r = rope(p);
+	Index		left_chars = r->left.num_chars;
+	if (at+len <= left_chars)
+		return slice(r->left, at, len);
+	if (at >= left_chars)
+		return slice(r->right, at-left_chars, len);
+	return concat(slice(r->left, at, left_chars-at), slice(r->right, 0, at+len-left_chars));
+}
+
+template<typename Index>
+UCS4 StrRopeI<Index>::charAt(Body* body, Index char_num)
+{
+	while (body->isRope())
+	{
+		StrRopeI*	r = static_cast<StrRopeI*>(body);
+		const Piece*	p = &r->left;
+		if (char_num >= p->num_chars)
+		{
+			char_num -= p->num_chars;
+			p = &r->right;
+		}
+		body = p->body;
+		char_num += p->offset;		// Zero if p is a rope
+	}
+	Bookmark	mark;
+	const char*	cp = body->nthChar(char_num, mark);
+	return UTF8Get(cp);
+}
+
+template<typename Index>
+StrBodyI<Index>* StrRopeI<Index>::flatten()
+{
+	Body*	f = flattened.load(std::memory_order_acquire);
+	if (f)
+		return f;
+
+	{
+		ArenaScope::Pause	pause;	// It lasts as long as the rope, which may outlive an arena
+		f = Body::create("", StrUTF8, 0, num_bytes+1);
+	}
+	char*	op = f->start;
+	copyTo(op, left);
+	copyTo(op, right);
+	*op = '\0';
+	f->num_elements = op-f->start+1;
+	f->AddRef();			// This rope keeps it
+	if (this->isMerged())
+		f->share();		// Any thread might release the rope
+
+	Body*	expected = 0;
+	if (!flattened.compare_exchange_strong(expected, f, std::memory_order_acq_rel))
+	{		// Another thread beat us to it
+		f->Release();
+		f = expected;
+	}
+	return f;
+}
+
+template<typename Index>
+StrBodyI<Index>* StrBodyI<Index>::flat()
+{
+	return is_rope ? static_cast<StrRopeI<Index>*>(this)->flatten() : this;
+}
+
 template<typename Index>
 bool StrValI<Index>::compare(const StrValI& c1, const StrValI& c2)
 {
@@ -854,6 +1809,106 @@ bool StrValI<Index>::equiv(const StrValI& c1, const StrValI& c2)
 	return c1.compare(c2, CompareRaw) == 0;
 }
 
+/*
+ * Produce the CompareNatural sort key of some text a byte at a time, so that
+ * compare() needs no allocation but orders strings exactly as their keys do.
+ * A run of digits is read twice: once to count its significant digits for the
+ * header, then again to produce them.
+ */
+template<typename Index>
+class StrValI<Index>::NaturalKeyReader
+{
+public:
+	NaturalKeyReader(const StrValI& _s, const char* _cp, const char* _ep)
+	: s(_s), cp(_cp), ep(_ep), raw(_cp), dp(0), digits(0), np(0), ne(0), ended(false) {}
+
+	int		next()		// The next byte of the key, or -1 after the last
+	{
+		if (np < ne)
+			return (uint8_t)pending[np++];
+		if (digits > 0)
+		{
+			digits--;
+			return '0'+digit(dp);
+		}
+		if (cp < ep)
+		{
+			token();
+			return (uint8_t)pending[np++];
+		}
+		if (!ended)
+		{		// The raw text follows a NUL, so different strings always differ
+			ended = true;
+			return 0;
+		}
+		return raw < ep ? (uint8_t)*raw++ : -1;
+	}
+
+private:
+	const StrValI&	s;
+	const char*	cp;		// The next character to read a token from
+	const char*	ep;
+	const char*	raw;		// The text, to follow the tokens
+	const char*	dp;		// The next significant digit of this number
+	size_t		digits;		// How many significant digits are still to come
+	char		pending[8];	// The unread bytes of this token
+	int		np;
+	int		ne;
+	bool		ended;
+
+	int		digit(const char*& p) const	// The value of a digit, or -1 leaving p unchanged
+	{
+		const char*	sp = p;
+		int		d = s.isRawBinary() ? s.getChar(p)-'0' : UCS4Digit(s.getChar(p));
+		if (d < 0 || d > 9)
+		{
+			p = sp;
+			return -1;
+		}
+		return d;
+	}
+
+	void		token()		// Make the next token, or just the header of a number
+	{
+		const char*	sp = cp;
+		UCS4		ch = s.getChar(cp);
+		char*		op = pending;
+		np = 0;
+		if (ch == 0 || ch == 1)
+		{
+			*op++ = 1;
+			*op++ = ch+1;
+		}
+		else if (s.isRawBinary() ? !(ch >= '0' && ch <= '9') : UCS4Digit(ch) < 0)
+			s.putKeyChar(op, ch);
+		else
+		{
+			cp = sp;
+			for (;;)
+			{
+				const char*	sig = cp;
+				int		d = digit(cp);
+				if (d < 0)
+					break;
+				if (digits == 0 && d > 0)	// Skip leading zeroes
+					dp = sig;
+				if (digits > 0 || d > 0)
+					digits++;
+			}
+			*op++ = '0';
+			if (digits < 254)
+				*op++ = digits+1;
+			else
+			{
+				*op++ = (char)0xFF;
+				for (int shift = 24; shift >= 0; shift -= 8)
+					*op++ = (char)(digits >> shift);
+			}
+		}
+		ne = op-pending;
+	}
+};
+
 template<typename Index>
 int StrValI<Index>::compare(const StrValI& comparand, CompareStyle style) const
 {
@@ -861,328 +1916,656 @@ int StrValI<Index>::compare(const StrValI& comparand, CompareStyle style) const
 	switch (style)
 	{
 	case CompareRaw:
-		cmp = memcmp(nthChar(0), comparand.nthChar(0), numBytes());
+		if (isSameSlice(comparand))
+			return (int)length() - (int)comparand.length();
+	{
+		Index		bytes = numBytes();
+		Index		comparand_bytes = comparand.numBytes();
+		cmp = memcmp(nthChar(0), comparand.nthChar(0), bytes < comparand_bytes ? bytes : comparand_bytes);
 		if (cmp == 0)
-			cmp = numBytes() - comparand.numBytes();
+			cmp = (int)bytes - (int)comparand_bytes;
 		return cmp;
+	}
 
 	case CompareCI:
-		assert(!"REVISIT: Case-independent comparison is not implemented");
+	{		// Skip equal ASCII quickly, and fold other characters one at a time
+		const char*	cp1 = nthChar(0);
+		const char*	ep1 = nthChar(length());
+		const char*	cp2 = comparand.nthChar(0);
+		const char*	ep2 = comparand.nthChar(comparand.length());
+		for (;;)
+		{
+			size_t		same = UTF8EqualPrefixCI(cp1, cp2, ep1-cp1 < ep2-cp2 ? ep1-cp1 : ep2-cp2);
+			cp1 += same;
+			cp2 += same;
+			if (cp1 == ep1 || cp2 == ep2)
+				return (cp1 != ep1) - (cp2 != ep2);	// The shorter one is first
+			UCS4		ch1 = UCS4ToFold(getChar(cp1));
+			UCS4		ch2 = UCS4ToFold(comparand.getChar(cp2));
+			if (ch1 != ch2)
+				return ch1 < ch2 ? -1 : 1;
+		}
+	}
 
 	case CompareNatural:
-		assert(!"REVISIT: Natural comparison is not implemented");
+	{		// ASCII other than digits and escapes is its own key, so skip where that's equal
+		const char*	cp1 = nthChar(0);
+		const char*	ep1 = nthChar(length());
+		const char*	cp2 = comparand.nthChar(0);
+		const char*	ep2 = comparand.nthChar(comparand.length());
+		while (cp1 < ep1 && cp2 < ep2 && *cp1 == *cp2
+		 && *cp1 > 1 && (*cp1 & 0x80) == 0 && !(*cp1 >= '0' && *cp1 <= '9'))
+			cp1++, cp2++;
+
+		NaturalKeyReader	key1(*this, cp1, ep1);
+		NaturalKeyReader	key2(comparand, cp2, ep2);
+		for (;;)
+		{
+			int	b1 = key1.next();
+			int	b2 = key2.next();
+			if (b1 != b2)
+				return b1 < b2 ? -1 : 1;
+			if (b1 < 0)
+				return 0;
+		}
+	}
 
 	default:
 		return 0;
 	}
 }
 
-// Allow ("str" + StrVal):
-template<typename Index = StrValIndex> StrValI<Index> operator+(const char* cp, const StrVal s)
+template<typename Index>
+size_t StrValI<Index>::hash() const
 {
-	return StrValI<Index>(cp) + s;
+	if (!isInline())
+	{
+		Body*	b = isRope() ? body->flat() : (Body*)body;
+		if (offset == 0 && length() == b->numChars())
+			return (size_t)b->hash();
+	}
+	Index		bytes;
+	const char*	cp = asUTF8(bytes);
+	return (size_t)UTF8Hash(cp, cp+bytes);
 }
 
+/*
+ * UTF8Hash of the folded characters, a bufferful at a time with the hash as the next seed.
+ * Characters that fold to ASCII are one byte. Others are four bytes, the first with its top
+ * bit set, which is cheaper than UTF-8 and can't be mistaken for ASCII.
+ */
 template<typename Index>
-void StrBodyI<Index>::transform(const std::function<Val(const char*& cp, const char* ep)> xform, int after)
+size_t StrValI<Index>::hashCI() const
 {
-	assert(ref_count <= 1);
-	char*		old_start = start;
-	size_t		old_num_elements = num_elements;
-
-	// Allocate new data, preserving the old
-	start = 0;
-	num_chars = 0;
-	num_elements = 0;
-	num_alloc = 0;
-	ArrayBody<char, Index>::resize(old_num_elements+6);		// Start with same allocation plus one character space
-
-	const char*	up = old_start;		// Input pointer
-	const char*	ep = old_start+old_num_elements-1;	// Termination guard, points to the NUL
-	Index		processed_chars = 0;	// Total input chars transformed
-	bool		stopped = false;	// Are we done yet?
-	char*		op = start;		// Output pointer
-	while (up < ep)
+	char		folded[256];
+	char*		op = folded;
+	uint64_t	h = 0;
+	const char*	cp = nthChar(0);
+	const char*	ep = nthChar(length());
+	while (cp < ep)
 	{
-		const char*	next = up;
-		if (processed_chars+1 > after+1	// Not yet reached the point to start transforming
-		 && !stopped)			// We have stopped transforming
+		if ((*cp & 0x80) == 0)
 		{
-			assert(next < ep);
-			StrVal		replacement = xform(next, ep);
-			Index		replaced_bytes = next-up;	// How many bytes were consumed?
-			Index		replaced_chars = replacement.length();	// Replaced by how many chars?
-
-			// Advance 'up' over the replaced characters
-			while (up < next)
-			{
-				up += UTF8Len(up);
-				processed_chars++;
-			}
-
-			stopped |= (replaced_bytes == 0);
-
-			Index		replacement_bytes;
-			const char*	rp = replacement.asUTF8(replacement_bytes);
-			ArrayBody<char, Index>::insert(num_elements, rp, replacement_bytes);
-			num_chars += replacement.length();
-			op = start+num_elements;
+			char	c = *cp++;
+			*op++ = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
 		}
 		else
-		{		// Just copy one character and move on
-			UCS4	ch = getChar(up);	// Get UCS4 character
-			processed_chars++;
-			if (num_alloc < (op-start+6+1))
+		{
+			UCS4	ch = UCS4ToFold(getChar(cp));
+			if (ch < 0x80)		// KELVIN SIGN folds to 'k', LONG S to 's'
+				*op++ = ch;
+			else
 			{
-				ArrayBody<char, Index>::resize((op-start)+6+1);	// Room for any char and NUL
-				op = start+num_elements;	// Reset our output pointer in case start has changed
+				op[0] = 0x80 | (ch >> 24);
+				op[1] = ch >> 16;
+				op[2] = ch >> 8;
+				op[3] = ch;
+				op += 4;
 			}
-			putChar(op, ch);
-			num_elements = op-start;
-			num_chars++;
+		}
+		if (op > folded+sizeof(folded)-4)
+		{		// Where each bufferful ends depends only on the folded text
+			h = UTF8Hash(folded, op, h);
+			op = folded;
 		}
 	}
-	// Append the \0 to the array:
-	ArrayBody<char, Index>::insert(num_elements, "", 1);
-	delete [] old_start;
+	return (size_t)UTF8Hash(folded, op, h);
 }
 
 template<typename Index>
-StrValI<Index>& StrValI<Index>::transform(const std::function<StrValI(const char*& cp, const char* ep)> xform, int after)
+void StrValI<Index>::putKeyChar(char*& op, UCS4 ch) const
 {
-	Unshare();
-	body->transform(xform, after);
-	num_chars = body->numChars();
-	mark = Bookmark();
-	return *this;
+	if (isRawBinary())
+		*op++ = (char)ch;
+	else if (ch == UCS4_NONE)
+		*op++ = (char)0xFF;
+	else if (UCS4IsIllegal(ch))
+	{
+		*op++ = (char)0xFE;
+		*op++ = (char)ch;
+	}
+	else
+		UTF8Put(op, ch);
 }
 
+/*
+ * A sort key is a raw binary StrVal. Comparing two keys (which uses memcmp)
+ * gives the order that compare() would give for the strings:
+ * - CompareRaw keys are just the UTF-8.
+ * - CompareCI keys are the folded characters in UTF-8 (which sorts like UCS4).
+ *   Illegal bytes become 0xFE then the byte, which sorts them last, as UCS4 does.
+ * - CompareNatural keys have the text as is, except that each run of digits
+ *   is '0', a length byte (or 0xFF and four bytes) and its significant digits,
+ *   so longer numbers sort later. NUL and 0x01 are escaped, so a NUL can end
+ *   this part. The raw UTF-8 follows it, so different strings always differ.
+ */
 template<typename Index>
-int32_t StrValI<Index>::asInt32(
-	ErrNum*	err_return,	// error return
-	int	radix,		// base for conversion
-	Index*	scanned		// characters scanned
-) const
+StrValI<Index> StrValI<Index>::sortKey(CompareStyle style) const
 {
-	Index		len = length();		// length of string
-	Index		i = 0;			// position of next character
-	UCS4		ch = 0;			// current character
-	int		d;			// current digit value
-	bool		negative = false;	// Was a '-' sign seen?
-	unsigned long	l = 0;			// Number being converted
-	unsigned long	last;
-	unsigned long	max;
-
-	if (err_return)
-		*err_return = 0;
+	const char*	cp = nthChar(0);
+	const char*	ep = nthChar(length());
+	size_t		max_bytes = (ep-cp)*6+8;	// No character needs more than this
+	if (style == CompareNatural)
+		max_bytes += ep-cp+1;		// The raw UTF-8 at the end
+	char		local[256];
+	char*		key = max_bytes <= sizeof(local) ? local : new char[max_bytes];
+	char*		op = key;
+	auto		put = [&](UCS4 ch) { putKeyChar(op, ch); };
 
-	// Check legal radix
-	if (radix < 0 || radix > 36)
+	switch (style)
 	{
-		if (err_return)
-			*err_return = ErrNum(STRERR_SET, STRERR_ILLEGAL_RADIX);
-		if (scanned)
-			*scanned = 0;
-		return 0;
-	}
-
-	// Skip leading white-space
-	while (i < len && UCS4IsWhite(ch = (*this)[i]))
-		i++;
-	if (i == len)
-		goto no_digits;
+	default:
+	case CompareRaw:
+		memcpy(op, cp, ep-cp);
+		op += ep-cp;
+		break;
 
-	// Check for sign character
-	if (ch == '+' || ch == '-')
-	{
-		i++;
-		negative = ch == '-';
-		while (i < len && UCS4IsWhite(ch = (*this)[i]))
-			i++;
-		if (i == len)
-			goto no_digits;
-	}
+	case CompareCI:
+		for (const char* up = cp; up < ep; )
+			put(UCS4ToFold(getChar(up)));
+		break;
 
-	if (radix == 0)		// Auto-detect radix (octal, decimal, binary)
-	{
-		if (UCS4Digit(ch) == 0 && i+1 < len)
+	case CompareNatural:
+		for (const char* up = cp; up < ep; )
 		{
-			// ch is the digit zero, look ahead
-			switch ((*this)[i+1])
+			const char*	sp = up;
+			UCS4		ch = getChar(up);
+			if (ch == 0 || ch == 1)
 			{
-			case 'b': case 'B':
-				if (radix == 0 || radix == 2)
-				{
-					radix = 2;
-					ch = (*this)[i += 2];
-					if (i == len)
-						goto no_digits;
-				}
-				break;
-			case 'x': case 'X':
-				if (radix == 0 || radix == 16)
+				*op++ = 1;
+				*op++ = ch+1;
+				continue;
+			}
+			if (isRawBinary() ? !(ch >= '0' && ch <= '9') : UCS4Digit(ch) < 0)
+			{
+				put(ch);
+				continue;
+			}
+
+			// Collect the significant digits of this number after the header:
+			char*		hp = op;
+			op += 6;
+			for (up = sp; up < ep; )
+			{
+				const char*	dp = up;
+				int		digit = isRawBinary() ? getChar(up)-'0' : UCS4Digit(getChar(up));
+				if (digit < 0 || digit > 9)
 				{
-					radix = 16;
-					ch = (*this)[i += 2];
-					if (i == len)
-						goto no_digits;
+					up = dp;
+					break;
 				}
-				break;
-			default:
-				if (radix == 0)
-					radix = 8;
-				break;
+				if (digit > 0 || op > hp+6)	// Skip leading zeroes
+					*op++ = '0'+digit;
 			}
+			size_t		digits = op-(hp+6);
+			*hp++ = '0';
+			if (digits < 254)
+				*hp++ = digits+1;
+			else
+			{
+				*hp++ = (char)0xFF;
+				for (int shift = 24; shift >= 0; shift -= 8)
+					*hp++ = (char)(digits >> shift);
+			}
+			memmove(hp, op-digits, digits);
+			op = hp+digits;
 		}
+		*op++ = '\0';
+		memcpy(op, cp, ep-cp);
+		op += ep-cp;
+		break;
+	}
+
+	StrValI		k;
+	if (op > key)
+		k = StrValI(Body::create(key, StrRawBinary, op-key));
+	if (key != local)
+		delete[] key;
+	return k;
+}
+
+/*
+ * A StrVal with its sort key, so sorts and ordered maps like CowMap make
+ * the key once per string rather than doing the work for every comparison.
+ */
+class	StrSortKey
+{
+public:
+	StrSortKey() {}
+	StrSortKey(const StrVal& s, StrVal::CompareStyle style = StrVal::CompareRaw)
+			: val(s), key(s.sortKey(style)) {}
+
+	const StrVal&	value() const { return val; }
+	const StrVal&	sortKey() const { return key; }
+
+	int		compare(const StrSortKey& k) const { return key.compare(k.key); }
+	bool		operator==(const StrSortKey& k) const { return key == k.key; }
+	bool		operator!=(const StrSortKey& k) const { return key != k.key; }
+	bool		operator<(const StrSortKey& k) const { return key < k.key; }
+	bool		operator<=(const StrSortKey& k) const { return key <= k.key; }
+	bool		operator>=(const StrSortKey& k) const { return key >= k.key; }
+	bool		operator>(const StrSortKey& k) const { return key > k.key; }
+
+private:
+	StrVal		val;
+	StrVal		key;
+};
+
+// Functors for case-independent keys in std::map and std::unordered_map:
+struct	StrValLessCI
+{
+	bool		operator()(const StrVal& s1, const StrVal& s2) const
+			{ return s1.compare(s2, StrVal::CompareCI) < 0; }
+};
+
+struct	StrValHashCI
+{
+	size_t		operator()(const StrVal& s) const
+			{ return s.hashCI(); }
+};
+
+// StrVal and StrRef can key std::unordered_map and std::unordered_set directly:
+namespace std
+{
+	template<typename Index> struct hash<StrValI<Index>>
+	{
+		size_t		operator()(const StrValI<Index>& s) const
+				{ return s.hash(); }
+	};
+	template<typename Index> struct hash<StrRefI<Index>>
+	{
+		size_t		operator()(const StrRefI<Index>& s) const
+				{ return StrValI<Index>(s).hash(); }
+	};
+}
+
+struct	StrValEqualCI
+{
+	bool		operator()(const StrVal& s1, const StrVal& s2) const
+			{ return s1.equalCI(s2); }
+};
+
+// Allow ("str" + StrVal):
+template<typename Index = StrValIndex> StrValI<Index> operator+(const char* cp, const StrVal s)
+{
+	return StrValI<Index>(cp) + s;
+}
+
+template<typename Index>
+char* StrBodyI<Index>::convertCaseInPlace(char* cp, const char* ep, bool upper)
+{
+	for (;;)
+	{
+		cp = UTF8ASCIIToCase(cp, ep, upper);
+		if (cp >= ep)
+			return cp;
+		const char*	np = cp;
+		UCS4		ch = UTF8Get(np);
+		UCS4		mapped = upper ? UCS4ToUpper(ch) : UCS4ToLower(ch);
+		if (mapped == ch)
+			cp = (char*)np;
+		else if (UTF8Len(mapped) == np-cp)
+			UTF8Put(cp, mapped);
 		else
-			radix = 10;
+			return cp;
 	}
+}
 
-	// Check there's at least one digit:
-	if ((d = Digit(ch, radix)) < 0)
-		goto not_number;
-
-	max = (ULONG_MAX-1)/radix + 1;
-	// Convert digits
-	do {
-		i++;			// We're definitely using this char
-		last = l;
-		if (l > max		// Detect *unsigned* long overflow
-		 || (l = l*radix + d) < last)
-		{
-			// Overflowed unsigned long!
-			if (err_return)
-				*err_return = ErrNum(STRERR_SET, STRERR_NUMBER_OVERFLOW);
-			if (scanned)
-				*scanned = i;
-			return 0;
-		}
-	} while (i < len && (d = Digit((*this)[i], radix)) >= 0);
+/*
+ * Case conversion maps each character to one character, so the count (and
+ * whether it's all ASCII) stays the same. Only if a character changes its
+ * UTF-8 length is the rest converted into new memory.
+ */
+template<typename Index>
+void StrBodyI<Index>::convertCase(bool upper)
+{
+	assert(this->GetRefCount() <= 1);
+	char*		ep = start+num_elements-1;
+	hash_code = 0;
+	if (isRawBinary())
+	{		// Only the ASCII letters have case
+		for (char* cp = start; (cp = UTF8ASCIIToCase(cp, ep, upper)) < ep; cp++)
+			;
+		return;
+	}
 
-	if (err_return)
-		*err_return = 0;
+	char*		cp = convertCaseInPlace(start, ep, upper);
+	if (cp >= ep)
+		return;
+
+	char*		converted = new char[(ep-cp)*3+1];	// No character grows more than this
+	char*		op = converted;
+	for (const char* up = cp; up < ep; )
+	{
+		const char*	sp = up;
+		UCS4		ch = UTF8Get(up);
+		UCS4		mapped = upper ? UCS4ToUpper(ch) : UCS4ToLower(ch);
+		if (mapped == ch)
+		{		// Copy it exactly, even if it's not UTF-8
+			memcpy(op, sp, up-sp);
+			op += up-sp;
+		}
+		else
+			UTF8Put(op, mapped);
+	}
+	Index		done = cp-start;
+	Body::remove(done);
+	Body::insert(done, converted, op-converted);
+	Body::insert(num_elements, "", 1);
+	delete[] converted;
+	delete[] checkpoints.exchange(0);	// The byte offsets have changed
+}
 
-	// Check for trailing non-white characters
-	while (i < len && UCS4IsWhite((*this)[i]))
-		i++;
-	if (i != len && err_return)
-		*err_return = ErrNum(STRERR_SET, STRERR_TRAIL_TEXT);
+template<typename Index>
+template<typename Xform, typename>
+void StrBodyI<Index>::transform(Xform xform, int after)
+{
+	assert(this->GetRefCount() <= 1);
+	const char*	cp = start;
+	const char*	ep = start+num_elements-1;	// Termination guard, points to the NUL
+	StrSink		sink(isRawBinary(), num_elements+num_elements/8+6);
 
-	// Return number of digits scanned
-	if (scanned)
-		*scanned = i;
+	// Copy the characters before the transformation starts
+	for (int skip = after+1; skip > 0 && cp < ep; skip--)
+		cp += isRawBinary() ? 1 : UTF8Len(cp);
+	sink.appendBytes(start, cp-start);
 
-	if (l > (unsigned long)LONG_MAX+(negative ? 1 : 0))
+	while (cp < ep)
 	{
-		if (err_return)
-			*err_return = ErrNum(STRERR_SET, STRERR_NUMBER_OVERFLOW);
-		// Try anyway, they might have wanted unsigned!
+		const char*	next = cp;
+		xform(next, ep, sink);
+		if (next == cp)
+			break;		// Stopped transforming
+		cp = next;
 	}
+	if (cp < ep)
+		sink.appendBytes(cp, ep-cp);	// Copy the untransformed remainder
+	adopt(sink);
+}
 
-	/*
-	 * Casting unsigned long down to long doesn't clear the high bit
-	 * on a twos-complement architecture:
-	 */
-	return negative ? -(long)l : (long)l;
+template<typename Index>
+void StrBodyI<Index>::transform(const std::function<Val(const char*& cp, const char* ep)> xform, int after)
+{
+	transform(
+		[&](const char*& cp, const char* ep, StrSink& sink)
+		{
+			sink.append(xform(cp, ep));
+		},
+		after
+	);
+}
+
+template<typename Index>
+void StrBodyI<Index>::adopt(StrSink& sink)
+{
+	assert(this->GetRefCount() <= 1);
+	if (!sink.buf)
+		sink.grow(0);
+	*sink.op = '\0';		// There's always room for the NUL
+	Index		length = Body::checkLength(sink.op-sink.buf+1);	// Before we let go of our data
+	size_t		allocated = sink.limit-sink.buf+1;
+
+	Index		old_alloc = num_alloc;
+	if (inline_data)
+		Body::destroyInline(old_alloc);	// The old data is part of this Body's memory
+	else if (start && old_alloc > 0)
+		Body::deleteElements(start, old_alloc);	// Don't delete borrowed data
+	inline_data = false;
+	start = sink.buf;
+	num_elements = length;
+	num_alloc = allocated < Body::maxLength() ? allocated : Body::maxLength();	// Any excess goes unused
+	sink.buf = sink.op = sink.limit = 0;
+	if (sink.raw_binary)
+		num_chars = RawBinaryMarker;
+	uncount();
+}
+
+template<typename Index>
+StrValI<Index>& StrValI<Index>::transform(const std::function<StrValI(const char*& cp, const char* ep)> xform, int after)
+{
+	Unshare();
+	body->transform(xform, after);
+	num_chars = body->numChars();
+	mark = Bookmark();
+	return *this;
+}
 
-no_digits:
+template<typename Index>
+int32_t StrValI<Index>::asInt32(
+	ErrNum*	err_return,	// error return
+	int	radix,		// base for conversion
+	Index*	scanned		// characters scanned
+) const
+{
+	ErrNum		e;
+	int64_t		l = asInt64(&e, radix, scanned);
+
+	if ((!e || e == STRERR_TRAIL_TEXT)
+	 && (l < INT32_MIN || l > INT32_MAX))
+		e = STRERR_NUMBER_OVERFLOW;	// Try anyway, they might have wanted unsigned!
 	if (err_return)
-		*err_return = ErrNum(STRERR_SET, STRERR_NO_DIGITS);
-	if (scanned)
-		*scanned = i;
-	return 0;
+		*err_return = e;
+	return (int32_t)(uint32_t)l;
+}
 
-not_number:
+template<typename Index>
+int64_t StrValI<Index>::asInt64(ErrNum* err_return, int radix, Index* scanned) const
+{
+	Index		bytes;
+	const char*	start = asUTF8(bytes);
+	const char*	cp = start;
+	uint64_t	magnitude;
+	bool		negative;
+	UTF8NumberStatus	status = UTF8GetInteger(cp, start+bytes, radix, magnitude, negative);
+	ErrNum		e = numberStatus(status, start, cp, start+bytes, scanned);
+
+	if ((!e || e == STRERR_TRAIL_TEXT)
+	 && magnitude > (uint64_t)INT64_MAX+(negative ? 1 : 0))
+		e = STRERR_NUMBER_OVERFLOW;	// Try anyway, they might have wanted unsigned!
 	if (err_return)
-		*err_return = ErrNum(STRERR_SET, STRERR_NOT_NUMBER);
-	if (scanned)
-		*scanned = i;
-	return 0;
+		*err_return = e;
+	return negative ? (int64_t)(0-magnitude) : (int64_t)magnitude;
+}
+
+template<typename Index>
+uint64_t StrValI<Index>::asUInt64(ErrNum* err_return, int radix, Index* scanned) const
+{
+	Index		bytes;
+	const char*	start = asUTF8(bytes);
+	const char*	cp = start;
+	uint64_t	magnitude;
+	bool		negative;
+	UTF8NumberStatus	status = UTF8GetInteger(cp, start+bytes, radix, magnitude, negative);
+	ErrNum		e = numberStatus(status, start, cp, start+bytes, scanned);
+
+	if ((!e || e == STRERR_TRAIL_TEXT) && negative && magnitude != 0)
+		e = STRERR_NUMBER_OVERFLOW;
+	if (err_return)
+		*err_return = e;
+	return negative ? 0-magnitude : magnitude;
+}
+
+template<typename Index>
+double StrValI<Index>::asDouble(ErrNum* err_return, Index* scanned) const
+{
+	Index		bytes;
+	const char*	start = asUTF8(bytes);
+	const char*	cp = start;
+	double		value;
+	UTF8NumberStatus	status = UTF8GetDouble(cp, start+bytes, value);
+	ErrNum		e = numberStatus(status, start, cp, start+bytes, scanned);
+
+	if (err_return)
+		*err_return = e;
+	return value;
 }
 
 /*
  * Represent the string as JSON, using UTF16 surrogates if necessary.
  * Does not include the enclosing double-quote characters that are part of the JSON spec.
+ * Clean runs are found by a vector scan and copied in bulk, after a counting pass
+ * that sizes the output exactly.
  */
 template<typename Index>
 void
-StrBodyI<Index>::toJSON()
+StrBodyI<Index>::toJSON(bool ascii_only)
+{
+	assert(this->GetRefCount() <= 1);
+	const char*	ep = start+num_elements-1;
+	size_t		bytes = escapeJSON(0, start, ep, isRawBinary(), ascii_only);
+	if (bytes == (size_t)(ep-start))
+		return;			// Nothing needs escaping
+
+	StrSink		sink(isRawBinary(), bytes);
+	char*		op = sink.reserve(bytes);
+	sink.commit(op+escapeJSON(op, start, ep, isRawBinary(), ascii_only));
+	adopt(sink);
+}
+
+template<typename Index>
+size_t
+StrBodyI<Index>::escapeJSON(char* op, const char* cp, const char* ep, bool raw, bool ascii_only)
 {
-	char		one_char[14];			// \u{12345678} or \u1234\u4321
-	StrBodyI	temp_body;
 	static const char hex[] = "0123456789ABCDEF";
+	bool		high = !raw || ascii_only;	// Non-ASCII bytes need a closer look
+	size_t		out = 0;			// Output bytes
+	char		escape[12];			// \u1234\u4321
+	auto		emit = [&](const char* from, size_t len)
+			{
+				if (op)
+					memcpy(op+out, from, len);
+				out += len;
+			};
 
-	transform(
-		[&](const char*& cp, const char* ep) -> Val
+	while (cp < ep)
+	{
+		const char*	sp = UTF8FindJSONEscape(cp, ep, high);
+		if (!sp)
+			sp = ep;
+		emit(cp, sp-cp);		// Copy the clean run
+
+		// Handle escapes and non-ASCII characters, until the next clean ASCII byte:
+		const char*	unchanged = cp = sp;	// Start of characters to copy as they are
+		while (cp < ep)
 		{
-			UCS4	ch = getChar(cp);
-			char*	op = one_char;		// Pack it into our local buffer
+			unsigned char	b = *cp;
+			if (b >= ' ' && b < 0x80 && b != '"' && b != '\\' && b != '/')
+				break;		// Back to the scanner
+			if (b >= 0xC2 && !raw && !ascii_only)
+			{		// Well-formed 2- and 3-byte characters (not overlong or surrogates) are unchanged
+				if (b < 0xE0 && ep-cp >= 2 && (cp[1]&0xC0) == 0x80)
+				{
+					cp += 2;
+					continue;
+				}
+				if (b < 0xF0 && b != 0xE0 && b != 0xED && ep-cp >= 3 && (cp[1]&0xC0) == 0x80 && (cp[2]&0xC0) == 0x80)
+				{
+					cp += 3;
+					continue;
+				}
+			}
+
+			const char*	next = cp;
+			UCS4		ch = raw || b < 0x80 ? (UCS4)b : UTF8Get(next);
+			if (next == cp)
+				next++;
+			char*		xp = escape;
 			switch (ch)
 			{
 			case '\0':	// Null Byte
-				*op++ = '\\'; *op++ = '0'; break;
+				*xp++ = '\\'; *xp++ = 'u'; *xp++ = '0'; *xp++ = '0'; *xp++ = '0'; *xp++ = '0'; break;
 			case '\"':	// Double quote
-				*op++ = '\\'; *op++ = '\"'; break;
+				*xp++ = '\\'; *xp++ = '\"'; break;
 			case '\\':	// Backslash character
-				*op++ = '\\'; *op++ = '\\'; break;
+				*xp++ = '\\'; *xp++ = '\\'; break;
 			case '/':	// Forward slash
-				*op++ = '\\'; *op++ = '/'; break;
+				*xp++ = '\\'; *xp++ = '/'; break;
 			case '\b':	// Backspace
-				*op++ = '\\'; *op++ = 'b'; break;
+				*xp++ = '\\'; *xp++ = 'b'; break;
 			case '\f':	// Form Feed
-				*op++ = '\\'; *op++ = 'f'; break;
+				*xp++ = '\\'; *xp++ = 'f'; break;
 			case '\n':	// New Line
-				*op++ = '\\'; *op++ = 'n'; break;
+				*xp++ = '\\'; *xp++ = 'n'; break;
 			case '\r':	// Carriage Return
-				*op++ = '\\'; *op++ = 'r'; break;
+				*xp++ = '\\'; *xp++ = 'r'; break;
 			case '\t':	// Tab
-				*op++ = '\\'; *op++ = 't'; break;
+				*xp++ = '\\'; *xp++ = 't'; break;
 
 			default:
 				// JSON allows direct representation of any legal code point that's not
 				// a control-char, \, ' or a surrogate, but we don't have to do that.
-				// Here we leave valid UTF-16 characters inline, represented as UTF-8
-
-				// REVISIT: Handle StrRawBinary data
-				// if (ch >= ' ' && ch < 128)			// ASCII but not ctl
-				// if (ch >= ' ' && ch < 256)			// ISO8859-1 but not ctl
-				if (ch >= ' '
-				 && (ch <= 0xFFFF && !UTF16IsSurrogate(ch))	// Not ctl, emoji or surrogate 
-				  || (ch <= 0xFF && isRawBinary()))		// Just 8-bit
-				{
-					putChar(op, ch);
-					break;
-				}
+				// Here we leave valid UTF-16 characters inline, represented as UTF-8,
+				// and raw binary bytes as they are.
+				if (ch >= ' ' && !ascii_only
+				 && (raw || (ch <= 0xFFFF && !UTF16IsSurrogate(ch))))
+					break;		// Copy it unchanged
 
 				// Use \u1234 format, as a surrogate pair if needed, per JSON spec
-				auto	u4 = [](unsigned short u, char*& op){
-						*op++ = '\\';
-						*op++ = 'u';
-						*op++ = hex[(u>>12)&0xF];
-						*op++ = hex[(u>>8)&0xF];
-						*op++ = hex[(u>>4)&0xF];
-						*op++ = hex[u&0xF];
+				auto	u4 = [](unsigned short u, char*& xp){
+						*xp++ = '\\';
+						*xp++ = 'u';
+						*xp++ = hex[(u>>12)&0xF];
+						*xp++ = hex[(u>>8)&0xF];
+						*xp++ = hex[(u>>4)&0xF];
+						*xp++ = hex[u&0xF];
 					};
 				if (ch <= 0xFFFF)
-				{		// Character fits in one \u escape, do that
-					u4(ch, op);
-					break;
+					u4(ch, xp);	// Character fits in one \u escape, do that
+				else if (UCS4IsUnicode(ch))
+				{		// We need two surrogates for Emoji's etc.
+					u4(UCS4HighSurrogate(ch), xp);
+					u4(UCS4LowSurrogate(ch), xp);
 				}
-
-				// We need two surrogates for Emoji's etc.
-				assert(ch <= 0xFFFFF);
-				// Surrogate pair: D800 to DBFF, Low surrogate: D800 to DBFF
-				u4(0xD800+((ch>>10)&0x3FF), op);
-				u4(0xDC00+(ch&0x3FF), op);
+				else
+					u4(0xFFFD, xp);	// An illegal byte, or not Unicode: use the replacement character
 				break;
 			}
-			*op = '\0';
-
-			// Assign this to the body in our closure
-			temp_body = StrBodyI(one_char, StrStatic, op-one_char);
-			return Val(&temp_body);
+			if (xp != escape)
+			{
+				emit(unchanged, cp-unchanged);
+				emit(escape, xp-escape);
+				unchanged = next;
+			}
+			cp = next;
 		}
-	);
+		emit(unchanged, cp-unchanged);
+	}
+	return out;
+}
+
+inline StrVal
+StrBuilder::take()
+{
+	size_t	bytes = length();
+	if (bytes <= StrVal::InlineMax)
+	{		// Keep the buffer for re-use
+		StrVal	built(buf, bytes);
+		clear();
+		return built;
+	}
+	StrBody*	body = new StrBody();
+	body->adopt(*this);
+	return StrVal(body);
 }
 
 class	StringArray
@@ -1193,13 +2576,15 @@ public:
 	StringArray() {}
 	StringArray(const Base& a1) : Base(a1) {}
 	StringArray(const StrVal* data, Index size, Index allocate = 0)
-	: Array(data, size, allocate)
-	{
+	: Array((const StrRef*)0, 0, allocate > size ? allocate : size)
+	{		// Each StrVal is converted, in case it's inline
+		for (Index i = 0; i < size; i++)
+			append(data[i]);
 	}
 
 	// Construct from an Array of const char*
 	StringArray(const Array<const char*> strings)
-	: Array((const StrVal*)0, 0, strings.length())
+	: Array((const StrRef*)0, 0, strings.length())
 	{
 		strings.each([&](const char* s) { append(s); });
 	}
@@ -0,0 +1,51 @@
+#if !defined(UTF8_NUMBER_H)
+#define UTF8_NUMBER_H
+/*
+ * Conversion of numbers to and from UTF-8 text.
+ *
+ * These work directly on the bytes, advancing cp past the characters used
+ * or written.
+ * Any Unicode white-space may precede the number and follow its sign, and
+ * integers may use the digits of any Unicode script, as StrVal always has.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<cstdint>
+#include	<char_encoding.h>
+
+typedef enum {
+	UTF8NumberOK = 0,
+	UTF8NumberNoDigits,		// There was only white-space
+	UTF8NumberNotNumber,		// The first non-blank character was non-numeric
+	UTF8NumberOverflow,		// The number doesn't fit (cp is left after the digit that overflowed)
+	UTF8NumberIllegalRadix		// The radix was not 0 or 2..36
+} UTF8NumberStatus;
+
+/*
+ * Get an integer, returning its magnitude and whether it had a '-' sign.
+ * Radix 0 means use C rules: 0x means hexadecimal, 0b binary, and 0 octal.
+ */
+UTF8NumberStatus UTF8GetInteger(const UTF8*& cp, const UTF8* ep, int radix, uint64_t& magnitude, bool& negative);
+
+/*
+ * Get a decimal number with an optional fraction and exponent (or inf,
+ * infinity or nan), correctly rounded to the nearest double. Overflow
+ * returns an infinity.
+ */
+UTF8NumberStatus UTF8GetDouble(const UTF8*& cp, const UTF8* ep, double& value);
+
+const int	UTF8MaxInteger = 20;	// Bytes needed for any 64-bit integer, with its sign
+const int	UTF8MaxDouble = 25;	// Bytes needed for any double, as from UTF8PutDouble
+
+// Put an integer in decimal. There must be room for UTF8MaxInteger bytes
+void		UTF8PutInteger(UTF8*& cp, uint64_t magnitude, bool negative = false);
+
+/*
+ * Put a double with the fewest digits that UTF8GetDouble will convert back to
+ * the same value, in fixed-point if its magnitude is between 1e-6 and 1e21 and
+ * in scientific notation otherwise (as JavaScript does). There must be room
+ * for UTF8MaxDouble bytes.
+ */
+void		UTF8PutDouble(UTF8*& cp, double value);
+
+#endif
@@ -0,0 +1,72 @@
+#if !defined(UTF8_SCAN_H)
+#define UTF8_SCAN_H
+/*
+ * Bulk scanning of UTF-8 data.
+ *
+ * These functions work on whole buffers rather than single characters, and
+ * use SSE2 or AVX2 vector instructions where the processor has them (chosen
+ * at runtime), with a portable scalar implementation otherwise. Their results
+ * are always identical to a character-by-character scan using UTF8Get().
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<cstddef>
+#include	<cstdint>
+#include	<char_encoding.h>
+
+/*
+ * Count the characters in [cp, ep) the same way repeated UTF8Get() would:
+ * each illegal byte counts as one character, and a sequence that overlaps
+ * ep (or decodes to UCS4_NONE) truncates the count there.
+ *
+ * If ascii is provided, it's set true only if every byte is 7-bit ASCII.
+ * If valid is provided, it's set true only if every character is a
+ * structurally correct UTF-8 sequence of 1-4 bytes.
+ */
+size_t		UTF8CountChars(const UTF8* cp, const UTF8* ep, bool* ascii = 0, bool* valid = 0);
+
+/*
+ * Find the first or last occurrence of needle in [cp, ep), returning a
+ * pointer to it or 0 if there is none. An empty needle is found at cp (or
+ * ep). UTF8Get never consumes an ASCII or lead byte as part of an earlier
+ * character, so a needle starting with one is only ever found at the start
+ * of a character.
+ */
+const UTF8*	UTF8Find(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes);
+const UTF8*	UTF8RFind(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes);
+
+/*
+ * Find the first or last byte in [cp, ep) that is in a class (or not in it,
+ * if wanted is false), returning a pointer to it or 0 if there is none. The
+ * class contains the ASCII bytes whose bits are set in ascii[2], and all
+ * bytes above 0x7F if high is true.
+ */
+const UTF8*	UTF8FindClass(const UTF8* cp, const UTF8* ep, const uint64_t* ascii, bool high, bool wanted = true);
+const UTF8*	UTF8RFindClass(const UTF8* cp, const UTF8* ep, const uint64_t* ascii, bool high, bool wanted = true);
+
+/*
+ * Return how many leading bytes of cp1 and cp2 (up to bytes) are ASCII and
+ * the same when ASCII letters are folded to lower case.
+ */
+size_t		UTF8EqualPrefixCI(const UTF8* cp1, const UTF8* cp2, size_t bytes);
+
+/*
+ * Convert the ASCII letters from cp to lower (or upper) case in place,
+ * stopping at the first non-ASCII byte. Returns a pointer to that byte, or ep.
+ */
+UTF8*		UTF8ASCIIToCase(UTF8* cp, const UTF8* ep, bool upper);
+
+/*
+ * Find the first byte in [cp, ep) that a JSON string can't contain as-is: a
+ * control character, double quote, backslash or slash, or (if high is true)
+ * any byte above 0x7F. Returns 0 if there is none.
+ */
+const UTF8*	UTF8FindJSONEscape(const UTF8* cp, const UTF8* ep, bool high);
+
+/*
+ * A fast 64-bit hash of the bytes in [cp, ep). It isn't cryptographic,
+ * and the value may differ between platforms, so don't store it.
+ */
+uint64_t	UTF8Hash(const UTF8* cp, const UTF8* ep, uint64_t seed = 0);
+
+#endif
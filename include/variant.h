@@ -45,6 +45,17 @@ public:
 
 	VariantType		type() const { return _type; }
 	bool			is_null() const { return _type == None; }
+	void			share() const		// Call before handing this to another thread
+	{
+		switch (_type)
+		{
+		case String:		u.str.share(); break;
+		case StrArray:		u.str_arr.share(); break;
+		case VarArray:		u.var_arr.share(); break;
+		case StrVarMap:		u.var_map.share(); break;
+		default:		break;
+		}
+	}
 	static const char*	type_names[];
 	const char*		type_name() const
 	{
@@ -66,15 +77,15 @@ public:
 	Variant(long long _ll)						// LongLong
 	{ _type = LongLong; u.ll = _ll; }
 	Variant(StrVal v)						// StrRef
-	{ _type = String; new(&u.str) StrRef(v); }
+	{ _type = String; new(&u.str) StrRef(v.pass()); }
 	Variant(const char* s)						// StrRef
 	{ _type = String; new(&u.str) StrRef(s); }
 	Variant(StringArray a)						// StrArray
-	{ _type = StrArray; new(&u.str_arr) StringArray(a); }
+	{ _type = StrArray; new(&u.str_arr) StringArray(std::move(a)); }
 	Variant(StrVal* v, StringArray::Index count)
 	{ _type = StrArray; new(&u.str_arr) StringArray(v, count); }
 	Variant(VariantArray a)						// VarArray
-	{ _type = VarArray; new(&u.str_arr) VariantArray(a); }
+	{ _type = VarArray; new(&u.var_arr) VariantArray(a.pass()); }
 	Variant(Variant* v, VariantArray::Index count)
 	{ _type = VarArray; new(&u.var_arr) VariantArray(v, count); }
 	Variant(StrVal* keys, Variant* values, StringArray::Index count)	// StrVarMap
@@ -84,7 +95,7 @@ public:
 			u.var_map.insert(keys[i], values[i]);
 	}
 	Variant(StrVariantMap map)					// StrVarMap
-	{ _type = StrVarMap; u.var_map = map; }
+	{ _type = StrVarMap; new(&u.var_map) StrVariantMap(std::move(map)); }
 
 	// Default-initialise any _type
 	Variant(VariantType t)
@@ -166,72 +177,96 @@ public:
 	// as_json(-2) emits maximally compact JSON.
 	// as_json(n) emits formatted/indented json (two spaces per level) starting with indent n.
 	StrVal			as_json(int indent = -1) const
+	{
+		StrBuilder	json;
+		append_json(json, indent);
+		return json.take();
+	}
+
+	// Append the JSON to a StrBuilder, without making intermediate strings
+	void			append_json(StrBuilder& json, int indent = -1) const
 	{
 		int		next_indent = indent;
 		StrVal		sep;			// Separator string between array or map items
 		switch (indent)
 		{
-		case -2:	sep = ","; break;	// Tight
-		case -1:	sep = ", "; break;	// Compact
+		case -2:	sep = StrValLiteral(","); break;	// Tight
+		case -1:	sep = StrValLiteral(", "); break;	// Compact
 		default:	next_indent = indent+1;	// Indented
-				sep = StrVal(",\n")+StrVal("  ")*next_indent;
+				sep = StrValLiteral(",\n")+StrValLiteral("  ")*next_indent;
 				break;
 		}
+		StrVal		open = sep.substr(1);	// Follows the opening bracket or brace
+		StrVal		close = open.shorter(2);	// Precedes the closing one
 
-		char	buf[2+sizeof(long long)*5/2];	// long enough for decimal long long, sign and nul
 		switch (_type)
 		{
 		default:                
-			return "REVISIT: Data corruption (Variant::_type)";
+			json.append("REVISIT: Data corruption (Variant::_type)");
+			return;
 
 		case None:		// FALL THROUGH
-			return "null";
+			json.append("null");
+			return;
 
 		case Integer:		// FALL THROUGH
-			snprintf(buf, sizeof(buf), "%d", u.i);
-			return buf;	// StrVal copies the data
+			json.appendInt(u.i);
+			return;
 
 		case Long:		
-			snprintf(buf, sizeof(buf), "%ld", u.l);
-			return buf;
+			json.appendInt(u.l);
+			return;
 
 		case LongLong:		
-			snprintf(buf, sizeof(buf), "%lld", u.ll);
-			return buf;
+			json.appendInt(u.ll);
+			return;
 
 		case String:
-			return StrVal("\"")+StrVal(u.str).asJSON()+"\"";
+			json.appendChar('"');
+			StrVal(u.str).appendJSON(json);
+			json.appendChar('"');
+			return;
 
 		case StrArray:
-			{
-			StrVal		str(StrVal("[")+sep.substr(1));
+			json.appendChar('[');
+			json.append(open);
 			for (int i = 0; i < u.str_arr.length(); i++)
-				str += (i > 0 ? sep : StrVal())
-				    + Variant(u.str_arr[i]).as_json(next_indent);
-			return str+sep.substr(1).shorter(2)+"]";
+			{
+				if (i > 0)
+					json.append(sep);
+				Variant(u.str_arr[i]).append_json(json, next_indent);
 			}
+			json.append(close);
+			json.appendChar(']');
+			return;
 
 		case VarArray:
-			{
-			StrVal		str(StrVal("[")+sep.substr(1));
+			json.appendChar('[');
+			json.append(open);
 			for (int i = 0; i < u.var_arr.length(); i++)
-				str += (i > 0 ? sep : StrVal())
-				    + u.var_arr[i].as_json(next_indent);
-			return str+sep.substr(1).shorter(2)+"]";
+			{
+				if (i > 0)
+					json.append(sep);
+				u.var_arr[i].append_json(json, next_indent);
 			}
+			json.append(close);
+			json.appendChar(']');
+			return;
 
 		case StrVarMap:
-			{
-			StrVal		str(StrVal("{")+sep.substr(1));
+			json.appendChar('{');
+			json.append(open);
 			for (auto iter = u.var_map.begin(); iter != u.var_map.end(); iter++)
 			{
-				str += (iter != u.var_map.begin() ? sep : StrVal())
-				    + Variant((*iter).first).as_json()
-				    + (indent==-2 ? ":" : ": ")
-				    + (*iter).second.as_json(next_indent);
-			}
-			return str+sep.substr(1).shorter(2)+"}";
+				if (iter != u.var_map.begin())
+					json.append(sep);
+				Variant((*iter).first).append_json(json);
+				json.append(indent==-2 ? ":" : ": ");
+				(*iter).second.append_json(json, next_indent);
 			}
+			json.append(close);
+			json.appendChar('}');
+			return;
 		}
 	}
 
@@ -276,6 +311,7 @@ protected:
 
 		ErrNum		e;
 		int32_t		i32;
+		int64_t		i64;
 		switch (new_type)
 		{
 		default:		// FALL THROUGH
@@ -292,8 +328,9 @@ protected:
 			case LongLong:	if (u.ll != (int)u.ll) break;	// Fail if it would truncate
 					u.i = (int)u.ll; return;
 			case String:	i32 = StrVal(u.str).asInt32(&e, 0);
-					if (!e)				// Some error in conversion
+					if (e)				// Some error in conversion
 						break;
+					coerce_none();
 					u.i = i32;
 					_type = new_type;
 					return;
@@ -312,10 +349,11 @@ protected:
 			case Long:	return; // Already handled
 			case LongLong:	if (u.ll != (long)u.ll) break;	// Fail if it would truncate
 					u.l = (long)u.ll; return;
-			case String:	i32 = StrVal(u.str).asInt32(&e, 0);	// REVISIT: int32 only, or it fails
-					if (!e)				// Some error in conversion
+			case String:	i64 = StrVal(u.str).asInt64(&e, 0);
+					if (e || i64 != (long)i64)	// Some error in conversion
 						break;
-					u.l = i32;
+					coerce_none();
+					u.l = (long)i64;
 					_type = new_type;
 					return;
 			case None:		// FALL THROUGH
@@ -332,10 +370,11 @@ protected:
 			case Integer:	u.l = u.i; return;
 			case Long:	u.ll = u.l; return;
 			case LongLong:	return; // Already handled
-			case String:	i32 = StrVal(u.str).asInt32(&e, 0);	// REVISIT: int32 only, or it fails
+			case String:	i64 = StrVal(u.str).asInt64(&e, 0);
 					if (e)				// Some error in conversion
 						break;
-					u.ll = i32;
+					coerce_none();
+					u.ll = i64;
 					_type = new_type;
 					return;
 			case None:		// FALL THROUGH
@@ -349,15 +388,11 @@ protected:
 		case String:
 			switch (old_type)
 			{
-			char buf[24];	// Big enough for 64-bit integer
-			case Integer:	snprintf(buf, sizeof(buf), "%d", u.i);
-					*this = StrVal(buf);
+			case Integer:	*this = StrVal::fromInt(u.i);
 					return;
-			case Long:	snprintf(buf, sizeof(buf), "%ld", u.l);
-					*this = StrVal(buf);
+			case Long:	*this = StrVal::fromInt(u.l);
 					return;
-			case LongLong:	snprintf(buf, sizeof(buf), "%lld", u.ll);
-					*this = StrVal(buf);
+			case LongLong:	*this = StrVal::fromInt(u.ll);
 					return;
 			case String:	return; // Already handled
 			case None:		// FALL THROUGH
@@ -0,0 +1,108 @@
+/*
+ * Sets of Unicode characters.
+ *
+ * Searches find candidate bytes with UTF8FindClass, and only decode the
+ * non-ASCII characters among them. When the set has non-ASCII members,
+ * every non-ASCII byte is a candidate for findAny; findNot must look at
+ * every non-ASCII character anyhow.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<charset.h>
+#include	<utf8_scan.h>
+
+CharSet&
+CharSet::add(UCS4 first, UCS4 last)
+{
+	for (; first < 0x80 && first <= last; first++)
+		ascii[first>>6] |= (uint64_t)1 << (first&63);
+	if (first > last)
+		return *this;
+
+	// Find the ranges that overlap or touch the new one, and replace them all:
+	const CharRange*	rp = ranges.asElements();
+	int		n = ranges.length();
+	int		lo = 0;
+	while (lo < n && rp[lo].last+1 < first)
+		lo++;
+	int		hi = lo;
+	while (hi < n && rp[hi].first <= last+1)
+		hi++;
+	CharRange	merged = { first, last };
+	if (hi > lo)
+	{
+		if (rp[lo].first < merged.first)
+			merged.first = rp[lo].first;
+		if (rp[hi-1].last > merged.last)
+			merged.last = rp[hi-1].last;
+		ranges.remove(lo, hi-lo);
+	}
+	if (lo == ranges.length())
+		ranges.append(merged);		// Sets are often built in order
+	else
+		ranges.insert(lo, Array<CharRange>(merged));
+	return *this;
+}
+
+CharSet&
+CharSet::add(const UTF8* cp, const UTF8* ep)
+{
+	while (cp < ep)
+		add(UTF8Get(cp));
+	return *this;
+}
+
+int
+CharSet::rangeAt(UCS4 ch) const
+{
+	const CharRange*	rp = ranges.asElements();
+	int		lo = 0;
+	int		hi = ranges.length();
+	while (lo < hi)
+	{
+		int	m = lo+(hi-lo)/2;
+		if (ch < rp[m].first)
+			hi = m;
+		else if (ch > rp[m].last)
+			lo = m+1;
+		else
+			return m;
+	}
+	return -1;
+}
+
+const UTF8*
+CharSet::find(const UTF8* cp, const UTF8* ep, bool wanted) const
+{
+	// Candidates are ASCII bytes that match, and non-ASCII bytes that might:
+	bool		high = wanted && !isASCII();
+	while (cp < ep)
+	{
+		const UTF8*	sp = UTF8FindClass(cp, ep, ascii, high, wanted);
+		if (!sp || (*sp & 0x80) == 0)
+			return sp;
+		cp = sp;
+		if (contains(UTF8Get(cp)) == wanted)
+			return sp;
+	}
+	return 0;
+}
+
+const UTF8*
+CharSet::rfind(const UTF8* cp, const UTF8* ep, bool wanted) const
+{
+	bool		high = wanted && !isASCII();
+	while (cp < ep)
+	{
+		const UTF8*	sp = UTF8RFindClass(cp, ep, ascii, high, wanted);
+		if (!sp || (*sp & 0x80) == 0)
+			return sp;
+		// sp is the last byte of a non-ASCII character:
+		sp = UTF8Backup(sp+1, cp);
+		const UTF8*	np = sp;
+		if (contains(UTF8Get(np)) == wanted)
+			return sp;
+		ep = sp;
+	}
+	return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * Thread-safe reference counting: the slow paths.
+ *
+ * Each thread has a number and a queue of objects that other threads have
+ * released below zero. The owner merges them when it next releases anything.
+ * When a thread ends, it merges its queue and marks it Ended, so a thread that
+ * later releases one of its objects merges it instead. The number then waits
+ * for a new thread to adopt it, which also continues the counts of the objects
+ * the old thread still owns.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<refcount.h>
+
+#include	<cstdlib>
+#include	<new>
+
+struct	RefCountNode
+{
+	RefCounted*	object;
+	RefCountNode*	next;
+};
+
+namespace {
+
+// Markers in the queue of a thread that has ended:
+RefCountNode* const	Ended = (RefCountNode*)1;	// Releasing threads must merge for themselves
+RefCountNode* const	Busy = (RefCountNode*)2;	// A releasing thread is merging one
+
+// Thread numbers index a table of blocks of threads.
+// Numbers are only made when no ended thread is waiting, so there are as many as the most threads at once.
+const int		BlockBits = 8;
+const uint32_t		BlockSize = 1 << BlockBits;
+const uint32_t		MaxBlocks = 1024;
+std::atomic<RefCountThread*>	blocks[MaxBlocks];
+uint32_t		num_threads;	// Protected by the lock
+
+// The table and abandoned threads are protected by a spin lock, which needs no constructor
+// or destructor, so threads may start and end during static initialisation or exit.
+std::atomic_flag	lock = ATOMIC_FLAG_INIT;
+RefCountThread*		abandoned;
+
+RefCountThread		detached = { RefCounted::Detached, {0}, 0 };
+
+void
+lockThreads()
+{
+	while (lock.test_and_set(std::memory_order_acquire))
+		;
+}
+
+void
+unlockThreads()
+{
+	lock.clear(std::memory_order_release);
+}
+
+RefCountThread*
+threadNumbered(uint32_t id)
+{
+	return &blocks[id >> BlockBits].load(std::memory_order_acquire)[id & (BlockSize-1)];
+}
+
+RefCountThread*
+newThread()
+{
+	uint32_t	id = ++num_threads;	// Zero is never used
+	uint32_t	block = id >> BlockBits;
+	if (block >= MaxBlocks)
+		throw std::bad_alloc();
+	RefCountThread*	threads = blocks[block].load(std::memory_order_relaxed);
+	if (!threads)
+	{
+		threads = (RefCountThread*)calloc(BlockSize, sizeof(RefCountThread));
+		if (!threads)
+			throw std::bad_alloc();
+		blocks[block].store(threads, std::memory_order_release);
+	}
+	RefCountThread*	thread = threads + (id & (BlockSize-1));
+	thread->id = id;
+	return thread;
+}
+
+thread_local bool	thread_ended;
+
+struct	RefCountThreadEnd		// Its destructor runs when the thread ends
+{
+	~RefCountThreadEnd()
+	{
+		RefCountLocal&	local = RefCountCurrent();
+		RefCountThread*	thread = local.thread;
+		thread_ended = true;
+		if (!thread)
+			return;
+
+		// Merge what's queued until the queue stays empty, then let releasing threads merge:
+		RefCountNode*	expected = 0;
+		while (!thread->queue.compare_exchange_strong(expected, Ended, std::memory_order_acq_rel))
+		{
+			RefCountMergeQueue(thread->queue.exchange(0, std::memory_order_acquire));
+			expected = 0;
+		}
+		local.id = RefCounted::Detached;	// Anything this thread counts from now is never biased
+		local.thread = &detached;
+
+		lockThreads();
+		thread->next_abandoned = abandoned;
+		abandoned = thread;
+		unlockThreads();
+	}
+};
+
+}
+
+void
+RefCountMergeQueue(RefCountNode* node)
+{
+	while (node)
+	{
+		RefCountNode*	next = node->next;
+		if (node->object->mergeQueued())
+			delete node->object;
+		delete node;
+		node = next;
+	}
+}
+
+uint32_t
+RefCountThreadStart()
+{
+	RefCountLocal&	local = RefCountCurrent();
+	if (thread_ended)
+	{
+		local.thread = &detached;
+		return local.id = RefCounted::Detached;
+	}
+
+	lockThreads();
+	RefCountThread*	thread = abandoned;
+	if (thread)
+		abandoned = thread->next_abandoned;
+	else
+		thread = newThread();
+	unlockThreads();
+	thread->next_abandoned = 0;
+
+	// An adopted thread's queue is Ended. Take it back, once no releasing thread is merging:
+	RefCountNode*	expected = thread->queue.load(std::memory_order_acquire);
+	while (expected != 0
+	 && !(expected == Ended && thread->queue.compare_exchange_weak(expected, 0, std::memory_order_acquire)))
+		expected = thread->queue.load(std::memory_order_acquire);
+
+	static thread_local RefCountThreadEnd	thread_end;	// Arrange to give the number up when the thread ends
+	(void)&thread_end;
+	local.thread = thread;
+	return local.id = thread->id;
+}
+
+void
+RefCounted::collect()
+{
+	RefCountThread*	thread = RefCountCurrent().thread;
+	if (thread && thread != &detached)
+		RefCountMergeQueue(thread->queue.exchange(0, std::memory_order_acquire));
+}
+
+void
+RefCounted::handOff()
+{
+	uint32_t	o = owner.load(std::memory_order_relaxed);
+	if (o == 0)
+	{		// The owner is merging it now, so there's nothing to wait for
+		if (mergeQueued())
+			delete this;
+		return;
+	}
+
+	RefCountThread*	thread = threadNumbered(o);
+	RefCountNode*	node = new RefCountNode;
+	node->object = this;
+	RefCountNode*	head = thread->queue.load(std::memory_order_acquire);
+	for (;;)
+	{
+		if (head == Busy)
+			head = thread->queue.load(std::memory_order_acquire);
+		else if (head == Ended)
+		{		// The owner has ended, so merge it here
+			if (!thread->queue.compare_exchange_weak(head, Busy, std::memory_order_acquire))
+				continue;
+			delete node;
+			bool	unused = mergeQueued();
+			thread->queue.store(Ended, std::memory_order_release);
+			if (unused)
+				delete this;	// Its destructor may release more of the ended thread's objects
+			return;
+		}
+		else
+		{
+			node->next = head;
+			if (thread->queue.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_acquire))
+				return;
+		}
+	}
+}
+
+bool
+RefCounted::mergeQueued()
+{
+	int		s;
+	if (owner.load(std::memory_order_relaxed) != 0)
+	{		// Still biased. Merge the counts, and it's no longer queued
+		int	n = biased.load(std::memory_order_relaxed);
+		owner.store(0, std::memory_order_relaxed);
+		biased.store(0, std::memory_order_relaxed);
+		int	add = n*SharedOne + Merged - Queued;
+		s = shared.fetch_add(add, std::memory_order_acq_rel) + add;
+	}
+	else		// The owner merged it already
+		s = shared.fetch_sub(Queued, std::memory_order_acq_rel) - Queued;
+	return s == Merged;
+}
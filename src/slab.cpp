@@ -0,0 +1,233 @@
+/*
+ * Slab allocation of small blocks, with a cache for each thread.
+ *
+ * The slow paths: making and adopting thread caches, carving new chunks,
+ * collecting blocks freed by other threads, large blocks, and arenas.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<slab.h>
+
+#include	<cstdlib>
+#include	<new>
+
+// refcount.h refers to the one that matches how it was compiled, so a program
+// that doesn't agree with the library about SLAB_ALLOC fails to link:
+#if	defined(SLAB_ALLOC)
+int	StrppBuiltWithSlabAlloc;
+#else
+int	StrppBuiltWithoutSlabAlloc;
+#endif
+
+namespace {
+
+// The abandoned caches are protected by a spin lock, which needs no constructor
+// or destructor, so threads may start and end during static initialisation or exit.
+std::atomic_flag	abandoned_lock = ATOMIC_FLAG_INIT;
+SlabCache*		abandoned;
+
+void
+lockAbandoned()
+{
+	while (abandoned_lock.test_and_set(std::memory_order_acquire))
+		;
+}
+
+void
+unlockAbandoned()
+{
+	abandoned_lock.clear(std::memory_order_release);
+}
+
+thread_local bool	thread_ended;
+
+struct	SlabThreadEnd		// Its destructor runs when the thread ends
+{
+	~SlabThreadEnd()
+	{
+		SlabCache*&	cache = SlabCurrentCache();
+		thread_ended = true;
+		if (!cache)
+			return;
+		lockAbandoned();
+		cache->next_abandoned = abandoned;
+		abandoned = cache;
+		unlockAbandoned();
+		cache = 0;
+	}
+};
+
+void*
+allocateChunk(size_t bytes)
+{
+	void*		mem;
+	if (posix_memalign(&mem, SlabChunkSize, bytes) != 0)
+		throw std::bad_alloc();
+	return mem;
+}
+
+}
+
+SlabCache*
+SlabThreadCache()
+{
+	SlabCache*&	cache = SlabCurrentCache();
+	if (cache)
+		return cache;
+
+	lockAbandoned();
+	cache = abandoned;
+	if (cache)
+		abandoned = cache->next_abandoned;
+	unlockAbandoned();
+
+	if (!cache)
+	{
+		void*	mem = calloc(1, sizeof(SlabCache));
+		if (!mem)
+			throw std::bad_alloc();
+		cache = new(mem) SlabCache();
+	}
+	cache->next_abandoned = 0;
+
+	if (!thread_ended)
+	{		// Arrange to give the cache up when the thread ends
+		static thread_local SlabThreadEnd	thread_end;
+		(void)&thread_end;
+	}
+	return cache;
+}
+
+SlabBlock*
+SlabCache::refill(int size_class)
+{
+	SlabBlock*	block = remote[size_class].exchange(0, std::memory_order_acquire);
+	if (block)
+		return block;
+
+	// Carve a new chunk into a list of blocks:
+	char*		mem = (char*)allocateChunk(SlabChunkSize);
+	SlabChunk*	chunk = (SlabChunk*)mem;
+	chunk->cache = this;
+	chunk->size_class = size_class;
+
+	size_t		size = SlabClassSize(size_class);
+	size_t		count = (SlabChunkSize-SlabChunkHeader)/size;
+	char*		first = mem+SlabChunkHeader;
+	for (size_t i = 0; i+1 < count; i++)
+		((SlabBlock*)(first+i*size))->next = (SlabBlock*)(first+(i+1)*size);
+	((SlabBlock*)(first+(count-1)*size))->next = 0;
+	return (SlabBlock*)first;
+}
+
+void*
+SlabAllocateLarge(size_t bytes)
+{
+	void*		mem = malloc(bytes);
+	if (!mem)
+		throw std::bad_alloc();
+	return mem;
+}
+
+void
+SlabFreeElsewhere(void* mem)
+{
+	SlabChunk*	chunk = SlabChunkOf(mem);
+	if (chunk->size_class == SlabArenaClass)
+	{
+		SlabArenaChunk*	arena_chunk = (SlabArenaChunk*)chunk;
+		if (arena_chunk->owner == SlabCurrentCache() && arena_chunk->open.load(std::memory_order_relaxed))
+			arena_chunk->freed++;	// The memory is released when the arena closes
+		else if (arena_chunk->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			free(arena_chunk);	// The last block, after the arena closed
+		return;
+	}
+	std::atomic<SlabBlock*>&	list = chunk->cache->remote[chunk->size_class];
+	SlabBlock*	block = (SlabBlock*)mem;
+	block->next = list.load(std::memory_order_relaxed);
+	while (!list.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed))
+		;
+}
+
+size_t
+SlabAllocations()
+{
+	SlabCache*	cache = SlabCurrentCache();
+	return cache ? cache->allocations : 0;
+}
+
+static_assert(sizeof(SlabArenaChunk) <= SlabChunkHeader, "An arena chunk header must fit before its first block");
+
+void
+SlabArena::newChunk()
+{
+	SlabCache*	cache = SlabCurrentCache();
+	char*		mem = (char*)cache->spare_chunks;
+	if (mem)
+	{
+		cache->spare_chunks = cache->spare_chunks->next;
+		cache->num_spare_chunks--;
+	}
+	else
+		mem = (char*)allocateChunk(SlabChunkSize);
+	SlabArenaChunk*	chunk = new(mem) SlabArenaChunk();
+	chunk->cache = 0;
+	chunk->size_class = SlabArenaClass;
+	chunk->owner = cache;
+	chunk->open.store(true, std::memory_order_relaxed);
+	chunk->allocated = 0;
+	chunk->freed = 0;
+	chunk->remaining.store(0, std::memory_order_relaxed);
+	chunk->next = chunks;
+	chunks = chunk;
+	next = mem+SlabChunkHeader;
+	end = mem+SlabChunkSize;
+}
+
+void
+SlabArenaOpen(SlabArena* arena)
+{
+	SlabCache*	cache = SlabThreadCache();
+	arena->next = arena->end = 0;
+	arena->chunks = 0;
+	arena->outer = cache->arena;
+	cache->arena = arena;
+}
+
+long
+SlabArenaLive(const SlabArena* arena)
+{
+	long		live = 0;
+	for (SlabArenaChunk* chunk = arena->chunks; chunk; chunk = chunk->next)
+		live += chunk->allocated - chunk->freed + chunk->remaining.load(std::memory_order_relaxed);
+	return live;
+}
+
+long
+SlabArenaClose(SlabArena* arena)
+{
+	SlabCache*	cache = SlabCurrentCache();
+	cache->arena = arena->outer;
+
+	long		live = SlabArenaLive(arena);
+	SlabArenaChunk*	next;
+	for (SlabArenaChunk* chunk = arena->chunks; chunk; chunk = next)
+	{
+		next = chunk->next;
+		long	unfreed = chunk->allocated - chunk->freed;
+		chunk->open.store(false, std::memory_order_relaxed);
+		if (chunk->remaining.fetch_add(unfreed, std::memory_order_acq_rel) + unfreed != 0)
+			continue;	// The last block to be freed will free the chunk
+		if (cache->num_spare_chunks < SlabMaxSpareChunks)
+		{		// Keep it for the next arena
+			chunk->next = cache->spare_chunks;
+			cache->spare_chunks = chunk;
+			cache->num_spare_chunks++;
+		}
+		else
+			free(chunk);
+	}
+	arena->chunks = 0;
+	arena->next = arena->end = 0;
+	return live;
+}
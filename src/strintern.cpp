@@ -0,0 +1,128 @@
+/*
+ * Interned strings.
+ *
+ * The table is keyed by the bytes of each canonical Body, which never change
+ * because the table's reference keeps the Body shared (so immutable).
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strintern.h>
+#include	<lockfree.h>
+
+#include	<unordered_map>
+
+namespace {
+
+struct	InternKey
+{
+	const char*	data;
+	size_t		bytes;
+};
+
+struct	InternKeyHash
+{
+	size_t		operator()(const InternKey& k) const
+			{ return (size_t)UTF8Hash(k.data, k.data+k.bytes); }
+};
+
+struct	InternKeyEqual
+{
+	bool		operator()(const InternKey& k1, const InternKey& k2) const
+			{ return k1.bytes == k2.bytes && memcmp(k1.data, k2.data, k1.bytes) == 0; }
+};
+
+struct	InternTable
+{
+	Latch		latch;
+	size_t		limit = 0;
+	std::unordered_map<InternKey, Ref<StrBody>, InternKeyHash, InternKeyEqual>	strings;
+
+	size_t		purge()		// Caller must hold the latch
+			{
+				size_t	purged = 0;
+				for (auto it = strings.begin(); it != strings.end(); )
+					if (it->second->GetRefCount() <= 1)
+					{	// Only the table uses this Body, and no-one can find it without the latch
+						it = strings.erase(it);
+						purged++;
+					}
+					else
+						it++;
+				return purged;
+			}
+};
+
+InternTable&
+table()
+{
+	static InternTable	t;	// Constructed on first use
+	return t;
+}
+
+}
+
+StrVal
+StrIntern::intern(const char* data, size_t bytes)
+{
+	if (bytes == 0)
+		return StrVal();
+
+	InternTable&	t = table();
+	InternKey	key = { data, bytes };
+	t.latch.enter();
+	auto		found = t.strings.find(key);
+	if (found != t.strings.end())
+	{
+		StrVal	canonical((StrBody*)found->second);
+		t.latch.leave();
+		return canonical;
+	}
+
+	if (t.limit > 0 && t.strings.size() >= t.limit && t.purge() == 0)
+	{		// Full of strings that are in use
+		t.latch.leave();
+		return StrVal(data, bytes);
+	}
+
+	StrBody*	body;
+	{
+		ArenaScope::Pause	pause;	// The table keeps it beyond any arena
+		body = StrBody::create(data, StrUTF8, bytes);
+	}
+	body->is_interned = true;
+	body->share();			// Any thread may find and release it
+	key.data = body->data();	// The Body's copy of the data lasts as long as the entry
+	t.strings.insert(std::make_pair(key, Ref<StrBody>(body)));
+	StrVal		canonical(body);
+	t.latch.leave();
+	return canonical;
+}
+
+size_t
+StrIntern::size()
+{
+	InternTable&	t = table();
+	t.latch.enter();
+	size_t		n = t.strings.size();
+	t.latch.leave();
+	return n;
+}
+
+size_t
+StrIntern::purge()
+{
+	InternTable&	t = table();
+	t.latch.enter();
+	size_t		n = t.purge();
+	t.latch.leave();
+	return n;
+}
+
+void
+StrIntern::setLimit(size_t max_strings)
+{
+	InternTable&	t = table();
+	t.latch.enter();
+	t.limit = max_strings;
+	t.latch.leave();
+}
@@ -0,0 +1,93 @@
+/*
+ * Strings on memory-mapped files.
+ *
+ * The file is mapped over the start of an anonymous mapping that's at least
+ * one byte longer, so a NUL always follows the data, even when the file is a
+ * whole number of pages.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strmap.h>
+
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+
+ErrNum
+StrMapRegion(const char* path, size_t max_bytes, const char*& data, size_t& bytes, size_t& mapped_bytes)
+{
+	data = 0;
+	bytes = mapped_bytes = 0;
+
+	int		fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ErrNum(0, errno);
+
+	struct stat	stat;
+	ErrNum		e;
+	if (fstat(fd, &stat) < 0)
+		e = ErrNum(0, errno);
+	else if (S_ISDIR(stat.st_mode))
+		e = ErrNum(0, EISDIR);
+	else if (!S_ISREG(stat.st_mode))
+		e = ErrNum(0, ENODEV);		// As mmap says, for a file that can't be mapped
+	else if ((unsigned long long)stat.st_size > max_bytes)
+		e = ErrNum(0, EFBIG);
+	if (e || stat.st_size == 0)
+	{
+		close(fd);
+		return e;
+	}
+
+	size_t		size = stat.st_size;
+	size_t		page = sysconf(_SC_PAGESIZE);
+	size_t		reserve = (size/page + 1) * page;
+	void*		zeroes = mmap(0, reserve, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (zeroes == MAP_FAILED)
+		e = ErrNum(0, errno);
+	else if (mmap(zeroes, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		e = ErrNum(0, errno);
+		munmap(zeroes, reserve);
+	}
+	close(fd);			// The mapping doesn't need it
+	if (e)
+		return e;
+
+	data = (const char*)zeroes;
+	bytes = size;
+	mapped_bytes = reserve;
+	return e;
+}
+
+void
+StrUnmapRegion(const char* data, size_t mapped_bytes)
+{
+	if (data)
+		munmap((void*)data, mapped_bytes);
+}
+
+ErrNum
+StrAdviseRegion(const char* data, size_t bytes, StrMapAdvice advice)
+{
+	int		flag;
+	switch (advice)
+	{
+	default:
+	case StrMapNormal:	flag = MADV_NORMAL;	break;
+	case StrMapSequential:	flag = MADV_SEQUENTIAL;	break;
+	case StrMapRandom:	flag = MADV_RANDOM;	break;
+	case StrMapWillNeed:	flag = MADV_WILLNEED;	break;
+	case StrMapDontNeed:	flag = MADV_DONTNEED;	break;
+	}
+	if (!data || bytes == 0)
+		return ErrNum();
+
+	size_t		page = sysconf(_SC_PAGESIZE);
+	uintptr_t	first = (uintptr_t)data & ~(page-1);
+	uintptr_t	end = ((uintptr_t)data + bytes + page-1) & ~(page-1);
+	if (madvise((void*)first, end-first, flag) < 0)
+		return ErrNum(0, errno);
+	return ErrNum();
+}
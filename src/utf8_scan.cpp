@@ -0,0 +1,819 @@
+/*
+ * Bulk scanning of UTF-8 data.
+ *
+ * The vector implementations classify 64 bytes at a time into bitmasks
+ * (one bit per byte) of continuation bytes and 2, 3 and 4-byte lead bytes.
+ * The continuation bytes a block *requires* are found by shifting the lead
+ * masks; the block is well-formed exactly when those are the continuation
+ * bytes it has. Well-formed blocks are counted by their lead bytes. Blocks
+ * that are not well-formed (or contain 5 or 6-byte leads) are handed to the
+ * scalar code, which defines the semantics, until it reaches the next block.
+ *
+ * Substring search compares 32 positions at a time with the first and last
+ * bytes of the needle, and only compares the rest of the needle where both
+ * match.
+ *
+ * Byte classes are tested 32 bytes at a time by looking up each byte's low
+ * nibble in a table of the high nibbles (0-7) that occur with it.
+ *
+ * Hashing is Wang Yi's wyhash (final version 4), which mixes 16 bytes at a
+ * time (48 for long data) with 64x64->128 bit multiplies.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<cstdint>
+#include	<cstring>
+
+#include	<utf8_scan.h>
+
+#if	defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define	UTF8_SCAN_SSE2
+#include	<emmintrin.h>
+#if	defined(__GNUC__)
+#define	UTF8_SCAN_AVX2
+#include	<immintrin.h>
+#endif
+#endif
+
+static inline int
+lowestBit(uint32_t m)		// m must be non-zero
+{
+#if	defined(__GNUC__)
+	return __builtin_ctz(m);
+#else
+	int	n = 0;
+	for (; !(m&1); m >>= 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline int
+highestBit(uint32_t m)		// m must be non-zero
+{
+#if	defined(__GNUC__)
+	return 31-__builtin_clz(m);
+#else
+	int	n = 31;
+	for (; !(m&0x80000000); m <<= 1)
+		n--;
+	return n;
+#endif
+}
+
+static inline int
+popcount64(uint64_t m)
+{
+#if	defined(__GNUC__)
+	return __builtin_popcountll(m);
+#else
+	int	n = 0;
+	for (; m; m &= m-1)
+		n++;
+	return n;
+#endif
+}
+
+/*
+ * Scan characters starting at cp until cp reaches stop (which may be
+ * exceeded by the last character), in data that ends at ep.
+ * Returns false if the data was truncated by a character overlapping ep.
+ */
+static inline bool
+countScalar(const UTF8*& cp, const UTF8* stop, const UTF8* ep, size_t& count, bool& ascii, bool& valid)
+{
+	while (cp < stop)
+	{
+		if ((unsigned char)*cp < 0x80)
+		{
+			cp++;
+			count++;
+			continue;
+		}
+		ascii = false;
+		const UTF8*	sp = cp;
+		UCS4		ch = UTF8Get(cp);
+		if (ch == UCS4_NONE		// Illegal encoding not handled by UTF8_ILLEGAL
+		 || cp > ep)			// Overlaps the end of data
+		{
+			valid = false;
+			return false;		// An error occurred before the end of the data; truncate it.
+		}
+		if (UCS4IsIllegal(ch) || cp-sp > 4)
+			valid = false;
+		count++;
+	}
+	return true;
+}
+
+#if	defined(UTF8_SCAN_SSE2)
+// Bitmasks describing a block of 64 bytes, one bit per byte:
+struct	UTF8BlockMasks
+{
+	uint64_t	high;		// 0x80..0xFF, non-ASCII
+	uint64_t	cont;		// 0x80..0xBF, continuation bytes
+	uint64_t	lead2;		// 0xC0..0xDF
+	uint64_t	lead3;		// 0xE0..0xEF
+	uint64_t	lead4;		// 0xF0..0xF7
+	uint64_t	bad;		// 0xF8..0xFF, which the scalar code must handle
+};
+
+// Make masks from movemask results for bytes that are (signed) greater than -65, -33, -17 and -9:
+static inline void
+blockMasks(UTF8BlockMasks& m, uint64_t high, uint64_t ge_c0, uint64_t ge_e0, uint64_t ge_f0, uint64_t ge_f8)
+{
+	ge_c0 &= high;		// The signed comparisons also pass ASCII
+	ge_e0 &= high;
+	ge_f0 &= high;
+	ge_f8 &= high;
+	m.high = high;
+	m.cont = high & ~ge_c0;
+	m.lead2 = ge_c0 & ~ge_e0;
+	m.lead3 = ge_e0 & ~ge_f0;
+	m.lead4 = ge_f0 & ~ge_f8;
+	m.bad = ge_f8;
+}
+
+static inline void
+classifySSE2(const UTF8* cp, UTF8BlockMasks& m)
+{
+	const __m128i	c0 = _mm_set1_epi8(-65);
+	const __m128i	e0 = _mm_set1_epi8(-33);
+	const __m128i	f0 = _mm_set1_epi8(-17);
+	const __m128i	f8 = _mm_set1_epi8(-9);
+	uint64_t	high = 0, ge_c0 = 0, ge_e0 = 0, ge_f0 = 0, ge_f8 = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		__m128i	v = _mm_loadu_si128((const __m128i*)(cp+i*16));
+		int	shift = i*16;
+		high |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << shift;
+		ge_c0 |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, c0)) << shift;
+		ge_e0 |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, e0)) << shift;
+		ge_f0 |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, f0)) << shift;
+		ge_f8 |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(v, f8)) << shift;
+	}
+	blockMasks(m, high, ge_c0, ge_e0, ge_f0, ge_f8);
+}
+
+#if	defined(UTF8_SCAN_AVX2)
+__attribute__((target("avx2")))
+static inline void
+classifyAVX2(const UTF8* cp, UTF8BlockMasks& m)
+{
+	const __m256i	c0 = _mm256_set1_epi8(-65);
+	const __m256i	e0 = _mm256_set1_epi8(-33);
+	const __m256i	f0 = _mm256_set1_epi8(-17);
+	const __m256i	f8 = _mm256_set1_epi8(-9);
+	uint64_t	high = 0, ge_c0 = 0, ge_e0 = 0, ge_f0 = 0, ge_f8 = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		__m256i	v = _mm256_loadu_si256((const __m256i*)(cp+i*32));
+		int	shift = i*32;
+		high |= (uint64_t)(uint32_t)_mm256_movemask_epi8(v) << shift;
+		ge_c0 |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, c0)) << shift;
+		ge_e0 |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, e0)) << shift;
+		ge_f0 |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, f0)) << shift;
+		ge_f8 |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, f8)) << shift;
+	}
+	blockMasks(m, high, ge_c0, ge_e0, ge_f0, ge_f8);
+}
+#endif
+
+/*
+ * The block loop, instantiated once per classifier. The always_inline lets
+ * each instance be compiled with its classifier's instruction set.
+ */
+template<void (*Classify)(const UTF8*, UTF8BlockMasks&)>
+__attribute__((always_inline))
+static inline size_t
+countBlocks(const UTF8* cp, const UTF8* ep, bool& ascii, bool& valid)
+{
+	size_t		count = 0;
+	uint64_t	carry = 0;	// Continuation bytes required at the start of this block
+	while (ep-cp >= 64)
+	{
+		UTF8BlockMasks	m;
+		Classify(cp, m);
+		if (m.high == 0 && carry == 0)
+		{		// Pure ASCII
+			count += 64;
+			cp += 64;
+			continue;
+		}
+		ascii = false;
+
+		uint64_t	l234 = m.lead2 | m.lead3 | m.lead4;
+		uint64_t	l34 = m.lead3 | m.lead4;
+		uint64_t	required = (l234 << 1) | (l34 << 2) | (m.lead4 << 3) | carry;
+		if (m.bad == 0 && required == m.cont)
+		{		// Well-formed, count the characters that start here
+			count += 64 - popcount64(m.cont);
+			carry = (l234 >> 63) | (l34 >> 62) | (m.lead4 >> 61);
+			cp += 64;
+			continue;
+		}
+
+		// Resynchronise using the scalar code, starting with any character that overlaps this block:
+		const UTF8*	block_end = cp+64;
+		if (carry)
+		{
+			do
+				cp--;
+			while (UTF8Is2nd(*cp));
+			count--;
+		}
+		carry = 0;
+		if (!countScalar(cp, block_end, ep, count, ascii, valid))
+			return count;
+	}
+
+	if (carry)
+	{		// Back up to the start of the character that's overlapping the tail
+		do
+			cp--;
+		while (UTF8Is2nd(*cp));
+		count--;
+	}
+	countScalar(cp, ep, ep, count, ascii, valid);
+	return count;
+}
+
+static size_t
+countCharsSSE2(const UTF8* cp, const UTF8* ep, bool& ascii, bool& valid)
+{
+	return countBlocks<classifySSE2>(cp, ep, ascii, valid);
+}
+
+#if	defined(UTF8_SCAN_AVX2)
+__attribute__((target("avx2,popcnt")))
+static size_t
+countCharsAVX2(const UTF8* cp, const UTF8* ep, bool& ascii, bool& valid)
+{
+	return countBlocks<classifyAVX2>(cp, ep, ascii, valid);
+}
+#endif
+#endif	// UTF8_SCAN_SSE2
+
+static size_t
+countCharsScalar(const UTF8* cp, const UTF8* ep, bool& ascii, bool& valid)
+{
+	size_t	count = 0;
+	countScalar(cp, ep, ep, count, ascii, valid);
+	return count;
+}
+
+/*
+ * Substring search. Needles here have at least 2 bytes (UTF8Find uses memchr
+ * for one), and the haystack has at least as many.
+ */
+static const UTF8*
+findScalar(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	const UTF8*	stop = ep-needle_bytes+1;	// Matches start before here
+	while (cp < stop)
+	{
+		cp = (const UTF8*)memchr(cp, needle[0], stop-cp);
+		if (!cp)
+			return 0;
+		if (memcmp(cp+1, needle+1, needle_bytes-1) == 0)
+			return cp;
+		cp++;
+	}
+	return 0;
+}
+
+static const UTF8*
+rfindScalar(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	for (const UTF8* sp = ep-needle_bytes; sp >= cp; sp--)
+		if (*sp == needle[0]
+		 && memcmp(sp+1, needle+1, needle_bytes-1) == 0)
+			return sp;
+	return 0;
+}
+
+#if	defined(UTF8_SCAN_SSE2)
+// Bitmask of the 32 positions from cp where the needle's first and last bytes (last is at offset) match:
+static inline uint32_t
+candidatesSSE2(const UTF8* cp, size_t offset, UTF8 first, UTF8 last)
+{
+	const __m128i	f = _mm_set1_epi8(first);
+	const __m128i	l = _mm_set1_epi8(last);
+	uint32_t	mask = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		__m128i	match = _mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(cp+i*16)), f),
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(cp+offset+i*16)), l)
+			);
+		mask |= (uint32_t)(uint16_t)_mm_movemask_epi8(match) << (i*16);
+	}
+	return mask;
+}
+
+#if	defined(UTF8_SCAN_AVX2)
+__attribute__((target("avx2")))
+static inline uint32_t
+candidatesAVX2(const UTF8* cp, size_t offset, UTF8 first, UTF8 last)
+{
+	__m256i	match = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)cp), _mm256_set1_epi8(first)),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(cp+offset)), _mm256_set1_epi8(last))
+		);
+	return (uint32_t)_mm256_movemask_epi8(match);
+}
+#endif
+
+template<uint32_t (*Candidates)(const UTF8*, size_t, UTF8, UTF8)>
+__attribute__((always_inline))
+static inline const UTF8*
+findBlocks(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	const UTF8*	stop = ep-needle_bytes+1;	// Matches start before here
+	while (stop-cp >= 32)
+	{
+		for (uint32_t mask = Candidates(cp, needle_bytes-1, needle[0], needle[needle_bytes-1]); mask; mask &= mask-1)
+		{
+			const UTF8*	sp = cp+lowestBit(mask);
+			if (memcmp(sp+1, needle+1, needle_bytes-2) == 0)
+				return sp;
+		}
+		cp += 32;
+	}
+	return findScalar(cp, ep, needle, needle_bytes);
+}
+
+template<uint32_t (*Candidates)(const UTF8*, size_t, UTF8, UTF8)>
+__attribute__((always_inline))
+static inline const UTF8*
+rfindBlocks(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	const UTF8*	stop = ep-needle_bytes+1;	// Matches start before here
+	while (stop-cp >= 32)
+	{
+		const UTF8*	bp = stop-32;
+		for (uint32_t mask = Candidates(bp, needle_bytes-1, needle[0], needle[needle_bytes-1]); mask; )
+		{
+			int		bit = highestBit(mask);
+			if (memcmp(bp+bit+1, needle+1, needle_bytes-2) == 0)
+				return bp+bit;
+			mask &= ~((uint32_t)1 << bit);
+		}
+		stop = bp;
+	}
+	return rfindScalar(cp, stop+needle_bytes-1, needle, needle_bytes);
+}
+
+static const UTF8*
+findSSE2(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	return findBlocks<candidatesSSE2>(cp, ep, needle, needle_bytes);
+}
+
+static const UTF8*
+rfindSSE2(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	return rfindBlocks<candidatesSSE2>(cp, ep, needle, needle_bytes);
+}
+
+#if	defined(UTF8_SCAN_AVX2)
+__attribute__((target("avx2")))
+static const UTF8*
+findAVX2(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	return findBlocks<candidatesAVX2>(cp, ep, needle, needle_bytes);
+}
+
+__attribute__((target("avx2")))
+static const UTF8*
+rfindAVX2(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	return rfindBlocks<candidatesAVX2>(cp, ep, needle, needle_bytes);
+}
+#endif
+#endif	// UTF8_SCAN_SSE2
+
+/*
+ * Byte classes
+ */
+struct	ByteClass
+{
+	const uint64_t*	ascii;
+	bool		high;		// Bytes above 0x7F are in the class
+	bool		wanted;		// Looking for bytes in the class, not out of it
+
+	bool		matches(UTF8 b) const
+			{
+				bool	in = (b & 0x80) ? high : (ascii[(b>>6)&1] >> (b&63)) & 1;
+				return in == wanted;
+			}
+};
+
+static const UTF8*
+findClassScalar(const UTF8* cp, const UTF8* ep, const ByteClass& c)
+{
+	for (; cp < ep; cp++)
+		if (c.matches(*cp))
+			return cp;
+	return 0;
+}
+
+static const UTF8*
+rfindClassScalar(const UTF8* cp, const UTF8* ep, const ByteClass& c)
+{
+	while (ep > cp)
+		if (c.matches(*--ep))
+			return ep;
+	return 0;
+}
+
+#if	defined(UTF8_SCAN_AVX2)
+struct	ClassTablesAVX2
+{
+	__m256i		lo;		// For each low nibble, a bit for each high nibble 0-7 in the class
+	__m256i		hi;		// For each high nibble, its bit (zero for non-ASCII)
+	uint32_t	high;		// All ones if non-ASCII bytes are in the class
+	uint32_t	flip;		// All ones if we want bytes not in the class
+};
+
+__attribute__((target("avx2")))
+static inline ClassTablesAVX2
+classTablesAVX2(const ByteClass& c)
+{
+	uint8_t		lo[16] = {0};
+	uint8_t		hi[16] = {0};
+	for (int b = 0; b < 128; b++)
+		if ((c.ascii[b>>6] >> (b&63)) & 1)
+			lo[b&0xF] |= 1 << (b>>4);
+	for (int h = 0; h < 8; h++)
+		hi[h] = 1 << h;
+	ClassTablesAVX2	t;
+	t.lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+	t.hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+	t.high = c.high ? ~0U : 0;
+	t.flip = c.wanted ? 0 : ~0U;
+	return t;
+}
+
+// Bitmask of the 32 bytes from cp that we're looking for:
+__attribute__((target("avx2")))
+static inline uint32_t
+classMaskAVX2(const UTF8* cp, const ClassTablesAVX2& t)
+{
+	const __m256i	nibble = _mm256_set1_epi8(0x0F);
+	__m256i		v = _mm256_loadu_si256((const __m256i*)cp);
+	__m256i		bits = _mm256_and_si256(
+				_mm256_shuffle_epi8(t.lo, _mm256_and_si256(v, nibble)),
+				_mm256_shuffle_epi8(t.hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble))
+			);
+	uint32_t	in = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits, _mm256_setzero_si256()));
+	in |= (uint32_t)_mm256_movemask_epi8(v) & t.high;
+	return in ^ t.flip;
+}
+
+__attribute__((target("avx2")))
+static const UTF8*
+findClassAVX2(const UTF8* cp, const UTF8* ep, const ByteClass& c)
+{
+	ClassTablesAVX2	t = classTablesAVX2(c);
+	for (; ep-cp >= 32; cp += 32)
+	{
+		uint32_t	mask = classMaskAVX2(cp, t);
+		if (mask)
+			return cp+lowestBit(mask);
+	}
+	return findClassScalar(cp, ep, c);
+}
+
+__attribute__((target("avx2")))
+static const UTF8*
+rfindClassAVX2(const UTF8* cp, const UTF8* ep, const ByteClass& c)
+{
+	ClassTablesAVX2	t = classTablesAVX2(c);
+	for (; ep-cp >= 32; ep -= 32)
+	{
+		uint32_t	mask = classMaskAVX2(ep-32, t);
+		if (mask)
+			return ep-32+highestBit(mask);
+	}
+	return rfindClassScalar(cp, ep, c);
+}
+#endif
+
+typedef size_t	(*UTF8CountCharsFn)(const UTF8* cp, const UTF8* ep, bool& ascii, bool& valid);
+
+static UTF8CountCharsFn
+selectCountChars()
+{
+#if	defined(UTF8_SCAN_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return countCharsAVX2;
+#endif
+#if	defined(UTF8_SCAN_SSE2)
+	return countCharsSSE2;
+#else
+	return countCharsScalar;
+#endif
+}
+
+size_t
+UTF8CountChars(const UTF8* cp, const UTF8* ep, bool* ascii, bool* valid)
+{
+	static const UTF8CountCharsFn	count_chars = selectCountChars();	// Thread-safe initialisation
+
+	bool	is_ascii = true;
+	bool	is_valid = true;
+	size_t	count = ep-cp < 64
+			? countCharsScalar(cp, ep, is_ascii, is_valid)	// Short strings don't need the vector setup
+			: count_chars(cp, ep, is_ascii, is_valid);
+	if (ascii)
+		*ascii = is_ascii;
+	if (valid)
+		*valid = is_valid;
+	return count;
+}
+
+typedef const UTF8*	(*UTF8FindFn)(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes);
+
+static UTF8FindFn
+selectFind(bool reverse)
+{
+#if	defined(UTF8_SCAN_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return reverse ? rfindAVX2 : findAVX2;
+#endif
+#if	defined(UTF8_SCAN_SSE2)
+	return reverse ? rfindSSE2 : findSSE2;
+#else
+	return reverse ? rfindScalar : findScalar;
+#endif
+}
+
+const UTF8*
+UTF8Find(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	static const UTF8FindFn	find = selectFind(false);
+
+	if (needle_bytes == 0)
+		return cp;
+	if (ep-cp < (ptrdiff_t)needle_bytes)
+		return 0;
+	if (needle_bytes == 1)
+		return (const UTF8*)memchr(cp, needle[0], ep-cp);
+	if (ep-cp < 64)
+		return findScalar(cp, ep, needle, needle_bytes);
+	return find(cp, ep, needle, needle_bytes);
+}
+
+const UTF8*
+UTF8RFind(const UTF8* cp, const UTF8* ep, const UTF8* needle, size_t needle_bytes)
+{
+	static const UTF8FindFn	rfind = selectFind(true);
+
+	if (needle_bytes == 0)
+		return ep;
+	if (ep-cp < (ptrdiff_t)needle_bytes)
+		return 0;
+	if (needle_bytes == 1 || ep-cp < 64)
+		return rfindScalar(cp, ep, needle, needle_bytes);
+	return rfind(cp, ep, needle, needle_bytes);
+}
+
+typedef const UTF8*	(*UTF8FindClassFn)(const UTF8* cp, const UTF8* ep, const ByteClass& c);
+
+static UTF8FindClassFn
+selectFindClass(bool reverse)
+{
+#if	defined(UTF8_SCAN_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return reverse ? rfindClassAVX2 : findClassAVX2;
+#endif
+	return reverse ? rfindClassScalar : findClassScalar;
+}
+
+const UTF8*
+UTF8FindClass(const UTF8* cp, const UTF8* ep, const uint64_t* ascii, bool high, bool wanted)
+{
+	static const UTF8FindClassFn	find = selectFindClass(false);
+
+	ByteClass	c = { ascii, high, wanted };
+	if (ep-cp < 64)
+		return findClassScalar(cp, ep, c);
+	const UTF8*	sp = findClassScalar(cp, cp+32, c);	// Nearby matches don't need the vector tables
+	return sp ? sp : find(cp+32, ep, c);
+}
+
+const UTF8*
+UTF8RFindClass(const UTF8* cp, const UTF8* ep, const uint64_t* ascii, bool high, bool wanted)
+{
+	static const UTF8FindClassFn	rfind = selectFindClass(true);
+
+	ByteClass	c = { ascii, high, wanted };
+	if (ep-cp < 64)
+		return rfindClassScalar(cp, ep, c);
+	const UTF8*	sp = rfindClassScalar(ep-32, ep, c);
+	return sp ? sp : rfind(cp, ep-32, c);
+}
+
+static inline UTF8
+foldASCII(UTF8 b)
+{
+	return b >= 'A' && b <= 'Z' ? b+('a'-'A') : b;
+}
+
+#if	defined(UTF8_SCAN_SSE2)
+static inline __m128i
+caseSSE2(__m128i v, char first, char last)	// Flip the case of letters first..last. Non-ASCII bytes are negative, so aren't changed
+{
+	__m128i	letter = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(first-1)), _mm_cmplt_epi8(v, _mm_set1_epi8(last+1)));
+	return _mm_xor_si128(v, _mm_and_si128(letter, _mm_set1_epi8('a'-'A')));
+}
+
+static inline __m128i
+foldSSE2(__m128i v)
+{
+	return caseSSE2(v, 'A', 'Z');
+}
+#endif
+
+size_t
+UTF8EqualPrefixCI(const UTF8* cp1, const UTF8* cp2, size_t bytes)
+{
+	size_t		i = 0;
+#if	defined(UTF8_SCAN_SSE2)
+	for (; i+16 <= bytes; i += 16)
+	{
+		__m128i		a = _mm_loadu_si128((const __m128i*)(cp1+i));
+		__m128i		b = _mm_loadu_si128((const __m128i*)(cp2+i));
+		uint32_t	stop = (uint32_t)_mm_movemask_epi8(_mm_or_si128(a, b))	// Non-ASCII
+				| (~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(foldSSE2(a), foldSSE2(b))) & 0xFFFF);
+		if (stop)
+			return i+lowestBit(stop);
+	}
+#endif
+	for (; i < bytes; i++)
+		if (((cp1[i] | cp2[i]) & 0x80) != 0
+		 || foldASCII(cp1[i]) != foldASCII(cp2[i]))
+			break;
+	return i;
+}
+
+UTF8*
+UTF8ASCIIToCase(UTF8* cp, const UTF8* ep, bool upper)
+{
+	const char	first = upper ? 'a' : 'A';	// The letters to change
+	const char	last = upper ? 'z' : 'Z';
+#if	defined(UTF8_SCAN_SSE2)
+	for (; ep-cp >= 16; cp += 16)
+	{
+		__m128i		v = _mm_loadu_si128((const __m128i*)cp);
+		_mm_storeu_si128((__m128i*)cp, caseSSE2(v, first, last));	// Leaves non-ASCII bytes alone
+		uint32_t	non_ascii = (uint32_t)_mm_movemask_epi8(v);
+		if (non_ascii)
+			return cp+lowestBit(non_ascii);
+	}
+#endif
+	for (; cp < ep; cp++)
+	{
+		if (*cp & 0x80)
+			return cp;
+		if (*cp >= first && *cp <= last)
+			*cp ^= 'a'-'A';
+	}
+	return cp;
+}
+
+static inline bool
+isJSONEscape(UTF8 b, bool high)
+{
+	return (unsigned char)b < 0x20 || b == '"' || b == '\\' || b == '/' || (high && (b & 0x80) != 0);
+}
+
+const UTF8*
+UTF8FindJSONEscape(const UTF8* cp, const UTF8* ep, bool high)
+{
+#if	defined(UTF8_SCAN_SSE2)
+	const __m128i	space = _mm_set1_epi8(' ');
+	const __m128i	quote = _mm_set1_epi8('"');
+	const __m128i	backslash = _mm_set1_epi8('\\');
+	const __m128i	slash = _mm_set1_epi8('/');
+	const __m128i	ascii = _mm_set1_epi8(high ? -128 : -1);	// Bytes above this (signed) and below space are escaped
+	for (; ep-cp >= 32; cp += 32)
+	{
+		__m128i		a = _mm_loadu_si128((const __m128i*)cp);
+		__m128i		b = _mm_loadu_si128((const __m128i*)(cp+16));
+		__m128i		ea = _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(a, quote), _mm_cmpeq_epi8(a, backslash)),
+					_mm_or_si128(_mm_cmpeq_epi8(a, slash), _mm_andnot_si128(_mm_cmpgt_epi8(ascii, a), _mm_cmplt_epi8(a, space))));
+		__m128i		eb = _mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(b, quote), _mm_cmpeq_epi8(b, backslash)),
+					_mm_or_si128(_mm_cmpeq_epi8(b, slash), _mm_andnot_si128(_mm_cmpgt_epi8(ascii, b), _mm_cmplt_epi8(b, space))));
+		uint32_t	stop = (uint32_t)_mm_movemask_epi8(ea) | ((uint32_t)_mm_movemask_epi8(eb) << 16);
+		if (stop)
+			return cp+lowestBit(stop);
+	}
+#endif
+	for (; cp < ep; cp++)
+		if (isJSONEscape(*cp, high))
+			return cp;
+	return 0;
+}
+
+// Replace a and b by the low and high halves of their 128-bit product
+static inline void
+wyMultiply(uint64_t& a, uint64_t& b)
+{
+#if	defined(__SIZEOF_INT128__)
+	unsigned __int128	r = (unsigned __int128)a*b;
+	a = (uint64_t)r;
+	b = (uint64_t)(r >> 64);
+#else
+	uint64_t	ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+	uint64_t	rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+	uint64_t	t = rl + (rm0 << 32);
+	uint64_t	c = t < rl;
+	uint64_t	lo = t + (rm1 << 32);
+	c += lo < t;
+	a = lo;
+	b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+// Multiply, and fold the 128-bit product
+static inline uint64_t
+wyMix(uint64_t a, uint64_t b)
+{
+	wyMultiply(a, b);
+	return a ^ b;
+}
+
+static inline uint64_t
+read8(const UTF8* cp)
+{
+	uint64_t	v;
+	memcpy(&v, cp, 8);
+	return v;
+}
+
+static inline uint64_t
+read4(const UTF8* cp)
+{
+	uint32_t	v;
+	memcpy(&v, cp, 4);
+	return v;
+}
+
+uint64_t
+UTF8Hash(const UTF8* cp, const UTF8* ep, uint64_t seed)
+{
+	static const uint64_t	secret[4] = {
+		0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+	};
+	const unsigned char*	p = (const unsigned char*)cp;
+	size_t		len = ep-cp;
+	uint64_t	a, b;
+
+	seed ^= wyMix(seed ^ secret[0], secret[1]);
+	if (len <= 16)
+	{
+		if (len >= 4)
+		{		// Two overlapping pairs of 4-byte reads cover the data
+			a = (read4(cp) << 32) | read4(cp + ((len >> 3) << 2));
+			b = (read4(ep-4) << 32) | read4(ep - 4 - ((len >> 3) << 2));
+		}
+		else if (len > 0)
+		{
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len-1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else
+	{
+		size_t		i = len;
+		if (i > 48)
+		{
+			uint64_t	see1 = seed, see2 = seed;
+			do {
+				seed = wyMix(read8(cp) ^ secret[1], read8(cp+8) ^ seed);
+				see1 = wyMix(read8(cp+16) ^ secret[2], read8(cp+24) ^ see1);
+				see2 = wyMix(read8(cp+32) ^ secret[3], read8(cp+40) ^ see2);
+				cp += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		for (; i > 16; i -= 16, cp += 16)
+			seed = wyMix(read8(cp) ^ secret[1], read8(cp+8) ^ seed);
+		a = read8(cp+i-16);	// The last 16 bytes, overlapping what's done
+		b = read8(cp+i-8);
+	}
+	a ^= secret[1];
+	b ^= seed;
+	wyMultiply(a, b);
+	return wyMix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
@@ -71,4 +71,28 @@ main(int argc, const char** argv)
 	// Check that shorter() (which uses slice()) worked correctly:
 	printf("sbc3 @%p = %d[%s, %s, %s]\n", sbc3.asElements(), sbc3.length(), sbc3[0].asUTF8(), sbc3[1].asUTF8(), sbc3[2].asUTF8());
 	printf("sbc == sbc3 -> %s\n", (sbc == sbc3) ? "true" : "false");	// Should be false
+
+	// Transforms, streaming into the output or returning replacements:
+	printf("\nTransforms\n");
+	CharArray	digits("a1b22c", 6);
+	digits.transform([](const char*& cp, const char* ep, CharArray& output)
+		{
+			if (*cp >= '0' && *cp <= '9')
+				for (int n = *cp++ - '0'; n > 0; n--)
+					output.append('#');
+			else
+				output.append(*cp++);
+		});
+	printf("digits = '%.*s'\n", digits.length(), digits.asElements());
+	CharArray	stopped("abc-def", 7);
+	stopped.transform([](const char*& cp, const char* ep) -> CharArray
+		{ return *cp == '-' ? CharArray("!", 1) : CharArray(*cp++ - 'a' + 'A'); }, 0);
+	printf("stopped = '%.*s'\n", stopped.length(), stopped.asElements());
+	sbc.transform([](const StrRef*& cp, const StrRef* ep, Array<StrRef>& output)
+		{
+			output.append(*cp);
+			output.append(StrVal(*cp).asUpper());
+			cp++;
+		});
+	printf("sbc = %s\n", StrArray(sbc).join(",").asUTF8());
 }
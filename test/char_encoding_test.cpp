@@ -6,7 +6,9 @@
  */
 #include	<cstdio>
 #include	<cstring>
+#include	<cstdlib>
 #include	<char_encoding.h>
+#include	<utf8_scan.h>
 
 bool		show_passes = false;
 int		test_count;
@@ -20,6 +22,7 @@ void		utf8_eof();
 void		utf8_alphabetic();
 void		utf8_numeric();
 void		utf8_case_conversions();
+void		utf8_bulk_count();
 
 UCS4		max_1byte = (0x1<<7)-1;				// 0x7F
 UCS4		max_2byte = (0x1<<11)-1;			// 0x7FF
@@ -40,6 +43,7 @@ main(int argc, const char** argv)
 	utf8_eof();		// Test \0
 	utf8_alphabetic();
 	utf8_numeric();
+	utf8_bulk_count();
 // 	utf8_case_conversions();	// None yet
 //	utf16_encoding();	//
 
@@ -400,3 +404,68 @@ UCS4		UCS4ToLower(UCS4 ch);		// To lower case
 UCS4		UCS4ToTitle(UCS4 ch);		// To Title or upper case
 */
 }
+
+// Count characters the slow way, as UTF8CountChars must:
+size_t
+utf8_reference_count(const char* cp, const char* ep, bool& ascii)
+{
+	size_t	count = 0;
+	ascii = true;
+	while (cp < ep)
+	{
+		if ((unsigned char)*cp >= 0x80)
+			ascii = false;
+		UCS4	ch = UTF8Get(cp);
+		if (ch == UCS4_NONE || cp > ep)
+			break;
+		count++;
+	}
+	return count;
+}
+
+void
+utf8_bulk_count()
+{
+	test_group("UTF8 bulk character counting");
+
+	const char*	ascii_text = "The quick brown fox jumps over the lazy dog, again and again and again and again";
+	bool		ascii, valid;
+	expect("ASCII count", UTF8CountChars(ascii_text, ascii_text+strlen(ascii_text), &ascii, &valid), strlen(ascii_text));
+	expect("ASCII is ascii", ascii);
+	expect("ASCII is valid", valid);
+
+	// Characters of each legal length, repeated to cross several 64-byte blocks:
+	char		buf[1024];
+	char*		op = buf;
+	UCS4		samples[] = { 'a', 0xE9, 0x4E2A, 0x1F389 };
+	for (int i = 0; i < 200; i++)
+	{
+		UTF8Put(op, samples[i%4]);
+		if (i%7 == 0)
+			UTF8Put(op, samples[(i/7)%4]);
+	}
+	size_t		mixed = op-buf;
+	expect("mixed count", UTF8CountChars(buf, buf+mixed, &ascii, &valid), 200+29);
+	expect("mixed is not ascii", !ascii);
+	expect("mixed is valid", valid);
+
+	// A truncated character at the end is not counted:
+	expect("truncated", UTF8CountChars(buf, buf+mixed-1), 200+29-1);
+
+	// Random bytes, biased towards UTF-8 structure, must match a UTF8Get scan exactly:
+	const unsigned char	bytes[] = { 'x', 'y', 0x80, 0xBF, 0xC3, 0xA9, 0xE4, 0xB8, 0xAA, 0xF0, 0x9F, 0x8E, 0x89, 0xF8, 0xFC, 0xFF };
+	srand(12345);
+	int		mismatches = 0;
+	for (int trial = 0; trial < 2000; trial++)
+	{
+		int	len = rand()%300;
+		for (int i = 0; i < len; i++)
+			buf[i] = (rand()%4 == 0) ? bytes[rand()%sizeof(bytes)] : 'a'+rand()%26;
+		buf[len] = '\0';
+		bool	ref_ascii;
+		size_t	expected = utf8_reference_count(buf, buf+len, ref_ascii);
+		if (UTF8CountChars(buf, buf+len, &ascii) != expected || ascii != ref_ascii)
+			mismatches++;
+	}
+	expect("random data matches UTF8Get", mismatches, 0);
+}
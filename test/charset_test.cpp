@@ -0,0 +1,151 @@
+/*
+ * Unicode Strings
+ * Tests for CharSet and the StrVal searches that use it
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strval.h>
+#include	<charset.h>
+#include	<cstdio>
+#include	<cstring>
+
+bool		show_passes = false;
+int		test_count;
+int		failure_count;
+const char*	new_group;
+
+void		charset_members();
+void		charset_search();
+
+int
+main(int argc, const char** argv)
+{
+	if (argc > 1 && 0 == strcmp("-p", argv[1]))
+		show_passes = true;
+
+	charset_members();
+	charset_search();
+
+	printf("Completed %d tests with %d failures\n", test_count, failure_count);
+	return failure_count == 0 ? 0 : 1;
+}
+
+void
+test_group(const char* group)
+{
+	new_group = group;
+}
+
+void
+expect(const char* when, uint32_t result, uint32_t wanted = 1)
+{
+	test_count++;
+	if (result != wanted)
+	{
+		if (new_group)
+			printf("%s:\n", new_group);
+		if (wanted != 1)
+			printf("%d:\t%s: FAIL (wanted %d=0x%X got %d=0x%X)\n", test_count, when, wanted, wanted, result, result);
+		else
+			printf("%d:\t%s: FAIL\n", test_count, when);
+		failure_count++;
+		new_group = 0;
+	}
+	else if (show_passes)
+	{
+		if (new_group)
+			printf("%s:\n", new_group);
+		printf("%d:\t%s: PASS\n", test_count, when);
+		new_group = 0;
+	}
+}
+
+void
+charset_members()
+{
+	test_group("Set membership");
+
+	CharSet		white(" \t\n");
+	expect("ASCII member", white.contains('\t') && white.contains(' '));
+	expect("ASCII non-member", !white.contains('a') && !white.contains(0x7F) && !white.contains(0xA0));
+	expect("ASCII only", white.isASCII());
+
+	CharSet		mixed(StrVal("aé某🎉"));
+	expect("mixed members", mixed.contains('a') && mixed.contains(0xE9) && mixed.contains(0x67D0) && mixed.contains(0x1F389));
+	expect("mixed non-members", !mixed.contains('b') && !mixed.contains(0xE8) && !mixed.contains(0x1F388));
+	expect("not ASCII only", !mixed.isASCII());
+
+	CharSet		ranges;
+	ranges.add(0x100, 0x1FF).add(0x300, 0x3FF).add(0x200, 0x2FF).add(0x500).add(0x7E, 0x81);
+	expect("merged ranges", ranges.contains(0x250) && ranges.contains(0x3FF) && ranges.contains(0x100));
+	expect("range edges", !ranges.contains(0xFF) && !ranges.contains(0x400) && ranges.contains(0x500) && !ranges.contains(0x501));
+	expect("range spanning ASCII", ranges.contains(0x7E) && ranges.contains(0x7F) && ranges.contains(0x81) && !ranges.contains(0x7D));
+
+	CharSet		copy(mixed);
+	copy.add('z');
+	expect("copies are separate", copy.contains('z') && !mixed.contains('z') && copy.contains(0xE9));
+}
+
+// Search one character at a time, as a reference:
+int
+slow_find(const StrVal& s, const CharSet& set, bool wanted, int after)
+{
+	for (int i = after+1; i < (int)s.length(); i++)
+		if (set.contains(s[i]) == wanted)
+			return i;
+	return -1;
+}
+
+int
+slow_rfind(const StrVal& s, const CharSet& set, bool wanted, int before)
+{
+	for (int i = (before == -1 ? s.length() : before)-1; i >= 0; i--)
+		if (set.contains(s[i]) == wanted)
+			return i;
+	return -1;
+}
+
+void
+charset_search()
+{
+	test_group("Searching with sets");
+
+	StrVal		text("Hello, wonderful world");
+	expect("findAny", text.findAny(CharSet(" ,")), 5);
+	expect("findAny string", text.findAny(StrVal("ow")), 4);
+	expect("rfindAny", text.rfindAny(CharSet("o")), 18);
+	expect("rfindAny before", text.rfindAny(CharSet("o"), 18), 8);
+	expect("findNot", text.findNot(CharSet("Hel")), 4);
+	expect("rfindNot", text.rfindNot(CharSet("dlr")), 18);
+	expect("none", text.findAny(CharSet("xyz")), -1);
+	expect("empty set", text.findNot(CharSet()), 0);
+
+	// Long enough to use the vector code, with matches in different places:
+	UCS4		samples[] = { 'a', 'b', ' ', 0xE9, 0x4E2A, 0x1F389, '.' };
+	const int	num_chars = 3000;
+	char*		buf = new char[num_chars*4+1];
+	char*		op = buf;
+	uint32_t	random = 3;
+	for (int i = 0; i < num_chars; i++)
+	{
+		random = random*1103515245 + 12345;
+		int	r = (random>>10)%100;
+		UTF8Put(op, samples[r < 40 ? 0 : r < 70 ? 1 : r < 98 ? 2+r%3 : 5+r%2]);
+	}
+	StrVal		big(buf, op-buf);
+	delete[] buf;
+
+	CharSet		sets[] = { CharSet("."), CharSet("ab "), CharSet(StrVal("🎉")), CharSet(StrVal("a b.é")), CharSet(StrVal("ab 个é🎉")) };
+	int		wrong = 0;
+	for (int s = 0; s < 5; s++)
+		for (int at = -1; at < num_chars; at += 97)
+		{
+			if (big.findAny(sets[s], at) != slow_find(big, sets[s], true, at)
+			 || big.findNot(sets[s], at) != slow_find(big, sets[s], false, at)
+			 || big.rfindAny(sets[s], at+1) != slow_rfind(big, sets[s], true, at+1)
+			 || big.rfindNot(sets[s], at+1) != slow_rfind(big, sets[s], false, at+1))
+				wrong++;
+		}
+	expect("long string searches", wrong, 0);
+	expect("rfind whole string", big.rfindAny(sets[0]), slow_rfind(big, sets[0], true, -1));
+}
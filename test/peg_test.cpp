@@ -8,6 +8,7 @@
 #include	<char_encoding.h>
 #include	<refcount.h>
 #include	<strval.h>
+#include	<strmap.h>
 #include	<variant.h>
 
 #include	<peg.h>
@@ -16,9 +17,6 @@
 
 #include	<cstdio>
 #include	<cctype>
-#include	<sys/stat.h>
-#include	<unistd.h>
-#include	<fcntl.h>
 
 #include	"memory_monitor.h"
 
@@ -37,31 +35,9 @@ void usage()
 	exit(1);
 }
 
-char* slurp_file(const char* filename, off_t* size_p)
-{
-	// Open the file and get its size
-	int		fd;
-	struct	stat	stat;
-	char*		px;
-	if ((fd = open(filename, O_RDONLY)) < 0		// Can't open
-	 || fstat(fd, &stat) < 0			// Can't fstat
-	 || (stat.st_mode&S_IFMT) != S_IFREG		// Not a regular file
-	 || (px = new char[stat.st_size+1]) == 0	// Can't get memory
-	 || read(fd, px, stat.st_size) < stat.st_size)	// Can't read entire file
-	{
-		perror(filename);
-		usage();
-	}
-	if (size_p)
-		*size_p = stat.st_size;
-	px[stat.st_size] = '\0';
-
-	return px;
-}
-
 // It's a pity that C++ has no way to initialise these string arrays inline:
 const char*	TOP_captures[] = { "rule", 0 };
-const char*	rule_captures[] = { "name", "alternates", "action" };
+const char*	rule_captures[] = { "name", "alternates", "action", 0 };
 const char*	action_captures[] = { "function", "parameter", 0 };
 const char*	parameter_captures[] = { "parameter", 0 };
 const char*	reference_captures[] = { "name", "joiner", 0 };
@@ -191,7 +167,7 @@ PxParser::Rule	PxParser::rules[] =
 int	PxParser::num_rule = sizeof(PxParser::rules)/sizeof(PxParser::rules[0]);
 
 PxParser::Match
-parse_file(char* text)
+parse_file(const char* text)
 {
 	PxParser		peg;
 
@@ -202,8 +178,16 @@ parse_file(char* text)
 int
 parse_and_report(const char* filename)
 {
-	off_t	file_size;
-	char*	text = slurp_file(filename, &file_size);
+	ErrNum		e;
+	StrVal		file = StrMapFile(filename, &e, StrMapSequential);
+	if (e)
+	{		// Can't open, not a regular file, or can't map
+		errno = e.msg();
+		perror(filename);
+		usage();
+	}
+	const char*	text = file.asUTF8();	// The mapping is followed by a NUL, so this doesn't copy
+	int		file_size = file.numBytes();
 
 	PxParser::Match match = parse_file(text);
 
@@ -234,8 +218,6 @@ parse_and_report(const char* filename)
 	if (bytes_parsed > 0)
 		printf("Parse Tree:\n%s\n", match.var.as_json(0).asUTF8());
 
-	delete text;
-
 	return bytes_parsed == file_size ? 0 : 1;
 }
 
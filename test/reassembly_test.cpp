@@ -13,10 +13,10 @@
 
 int main()
 {
-	StrVal  hello_world("Hello, world");
+	StrVal  hello_world("Hello, wonderful world");	// Too long to be stored inline
 	StrVal	hello = hello_world.substr(0, 5);
 	StrVal	comma = hello_world.substr(5, 2);
-	StrVal	world = hello_world.substr(7, 5);
+	StrVal	world = hello_world.substr(7, 15);
 	StrVal	reassembled = hello + comma;
 	reassembled += world;
 
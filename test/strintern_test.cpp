@@ -0,0 +1,163 @@
+/*
+ * Unicode Strings
+ * Tests for StrIntern
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strintern.h>
+#include	<cstdio>
+#include	<cstring>
+#include	<pthread.h>
+
+bool		show_passes = false;
+int		test_count;
+int		failure_count;
+const char*	new_group;
+
+void		intern_basics();
+void		intern_limits();
+void		intern_threads();
+
+int
+main(int argc, const char** argv)
+{
+	if (argc > 1 && 0 == strcmp("-p", argv[1]))
+		show_passes = true;
+
+	intern_basics();
+	intern_limits();
+	intern_threads();
+
+	printf("Completed %d tests with %d failures\n", test_count, failure_count);
+	return failure_count == 0 ? 0 : 1;
+}
+
+void
+test_group(const char* group)
+{
+	new_group = group;
+}
+
+void
+expect(const char* when, uint32_t result, uint32_t wanted = 1)
+{
+	test_count++;
+	if (result != wanted)
+	{
+		if (new_group)
+			printf("%s:\n", new_group);
+		if (wanted != 1)
+			printf("%d:\t%s: FAIL (wanted %d=0x%X got %d=0x%X)\n", test_count, when, wanted, wanted, result, result);
+		else
+			printf("%d:\t%s: FAIL\n", test_count, when);
+		failure_count++;
+		new_group = 0;
+	}
+	else if (show_passes)
+	{
+		if (new_group)
+			printf("%s:\n", new_group);
+		printf("%d:\t%s: PASS\n", test_count, when);
+		new_group = 0;
+	}
+}
+
+void
+intern_basics()
+{
+	test_group("Interning");
+
+	const char*	text = "identifier and more";
+	StrVal		i1 = StrIntern::intern(text, 10);
+	StrVal		i2 = StrIntern::intern(StrVal("identifier"));
+	StrVal		other = StrIntern::intern("identifies", 10);
+	expect("interned", i1.isInterned() && i2.isInterned() && other.isInterned());
+	expect("value", i1 == "identifier");
+	expect("same body", i1 == i2 && strcmp(i1.asUTF8(), i2.asUTF8()) == 0);
+	expect("shares data", i1.asUTF8() == i2.asUTF8());
+	expect("different", i1 != other);
+	expect("ordering", i1 < other && other > i2);
+	expect("plain equal", i1 == StrVal("identifier") && StrVal("identifier") == i1);
+	expect("slice not interned", !i1.substr(1).isInterned() && i1.substr(1) == "dentifier");
+	expect("reinterning", StrIntern::intern(i1).isInterned());
+
+	StrVal		copy = i1;
+	copy += "!";
+	expect("copy modified", copy == "identifier!" && !copy.isInterned() && i1 == "identifier");
+	expect("empty", StrIntern::intern("", 0).length(), 0);
+}
+
+void
+intern_limits()
+{
+	test_group("Purging unused strings");
+
+	StrIntern::purge();
+	size_t		initial = StrIntern::size();
+	{
+		StrVal	temp1 = StrIntern::intern("temporary 1", 11);
+		StrVal	temp2 = StrIntern::intern("temporary 2", 11);
+		expect("added", StrIntern::size(), initial+2);
+	}
+	StrVal		kept = StrIntern::intern("kept", 4);
+	expect("purged", StrIntern::purge(), 2);
+	expect("kept", StrIntern::size(), initial+1);
+	expect("kept value", StrIntern::intern("kept", 4).isInterned() && kept == "kept");
+
+	StrIntern::setLimit(initial+2);
+	StrVal		full = StrIntern::intern("fills the table", 15);
+	StrVal		excess = StrIntern::intern("one too many", 12);
+	expect("limit reached", full.isInterned() && !excess.isInterned() && excess == "one too many");
+	full = StrVal();
+	excess = StrIntern::intern("one too many", 12);
+	expect("space after purge", excess.isInterned());
+	StrIntern::setLimit(0);
+}
+
+struct	ThreadResult
+{
+	int	base;
+	StrVal	strings[100];
+};
+
+void*
+intern_some(void* arg)
+{
+	ThreadResult*	result = (ThreadResult*)arg;
+	char		buf[20];
+	for (int i = 0; i < 100; i++)
+	{
+		snprintf(buf, sizeof(buf), "thread string %d", (i+result->base)%100);
+		result->strings[i] = StrIntern::intern(buf, strlen(buf));
+	}
+	return 0;
+}
+
+void
+intern_threads()
+{
+	test_group("Interning from many threads");
+
+	const int	num_threads = 8;
+	pthread_t	threads[num_threads];
+	ThreadResult	results[num_threads];
+	for (int t = 0; t < num_threads; t++)
+	{
+		results[t].base = t*13;
+		pthread_create(&threads[t], 0, intern_some, &results[t]);
+	}
+	for (int t = 0; t < num_threads; t++)
+		pthread_join(threads[t], 0);
+
+	int		wrong = 0;
+	for (int t = 1; t < num_threads; t++)
+		for (int i = 0; i < 100; i++)
+		{		// Every thread got the same Body for each string
+			const StrVal&	s = results[t].strings[i];
+			const StrVal&	s0 = results[0].strings[(i+results[t].base)%100];
+			StrValIndex	b1, b2;
+			if (!s.isInterned() || s.asUTF8(b1) != s0.asUTF8(b2))
+				wrong++;
+		}
+	expect("one body per string", wrong, 0);
+}
@@ -0,0 +1,767 @@
+/*
+ * Unicode Strings
+ * Throughput benchmarks for StrVal.
+ * Run with a test name to run only that benchmark.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strval.h>
+#include	<variant.h>
+#include	<arena.h>
+#include	<strmap.h>
+
+#include	<chrono>
+#include	<cstdio>
+#include	<cstring>
+#include	<cstdlib>
+#include	<algorithm>
+#include	<map>
+#include	<unordered_map>
+#include	<vector>
+#include	<pthread.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+
+const char*	only;		// Run only this benchmark
+
+bool
+wanted(const char* name)
+{
+	return !only || strcmp(only, name) == 0;
+}
+
+// Time repeated calls of the operation, and report the time for each:
+template<typename Op>
+void
+timed(const char* what, long repeats, Op op)
+{
+	auto	start = std::chrono::steady_clock::now();
+	for (long i = 0; i < repeats; i++)
+		op(i);
+	auto	end = std::chrono::steady_clock::now();
+	double	ns = std::chrono::duration<double, std::nano>(end-start).count();
+	printf("\t%-40s %12.1f ns/op\n", what, ns/repeats);
+}
+
+// Build a string of about n characters, mixing ASCII and non-ASCII
+StrVal
+mixed_text(int n)
+{
+	static const char*	words[] = { "some ", "ASCII ", "某一个人", "講多過", "émigré ", "🎉 " };
+	static const int	word_chars[] = { 5, 6, 4, 3, 7, 2 };
+	char*	buf = new char[n*4+1];
+	char*	op = buf;
+	for (int chars = 0, w = 0; chars < n; chars += word_chars[w], w = (w+1)%6)
+		op = stpcpy(op, words[w]);
+	StrVal	text(buf, op-buf);
+	delete[] buf;
+	return text;
+}
+
+void
+bench_nth_char()
+{
+	printf("Random character access in a 10M-character non-ASCII string:\n");
+	StrVal		text(mixed_text(10000000).asUTF8());
+	StrValIndex	length = text.length();
+	uint32_t	random = 1;
+	UCS4		sum = 0;
+
+	for (int with_index = 1; with_index >= 0; with_index--)
+	{
+		StrBody::checkpoint_threshold = with_index ? 1024 : ~(StrValIndex)0;
+		StrVal	fresh(text.asUTF8());		// A new Body without an index
+		timed(with_index ? "operator[] with checkpoint index" : "operator[] with bookmark only", with_index ? 1000000 : 100,
+			[&](long) {
+				random = random*1103515245 + 12345;
+				sum += fresh[random%length];
+			});
+		timed(with_index ? "substr() with checkpoint index" : "substr() with bookmark only", with_index ? 1000000 : 100,
+			[&](long) {
+				random = random*1103515245 + 12345;
+				sum += fresh.substr(random%length, 10)[5];
+			});
+	}
+	StrBody::checkpoint_threshold = 1024;
+	if (sum == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_create()
+{
+	printf("Creating and destroying strings:\n");
+	const char*	text = "A string that's too long to store inline";
+	long		total = 0;
+	timed("StrVal from 40 bytes", 10000000,
+		[&](long) {
+			StrVal	s(text);
+			total += s.length();
+		});
+	timed("StrVal copy and append", 1000000,
+		[&](long) {
+			StrVal	s(text);
+			s += StrVal(text);
+			total += s.length();
+		});
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_concat()
+{
+	printf("Building a large string from small pieces:\n");
+	StrVal		piece("some text, ");
+	StrVal		wide("某一个人, ");
+	StrValIndex	total = 0;
+
+	StrVal		appended;
+	timed("append 20000 times", 20000,
+		[&](long i) {
+			appended += (i&1) ? piece : wide;
+		});
+	StrVal		inserted;
+	timed("insert at middle 20000 times", 20000,
+		[&](long i) {
+			inserted.insert(inserted.length()/2, (i&1) ? piece : wide);
+		});
+	timed("flatten", 1,
+		[&](long) {
+			total += strlen(appended.asUTF8()) + strlen(inserted.asUTF8());
+		});
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_find()
+{
+	printf("Searching a 1M-character non-ASCII string:\n");
+	StrVal		text(mixed_text(1000000).asUTF8());
+	StrVal		absent("émigré ASCII");
+	StrVal		near_end = text.substr(text.length()-20, 12);
+	long		total = 0;
+
+	timed("find() absent substring", 100,
+		[&](long) { total += text.find(absent); });
+	timed("rfind() absent substring", 100,
+		[&](long) { total += text.rfind(absent); });
+	timed("find() substring near the end", 100,
+		[&](long) { total += text.find(near_end); });
+	timed("find() absent character", 100,
+		[&](long) { total += text.find((UCS4)'z'); });
+	timed("rfind() character near the start", 100,
+		[&](long) { total += text.rfind((UCS4)0x1F389, 10); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_find_any()
+{
+	printf("Searching a 1M-character non-ASCII string for sets of characters:\n");
+	StrVal		text(mixed_text(1000000).asUTF8());
+	StrVal		punctuation(";:!?");
+	StrVal		wide("講過");
+	CharSet		punctuation_set(punctuation);
+	long		total = text[text.length()-1];	// Build the checkpoint index first
+
+	timed("findAny() absent ASCII set string", 10,
+		[&](long) { total += text.findAny(punctuation); });
+	timed("findAny() absent ASCII CharSet", 10,
+		[&](long) { total += text.findAny(punctuation_set); });
+	timed("findAny() absent non-ASCII set", 10,
+		[&](long) { total += text.findAny(StrVal("丁丂")); });
+	timed("findNot() letters and spaces", 10,
+		[&](long) { total += text.findNot(StrVal("someASCII ")); });
+	timed("rfindAny() non-ASCII near the start", 10,
+		[&](long) { total += text.rfindAny(wide, 100); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_compare_ci()
+{
+	printf("Case-independent comparison:\n");
+	StrVal		ascii1("Content-Type: application/json; charset=UTF-8");
+	StrVal		ascii2("content-type: Application/JSON; Charset=utf-8");
+	StrVal		wide1(mixed_text(1000).asUTF8());
+	StrVal		wide2(wide1.asUpper());
+	long		total = 0;
+
+	timed("asLower() copies, 46 ASCII bytes", 1000000,
+		[&](long) { total += ascii1.asLower() == ascii2.asLower(); });
+	timed("equalCI(), 46 ASCII bytes", 1000000,
+		[&](long) { total += ascii1.equalCI(ascii2); });
+	timed("asLower() copies, 1000 mixed characters", 10000,
+		[&](long) { total += wide1.asLower() == wide2.asLower(); });
+	timed("equalCI(), 1000 mixed characters", 10000,
+		[&](long) { total += wide1.equalCI(wide2); });
+	timed("hashCI(), 46 ASCII bytes", 1000000,
+		[&](long) { total += ascii1.hashCI() == ascii2.hashCI(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_sort()
+{
+	printf("Sorting 20000 file names in natural order:\n");
+	std::vector<StrVal>	names;
+	char			buf[40];
+	uint32_t		random = 1;
+	for (int i = 0; i < 20000; i++)
+	{
+		random = random*1103515245 + 12345;
+		snprintf(buf, sizeof(buf), "photo %d from album %d.jpeg", (random>>8)%5000, (random>>20)%20);
+		names.push_back(StrVal(buf));
+	}
+
+	timed("std::sort comparing with CompareNatural", 1,
+		[&](long) {
+			std::vector<StrVal>	v(names);
+			std::sort(v.begin(), v.end(), [](const StrVal& a, const StrVal& b)
+				{ return a.compare(b, StrVal::CompareNatural) < 0; });
+		});
+	timed("make StrSortKeys and std::sort", 1,
+		[&](long) {
+			std::vector<StrSortKey>	v;
+			for (auto& n: names)
+				v.push_back(StrSortKey(n, StrVal::CompareNatural));
+			std::sort(v.begin(), v.end());
+		});
+}
+
+void
+bench_case()
+{
+	printf("Case conversion of 1MB strings:\n");
+	StrVal		ascii;
+	for (int i = 0; i < 20000; i++)
+		ascii += "Some Mixed-Case ASCII text, about fifty bytes. ";
+	StrVal		wide(mixed_text(400000).asUTF8());
+	StrVal		ascii_flat(ascii.asUTF8());
+	long		total = 0;
+
+	timed("toUpper() ASCII", 10,
+		[&](long) { StrVal s(ascii_flat); s.toUpper(); total += s.length(); });
+	timed("toLower() ASCII", 10,
+		[&](long) { StrVal s(ascii_flat); s.toLower(); total += s.length(); });
+	timed("toUpper() mixed", 10,
+		[&](long) { StrVal s(wide); s.toUpper(); total += s.length(); });
+	timed("asLower() of short string", 1000000,
+		[&](long) { total += StrVal("Hello World").asLower().length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_transform()
+{
+	printf("Transforming a 1M-character non-ASCII string:\n");
+	StrVal		text(mixed_text(1000000).asUTF8());
+	long		total = 0;
+
+	timed("std::function returning replacements", 10,
+		[&](long) {
+			StrVal	s(text);
+			s.transform([](const char*& cp, const char* ep) -> StrVal
+				{
+					UCS4	ch = UTF8Get(cp);
+					return ch == ' ' ? StrVal("_") : StrVal(ch);
+				});
+			total += s.length();
+		});
+	timed("template streaming into a sink", 10,
+		[&](long) {
+			StrVal	s(text);
+			s.transform([](const char*& cp, const char* ep, StrSink& sink)
+				{
+					UCS4	ch = UTF8Get(cp);
+					sink.appendChar(ch == ' ' ? '_' : ch);
+				});
+			total += s.length();
+		});
+	timed("toJSON()", 10,
+		[&](long) { total += text.asJSON().length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_build()
+{
+	printf("Building strings piece by piece:\n");
+	long		total = 0;
+
+	timed("operator+=(UCS4) 100000 characters", 10,
+		[&](long) {
+			StrVal	s;
+			for (int i = 0; i < 100000; i++)
+				s += (UCS4)(i%64 ? 'a'+i%26 : 0xE9);
+			total += s.length();
+		});
+	timed("StrBuilder appendChar 100000 characters", 10,
+		[&](long) {
+			StrBuilder	b;
+			for (int i = 0; i < 100000; i++)
+				b.appendChar(i%64 ? 'a'+i%26 : 0xE9);
+			total += b.take().length();
+		});
+
+	VariantArray	values;
+	for (int i = 0; i < 10000; i++)
+		values << (i%3 ? Variant(i*1000) : Variant("text"));
+	Variant		array(values);
+	timed("as_json() of 10000 values", 10,
+		[&](long) { total += array.as_json().length(); });
+	timed("format() with two arguments", 100000,
+		[&](long i) { total += StrVal::format("Value: '%s', length %d", Variant("param1") << (int)i).length(); });
+	StrFormat	value_format("Value: '%s', length %d");
+	timed("StrFormat with two arguments", 100000,
+		[&](long i) { total += value_format(Variant("param1") << (int)i).length(); });
+	StrFormat	padded_format("%-12s|%8d|%08x|%.3s");
+	timed("StrFormat with widths and precision", 100000,
+		[&](long i) { total += padded_format(Variant("name") << (int)i << (int)i << "abcdef").length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_json()
+{
+	printf("JSON escaping:\n");
+	StrVal		source;
+	for (int i = 0; i < 20000; i++)
+		source += "\tif (name == \"value\") return 0;\n";
+	source = StrVal(source.asUTF8());
+	StrVal		wide(mixed_text(1000000).asUTF8());
+	StrVal		clean("An identifier_name");
+	long		total = 0;
+
+	timed("asJSON() 700KB source code", 10,
+		[&](long) { total += source.asJSON().length(); });
+	timed("asJSON() 1M mixed characters", 10,
+		[&](long) { total += wide.asJSON().length(); });
+	timed("asJSON() short clean string", 1000000,
+		[&](long) { total += clean.asJSON().length(); });
+
+	VariantArray	nodes;
+	for (int i = 0; i < 10000; i++)
+	{
+		StrVariantMap	node;
+		node.put("rule", "identifier");
+		node.put("text", (i%5 ? "name" : "\"quoted\""));
+		nodes << Variant(node);
+	}
+	Variant		tree(nodes);
+	timed("as_json() of 10000 small maps", 10,
+		[&](long) { total += tree.as_json().length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_numbers()
+{
+	printf("Number conversion:\n");
+	std::vector<StrVal>	ints, doubles;
+	uint64_t	x = 88172645463325252ULL;
+	for (int i = 0; i < 10000; i++)
+	{
+		char	buf[64];
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		snprintf(buf, sizeof(buf), "%lld", (long long)(x >> (x%64)) * (i%2 ? 1 : -1));
+		ints.push_back(StrVal(buf));
+		snprintf(buf, sizeof(buf), "%.17g", (double)(x >> 11) / 9007199254740992.0 * (i%3 ? 1e-5 : 1e8));
+		doubles.push_back(StrVal(buf));
+	}
+	double		sum = 0;
+	long		isum = 0;
+
+	timed("strtoll() 10000 integers", 100,
+		[&](long) { for (StrVal& s: ints) isum += strtoll(s.asUTF8(), 0, 10); });
+	timed("asInt64() 10000 integers", 100,
+		[&](long) { for (const StrVal& s: ints) isum += s.asInt64(0, 10); });
+	timed("strtod() 10000 doubles", 100,
+		[&](long) { for (StrVal& s: doubles) sum += strtod(s.asUTF8(), 0); });
+	timed("asDouble() 10000 doubles", 100,
+		[&](long) { for (const StrVal& s: doubles) sum += s.asDouble(); });
+	if (sum == 0 && isum == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_formatting()
+{
+	printf("Number formatting:\n");
+	std::vector<long long>	ints;
+	std::vector<double>	doubles;
+	uint64_t	x = 88172645463325252ULL;
+	for (int i = 0; i < 10000; i++)
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		ints.push_back((long long)(x >> (x%64)) * (i%2 ? 1 : -1));
+		doubles.push_back((double)(x >> 11) / 9007199254740992.0 * (i%3 ? 1e-5 : 1e8));
+	}
+	long		total = 0;
+
+	timed("snprintf(\"%lld\") 10000 integers", 100,
+		[&](long) { for (long long i: ints) { char buf[24]; snprintf(buf, sizeof(buf), "%lld", i); total += StrVal(buf).length(); } });
+	timed("fromInt() 10000 integers", 100,
+		[&](long) { for (long long i: ints) total += StrVal::fromInt(i).length(); });
+	timed("snprintf(\"%.17g\") 10000 doubles", 100,
+		[&](long) { for (double d: doubles) { char buf[32]; snprintf(buf, sizeof(buf), "%.17g", d); total += StrVal(buf).length(); } });
+	timed("fromDouble() 10000 doubles", 100,
+		[&](long) { for (double d: doubles) total += StrVal::fromDouble(d).length(); });
+
+	VariantArray	numbers;
+	for (long long i: ints)
+		numbers << Variant(i);
+	Variant		tree(numbers);
+	timed("as_json() of 10000 integers", 100,
+		[&](long) { total += tree.as_json().length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_hash()
+{
+	printf("Hashing and map lookups:\n");
+	std::vector<StrVal>	keys;
+	for (int i = 0; i < 10000; i++)
+	{
+		char	buf[64];
+		snprintf(buf, sizeof(buf), "/usr/share/project/source/module_%05d.cpp", i);
+		keys.push_back(StrVal(buf));
+	}
+	StrVal		big(mixed_text(1000000).asUTF8());
+	long		total = 0;
+
+	timed("hash() 1M mixed characters, cached", 1000,
+		[&](long) { total += big.hash(); });
+	timed("hash() 1M mixed characters, slice", 100,
+		[&](long) { total += big.substr(1).hash(); });
+	timed("hashCI() 1M mixed characters", 10,
+		[&](long) { total += big.hashCI(); });
+
+	std::map<StrVal, int>		ordered;
+	std::unordered_map<StrVal, int>	hashed;
+	CowMap<int>			cow;
+	CowHashMap<int>			cow_hashed;
+	for (int i = 0; i < (int)keys.size(); i++)
+	{
+		ordered[keys[i]] = i;
+		hashed[keys[i]] = i;
+		cow.insert(keys[i], i);
+		cow_hashed.insert(keys[i], i);
+	}
+	timed("std::map lookup of 10000 long keys", 100,
+		[&](long) { for (const StrVal& k: keys) total += ordered.find(k)->second; });
+	timed("std::unordered_map lookup of 10000 long keys", 100,
+		[&](long) { for (const StrVal& k: keys) total += hashed.find(k)->second; });
+	timed("CowMap lookup of 10000 long keys", 100,
+		[&](long) { for (const StrVal& k: keys) total += cow[k]; });
+	timed("CowHashMap lookup of 10000 long keys", 100,
+		[&](long) { for (const StrVal& k: keys) total += cow_hashed[k]; });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+StrVal
+upper(StrVal s)		// Takes its argument by value, as a by-value API should
+{
+	s.toUpper();
+	return s;
+}
+
+void
+bench_move()
+{
+	printf("Passing values by copy and by move:\n");
+	StrVal		text;
+	for (int i = 0; i < 20000; i++)
+		text += "Some Mixed-Case ASCII text, about fifty bytes. ";
+	text = StrVal(text.asUTF8());
+	long		total = 0;
+
+	timed("upper(s) of a 1MB string, copied", 100,
+		[&](long) { text = upper(text); total += text.length(); });
+	timed("upper(s.pass()) of a 1MB string", 100,
+		[&](long) { text = upper(text.pass()); total += text.length(); });
+
+	StrVal		a(mixed_text(1000).asUTF8());
+	StrVal		b(mixed_text(2000).asUTF8());
+	timed("std::swap of two StrVals", 10000000,
+		[&](long) { std::swap(a, b); total += a.length(); });
+
+	std::vector<StrVal>	values;
+	for (int i = 0; i < 1000; i++)
+		values.push_back(mixed_text(50+i%50).substr(i%7));
+	timed("std::reverse of 1000 StrVals", 10000,
+		[&](long) { std::reverse(values.begin(), values.end()); total += values[0].length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+const StrVal*	contended;		// Copied by many threads at once
+
+void*
+copy_contended(void* arg)
+{
+	long		total = 0;
+	for (long i = 0; i < 1000000; i++)
+	{
+		StrVal	copy = *contended;
+		total += copy.length();
+	}
+	*(long*)arg = total;
+	return 0;
+}
+
+void
+bench_refcount()
+{
+	printf("Reference counting:\n");
+	StrVal		text(mixed_text(100).asUTF8());
+	long		total = 0;
+
+	timed("copy StrVal in the owning thread", 10000000,
+		[&](long) { StrVal copy = text; total += copy.length(); });
+	text.share();
+	timed("copy shared StrVal, one thread", 10000000,
+		[&](long) { StrVal copy = text; total += copy.length(); });
+
+	contended = &text;
+	for (int num_threads = 2; num_threads <= 8; num_threads *= 2)
+	{
+		char		what[64];
+		long		totals[8];
+		pthread_t	threads[8];
+		snprintf(what, sizeof(what), "copy shared StrVal, %d threads (1M each)", num_threads);
+		timed(what, 1,
+			[&](long) {
+				for (int t = 0; t < num_threads; t++)
+					pthread_create(&threads[t], 0, copy_contended, &totals[t]);
+				for (int t = 0; t < num_threads; t++)
+					pthread_join(threads[t], 0);
+			});
+		total += totals[0];
+	}
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void*
+make_strings(void* arg)
+{
+	char		buf[256];
+	memset(buf, 'x', sizeof(buf));
+	long		total = 0;
+	for (long i = 0; i < 1000000; i++)
+	{
+		StrVal	s(buf, 20+i%200);	// Too long to be inline
+		total += s.length();
+	}
+	*(long*)arg = total;
+	return 0;
+}
+
+void
+bench_alloc()
+{
+	printf("Allocation rate, making and dropping 1M strings of 20..220 bytes in each thread:\n");
+	long		total = 0;
+	for (int num_threads = 1; num_threads <= 8; num_threads *= 2)
+	{
+		char		what[64];
+		long		totals[8];
+		pthread_t	threads[8];
+		snprintf(what, sizeof(what), "%d thread%s (per string)", num_threads, num_threads > 1 ? "s" : "");
+		timed(what, num_threads*1000000,
+			[&](long i) {
+				if (i != 0)
+					return;
+				for (int t = 0; t < num_threads; t++)
+					pthread_create(&threads[t], 0, make_strings, &totals[t]);
+				for (int t = 0; t < num_threads; t++)
+					pthread_join(threads[t], 0);
+			});
+		total += totals[0];
+	}
+
+	// Strings made in this thread and dropped in another:
+	std::vector<StrVal>	made(100000);
+	char		buf[256];
+	memset(buf, 'y', sizeof(buf));
+	timed("make here, drop in another thread", 100000,
+		[&](long i) {
+			made[i] = StrVal(buf, 20+i%200);
+			made[i].share();		// Before another thread may release it
+			if (i != 99999)
+				return;
+			pthread_t	dropper;
+			pthread_create(&dropper, 0, [](void* arg) -> void* {
+				std::vector<StrVal>*	v = (std::vector<StrVal>*)arg;
+				for (StrVal& s: *v)
+					s = StrVal();
+				return 0;
+			}, &made);
+			pthread_join(dropper, 0);
+		});
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+long
+render_rows(int n)		// Make a tree of short-lived values, render it as JSON, and drop it all
+{
+	VariantArray	rows;
+	for (int i = 0; i < n; i++)
+	{
+		char		buf[64];
+		snprintf(buf, sizeof(buf), "row %d of the result, with some text", i);
+		VariantArray	row;
+		row += Variant(StrVal(buf));
+		row += Variant(i);
+		rows += Variant(row);
+	}
+	return Variant(rows).as_json().length();
+}
+
+void
+bench_arena()
+{
+	printf("Arena allocation:\n");
+	long		total = 0;
+	char		buf[256];
+	memset(buf, 'x', sizeof(buf));
+	timed("keep 1000 strings, then drop them", 10000,
+		[&](long) {
+			std::vector<StrVal>	kept(1000);
+			for (int i = 0; i < 1000; i++)
+				kept[i] = StrVal(buf, 20+i%200);
+			total += kept[999].length();
+		});
+	timed("the same in an ArenaScope", 10000,
+		[&](long) {
+			ArenaScope		arena;
+			std::vector<StrVal>	kept(1000);
+			for (int i = 0; i < 1000; i++)
+				kept[i] = StrVal(buf, 20+i%200);
+			total += kept[999].length();
+		});
+	timed("render 100 rows as JSON", 10000,
+		[&](long) { total += render_rows(100); });
+	timed("the same in an ArenaScope", 10000,
+		[&](long) { ArenaScope arena; total += render_rows(100); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_literal()
+{
+	printf("String literals:\n");
+	long		total = 0;
+	timed("StrVal(\"a 40-byte literal\")", 1000000,
+		[&](long) { StrVal s("Expected a closing bracket after the list"); total += s.length(); });
+	timed("StrValLiteral(\"a 40-byte literal\")", 1000000,
+		[&](long) { StrVal s = StrValLiteral("Expected a closing bracket after the list"); total += s.length(); });
+	StrVal		made("Expected a closing bracket after the list");
+	StrVal		literal = StrValLiteral("Expected a closing bracket after the list");
+	timed("copy a made StrVal", 10000000,
+		[&](long) { StrVal copy = made; total += copy.length(); });
+	timed("copy a literal StrVal", 10000000,
+		[&](long) { StrVal copy = literal; total += copy.length(); });
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+void
+bench_map()
+{
+	printf("Memory-mapped files:\n");
+	char		path[] = "/tmp/strval_benchXXXXXX";
+	int		fd = mkstemp(path);
+	if (fd < 0)
+		return;
+	const char*	line = "The quick brown fox jumps over the lazy dog, 素早い茶色の狐.\n";
+	std::string	contents;
+	while (contents.size() < 16*1024*1024)
+		contents += line;
+	if (write(fd, contents.data(), contents.size()) != (ssize_t)contents.size())
+		printf("(short write)\n");
+	close(fd);
+
+	long		total = 0;
+	timed("read a 16MB file into a StrVal", 20,
+		[&](long) {
+			int	fd = open(path, O_RDONLY);
+			char*	buf = new char[contents.size()];
+			if (read(fd, buf, contents.size()) == (ssize_t)contents.size())
+			{
+				StrVal	s(buf, contents.size());
+				total += s.length();
+			}
+			delete[] buf;
+			close(fd);
+		});
+	timed("StrMapFile a 16MB file", 20,
+		[&](long) { StrVal s = StrMapFile(path); total += s.length(); });
+	unlink(path);
+	if (total == 0)
+		printf("(unlikely checksum)\n");
+}
+
+int
+main(int argc, const char** argv)
+{
+	if (argc > 1)
+		only = argv[1];
+
+	if (wanted("nth_char"))
+		bench_nth_char();
+	if (wanted("concat"))
+		bench_concat();
+	if (wanted("create"))
+		bench_create();
+	if (wanted("find"))
+		bench_find();
+	if (wanted("find_any"))
+		bench_find_any();
+	if (wanted("compare_ci"))
+		bench_compare_ci();
+	if (wanted("sort"))
+		bench_sort();
+	if (wanted("case"))
+		bench_case();
+	if (wanted("transform"))
+		bench_transform();
+	if (wanted("build"))
+		bench_build();
+	if (wanted("json"))
+		bench_json();
+	if (wanted("numbers"))
+		bench_numbers();
+	if (wanted("formatting"))
+		bench_formatting();
+	if (wanted("hash"))
+		bench_hash();
+	if (wanted("move"))
+		bench_move();
+	if (wanted("refcount"))
+		bench_refcount();
+	if (wanted("alloc"))
+		bench_alloc();
+	if (wanted("arena"))
+		bench_arena();
+	if (wanted("literal"))
+		bench_literal();
+	if (wanted("map"))
+		bench_map();
+	return 0;
+}
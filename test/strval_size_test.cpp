@@ -0,0 +1,36 @@
+/*
+ * Unicode Strings
+ * Object sizes with 16-bit and 32-bit indices.
+ * Build with -DStrValIndexBits=16 -DArrayIndexBits=16 to make 16-bit indices the default.
+ *
+ * (c) Copyright Clifford Heath 2025. See LICENSE file for usage rights.
+ */
+#include	<strval.h>
+#include	<variant.h>
+#include	<cowmap.h>
+#include	<cstdio>
+
+#define	SIZES(T)	printf("%-24s %8d %8d\n", #T, (int)sizeof(T<uint16_t>), (int)sizeof(T<uint32_t>))
+
+template<typename Index> using StrArrayBody = ArrayBody<char, Index>;
+template<typename Index> using StrArray = Array<StrVal, Index>;
+
+int
+main(int argc, const char** argv)
+{
+	printf("%-24s %8s %8s\n", "Object", "16-bit", "32-bit");
+	SIZES(StrBookmark);
+	SIZES(StrRefI);
+	SIZES(StrValI);
+	SIZES(StrBodyI);
+	SIZES(StrRopeI);
+	SIZES(StrArrayBody);
+	SIZES(StrArray);
+
+	printf("\nWith the default indices of %d and %d bits:\n", StrValIndexBits, ArrayIndexBits);
+	printf("%-24s %8d\n", "StrVal", (int)sizeof(StrVal));
+	printf("%-24s %8d\n", "Variant", (int)sizeof(Variant));
+	printf("%-24s %8d\n", "VariantArray", (int)sizeof(VariantArray));
+	printf("%-24s %8d\n", "CowMap<Variant>", (int)sizeof(CowMap<Variant>));
+	return 0;
+}
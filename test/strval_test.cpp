@@ -1,12 +1,1587 @@
+/*
+ * Unicode Strings
+ * Tests for StrVal
+ *
+ * (c) Copyright Clifford Heath 2022. See LICENSE file for usage rights.
+ */
 #include	<strval.h>
+#include	<variant.h>
 #include	<cstdio>
+#include	<cstring>
+#include	<cstdlib>
+#include	<cmath>
+#include	<new>
+#include	<map>
+#include	<unordered_map>
+#include	<algorithm>
+#include	<stdexcept>
+#include	<cowmap.h>
+#include	<pthread.h>
+#include	<slab.h>
+#include	<arena.h>
+#include	<peg_ast.h>
+#include	<strmap.h>
+#include	<sys/mman.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+
+bool		show_passes = false;
+int		test_count;
+int		failure_count;
+const char*	new_group;
+
+void		strval_checkpoints();
+void		strval_inline();
+void		strval_allocation();
+void		strval_move();
+void		strval_literal();
+void		strval_ropes();
+void		strval_find();
+void		strval_compare_ci();
+void		strval_sort_keys();
+void		strval_case();
+void		strval_transform();
+void		strval_builder();
+void		strval_json();
+void		strval_numbers();
+void		strval_formatting();
+void		strval_format();
+void		strval_hash();
+void		strval_refcount();
+void		strval_slab();
+void		strval_arena();
+void		strval_peg();
+void		strval_index16();
+void		strval_map();
+
+#if !defined(MEMCHECK)
+// Count allocations, so we can check which operations need none.
+// Every form of new and delete is replaced, and all of them use these two,
+// which aren't inlined so the compiler never pairs malloc with a delete:
+long		new_count;
+
+__attribute__((noinline)) static void*
+counted_malloc(size_t size)
+{
+	new_count++;
+	void*	p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) static void
+counted_free(void* p)
+{
+	free(p);
+}
+
+void*	operator new(size_t size) { return counted_malloc(size); }
+void*	operator new[](size_t size) { return counted_malloc(size); }	// Sanitizers replace the default new[]
+void	operator delete(void* p) noexcept { counted_free(p); }
+void	operator delete[](void* p) noexcept { counted_free(p); }
+void	operator delete(void* p, size_t) noexcept { counted_free(p); }
+void	operator delete[](void* p, size_t) noexcept { counted_free(p); }
+
+long
+allocations()		// Including blocks from the slab allocator
+{
+#if	defined(SLAB_ALLOC)
+	return new_count + SlabAllocations();
+#else
+	return new_count;
+#endif
+}
+#endif
 
 int
 main(int argc, const char** argv)
 {
+	if (argc > 1 && 0 == strcmp("-p", argv[1]))
+		show_passes = true;
+
 	StrVal		s;
 	StrVal		foo("foo");
 
 	const UTF8*		f = foo.asUTF8();
 	printf("f=`%s`\n", f);
+
+	strval_checkpoints();
+	strval_ropes();
+	strval_find();
+	strval_compare_ci();
+	strval_sort_keys();
+	strval_case();
+	strval_transform();
+	strval_builder();
+	strval_json();
+	strval_numbers();
+	strval_formatting();
+	strval_format();
+	strval_hash();
+	strval_refcount();
+	strval_slab();
+	strval_arena();
+	strval_peg();
+	strval_index16();
+	strval_map();
+#if !defined(MEMCHECK)
+#if	StrValIndexBits > 16		// 16-bit StrVals hold fewer bytes inline than these tests use
+	strval_inline();
+#endif
+	strval_allocation();
+	strval_move();
+	strval_literal();
+#endif
+
+	printf("Completed %d tests with %d failures\n", test_count, failure_count);
+	return failure_count == 0 ? 0 : 1;
+}
+
+void
+test_group(const char* group)
+{
+	new_group = group;
+}
+
+void
+expect(const char* when, uint32_t result, uint32_t wanted = 1)
+{
+	test_count++;
+	if (result != wanted)
+	{
+		if (new_group)
+			printf("%s:\n", new_group);
+		if (wanted != 1)
+			printf("%d:\t%s: FAIL (wanted %d=0x%X got %d=0x%X)\n", test_count, when, wanted, wanted, result, result);
+		else
+			printf("%d:\t%s: FAIL\n", test_count, when);
+		failure_count++;
+		new_group = 0;
+	}
+	else if (show_passes)
+	{
+		if (new_group)
+			printf("%s:\n", new_group);
+		printf("%d:\t%s: PASS\n", test_count, when);
+		new_group = 0;
+	}
+}
+
+void
+strval_checkpoints()
+{
+	test_group("Checkpoint index on large bodies");
+
+	// Build enough mixed-width text to be indexed:
+	UCS4		samples[] = { 'a', 0xE9, 0x4E2A, 0x1F389, ' ' };
+	const int	num_chars = 5000;
+	char*		buf = new char[num_chars*4+1];
+	char*		op = buf;
+	for (int i = 0; i < num_chars; i++)
+		UTF8Put(op, samples[i*7%5]);
+	StrVal		big(buf, op-buf);
+	delete[] buf;
+	expect("length", big.length(), num_chars);
+
+	int		wrong = 0;
+	for (int i = num_chars-1; i >= 0; i -= 3)
+		if (big[i] != samples[i*7%5])
+			wrong++;
+	expect("indexed characters", wrong, 0);
+
+	StrVal		slice = big.substr(1000, 100);
+	wrong = 0;
+	for (int i = 0; i < 100; i++)
+		if (slice[i] != samples[(1000+i)*7%5])
+			wrong++;
+	expect("indexed slice characters", wrong, 0);
+
+	// Mutation discards the index:
+	big.insert(10, StrVal("xyz"));
+	expect("length after insert", big.length(), num_chars+3);
+	expect("character after insert", big[num_chars], samples[(num_chars-3)*7%5]);
+}
+
+void
+strval_ropes()
+{
+	test_group("Large concatenations make ropes");
+
+	// Build by appending, inserting and prepending, and check against a plain buffer
+	const char*	words[] = { "alpha ", "βeta ", "γάμμα ", "🎉 ", "a much longer piece of text to insert " };
+	const int	max_bytes = 200000;
+	char*		expected = new char[max_bytes];
+	int		expected_bytes = 0;
+	StrVal		rope;
+	uint32_t	random = 1;
+	for (int i = 0; i < 2000; i++)
+	{
+		random = random*1103515245 + 12345;
+		const char*	word = words[(random>>8)%5];
+		int		word_bytes = strlen(word);
+		int		pos_char = rope.length() == 0 ? 0 : (random>>12)%(rope.length()+1);
+		if (i%3 == 0)
+			pos_char = rope.length();	// Mostly append
+
+		// Find the byte position in the expected data:
+		const char*	ep = expected;
+		for (int c = 0; c < pos_char; c++)
+			ep += UTF8Len(ep);
+		int		pos_byte = ep-expected;
+		memmove(expected+pos_byte+word_bytes, expected+pos_byte, expected_bytes-pos_byte);
+		memcpy(expected+pos_byte, word, word_bytes);
+		expected_bytes += word_bytes;
+
+		rope.insert(pos_char, StrVal(word));
+	}
+	expected[expected_bytes] = '\0';
+	expect("is a rope", rope.isRope());
+
+	StrVal		flat(expected);
+	expect("rope length", rope.length(), flat.length());
+	int		wrong = 0;
+	for (int i = 0; i < (int)flat.length(); i += 7)
+		if (rope[i] != flat[i])
+			wrong++;
+	expect("characters from rope", wrong, 0);
+	expect("still a rope", rope.isRope());
+
+	StrVal		slice = rope.substr(1000, 5000);
+	expect("slice of rope", slice == flat.substr(1000, 5000));
+	StrVal		joined = slice.substr(0, 2000) + slice.substr(2000);
+	expect("rejoined slices", joined == slice);
+
+	StrVal		copy(rope);
+	expect("equal to flat", copy == flat);
+	expect("NUL terminated", strcmp(rope.asUTF8(), expected) == 0);
+	expect("flattened", !rope.isRope());
+	expect("copy shares the flat data", copy.isRope() && copy == rope);
+
+	copy.toUpper();
+	expect("modified copy", copy[0] == rope.asUpper()[0] && copy.length() == rope.length());
+	delete[] expected;
+}
+
+// Search one character at a time, as a reference:
+int
+slow_find(const StrVal& s, const StrVal& needle, int after = -1)
+{
+	for (int i = after+1; i+(int)needle.length() <= (int)s.length(); i++)
+		if (s.substr(i, needle.length()) == needle)
+			return i;
+	return -1;
+}
+
+int
+slow_rfind(const StrVal& s, const StrVal& needle, int before = -1)
+{
+	int		last = (int)s.length()-(int)needle.length();
+	if (before != -1 && before-1 < last)
+		last = before-1;
+	for (int i = last; i >= 0; i--)
+		if (s.substr(i, needle.length()) == needle)
+			return i;
+	return -1;
+}
+
+void
+strval_find()
+{
+	test_group("Substring search");
+
+	UCS4		samples[] = { 'a', 'b', 0xE9, 0x4E2A, 0x1F389, ' ', 'c' };
+	const int	num_chars = 3000;
+	char*		buf = new char[num_chars*4+1];
+	char*		op = buf;
+	uint32_t	random = 7;
+	for (int i = 0; i < num_chars; i++)
+	{
+		random = random*1103515245 + 12345;
+		UTF8Put(op, samples[(random>>10)%7]);
+	}
+	StrVal		big(buf, op-buf);
+	delete[] buf;
+
+	int		wrong = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		random = random*1103515245 + 12345;
+		int		at = (random>>8)%num_chars;
+		int		len = 1+(random>>20)%12;
+		StrVal		needle = big.substr(at, len);
+		if (i%4 == 0)
+			needle += "x";			// Usually not found
+		int		from = i%3 == 0 ? at-1 : (i%3 == 1 ? -1 : at/2);
+		if (big.find(needle, from) != slow_find(big, needle, from)
+		 || big.rfind(needle) != slow_rfind(big, needle)
+		 || big.rfind(needle, at+1) != slow_rfind(big, needle, at+1))
+			wrong++;
+	}
+	expect("substrings", wrong, 0);
+
+	wrong = 0;
+	for (int i = 0; i < 7; i++)
+	{
+		StrVal		ch(samples[i]);
+		if (big.find(samples[i], 100) != slow_find(big, ch, 100)
+		 || big.rfind(samples[i], 2000) != slow_rfind(big, ch, 2000))
+			wrong++;
+	}
+	expect("characters", wrong, 0);
+
+	StrVal		hello("Hello, wonderful world");
+	expect("short find", hello.find("wo"), 7);
+	expect("short find after", hello.find("wo", 7), 17);
+	expect("short rfind", hello.rfind("wo"), 17);
+	expect("short rfind before", hello.rfind("wo", 17), 7);
+	expect("find char", hello.find('d'), 10);
+	expect("rfind last char", hello.rfind('d'), 21);
+	expect("not found", hello.find("worlds"), -1);
+	expect("longer than string", hello.find("Hello, wonderful world!"), -1);
+	expect("rfind too long", hello.rfind("Hello, wonderful world!"), -1);
+	expect("empty needle", hello.find(""), 0);
+	expect("empty needle after", hello.find("", 3), 4);
+	expect("empty rfind", hello.rfind(""), hello.length());
+
+	// A needle starting with a continuation byte must not match inside a character:
+	StrVal		odd("\xC3\xA9-\xA9");	// é, '-', then a lone continuation byte
+	expect("odd length", odd.length(), 3);
+	expect("continuation byte not inside char", odd.find(StrVal("\xA9")), 2);
+	expect("continuation byte rfind", odd.rfind(StrVal("\xA9")), 2);
+	expect("continuation byte not found", StrVal("\xC3\xA9").find(StrVal("\xA9")), -1);
+}
+
+void
+strval_compare_ci()
+{
+	test_group("Case-independent comparison");
+
+	StrVal		hello("Hello, World");
+	expect("equalCI", hello.equalCI("hELLO, wORLD"));
+	expect("not equalCI", !hello.equalCI("Hello, Word") && !hello.equalCI("Hello, Worle"));
+	expect("ordering", hello.compare("hello, xylophone", StrVal::CompareCI) < 0 && StrVal("B").compare("a", StrVal::CompareCI) > 0);
+	expect("prefix first", StrVal("HELLO").compare(hello, StrVal::CompareCI) < 0 && hello.compare("HELLO", StrVal::CompareCI) > 0);
+	expect("non-letters unchanged", !StrVal("[").equalCI("{") && !StrVal("@").equalCI("`"));
+	expect("Latin-1", StrVal("ÉCOLE Été").equalCI("école été"));
+	expect("Greek sigma", StrVal("ΣΊΣΥΦΟΣ").equalCI("σίσυφος") && StrVal("ΣΊΣΥΦΟΣ").equalCI("σίσυφοσ"));
+	expect("micro sign", StrVal("µ").equalCI("Μ"));
+	expect("non-ASCII ordering", StrVal("é").compare("F", StrVal::CompareCI) > 0);
+
+	// Long enough for the vector comparison, with the difference in many places:
+	const char*	upper = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG, ÀND THE QUICK BROWN FOX JUMPS AGAIN";
+	const char*	lower = "the quick brown fox jumps over the lazy dog, ànd the quick brown fox jumps again";
+	StrVal		u(upper);
+	StrVal		l(lower);
+	expect("long equalCI", u.equalCI(l) && l.equalCI(u));
+	int		wrong = 0;
+	for (int i = 0; i < (int)l.length(); i++)
+	{
+		StrVal	changed = l.substr(0, i) + "#" + l.substr(i+1);
+		int	c1 = u.compare(changed, StrVal::CompareCI);
+		int	c2 = changed.compare(u, StrVal::CompareCI);
+		if (changed.equalCI(u) || c1 == 0 || (c1 < 0) == (c2 < 0))
+			wrong++;
+	}
+	expect("long strings differing at each position", wrong, 0);
+
+	expect("hashCI", u.hashCI() == l.hashCI() && hello.hashCI() == StrVal("HELLO, world").hashCI());
+	expect("hashCI differs", hello.hashCI() != StrVal("Hello, Word").hashCI());
+	StrVal		long_u = u*10;		// Many bufferfuls, with differently-sized characters
+	StrVal		long_l = l*10;
+	expect("long hashCI", long_u.hashCI() == long_l.hashCI() && long_u.hashCI() != (long_l+"x").hashCI());
+	expect("hashCI of a slice", long_u.substr(90, 500).hashCI() == StrVal(long_l.substr(90, 500).asUTF8()).hashCI());
+	expect("Greek hashCI", StrVal("ΣΊΣΥΦΟΣ").hashCI() == StrVal("σίσυφος").hashCI());
+	expect("hashCI of non-ASCII folding to ASCII",
+		StrVal("\u212A").equalCI("k") && StrVal("\u212A").hashCI() == StrVal("k").hashCI()
+		&& StrVal("\u017F").equalCI("s") && StrVal("\u017F").hashCI() == StrVal("s").hashCI()
+		&& StrVal("\u212Aelvin's").hashCI() == StrVal("KELVIN'S").hashCI());
+
+	std::unordered_map<StrVal, int, StrValHashCI, StrValEqualCI>	counts;
+	counts["Apple"]++;
+	counts["APPLE"]++;
+	counts["apple"]++;
+	counts["Äpple"]++;
+	counts["äPPLE"]++;
+	expect("unordered_map keys", counts.size(), 2);
+	expect("unordered_map count", counts["aPpLe"], 3);
+
+	std::map<StrVal, int, StrValLessCI>	ordered;
+	ordered["banana"] = 1;
+	ordered["Apple"] = 2;
+	ordered["APPLE"] = 3;
+	ordered["Cherry"] = 4;
+	expect("map keys", ordered.size(), 3);
+	expect("map order", ordered.begin()->second == 3 && ordered.rbegin()->first == "Cherry");
+
+#if !defined(MEMCHECK)
+	long		before = allocations();
+	bool		same = u.equalCI(l) && u.compare(hello, StrVal::CompareCI) > 0 && u.hashCI() == l.hashCI();
+	expect("no allocation", same && allocations() == before);
+#endif
+}
+
+int
+sign(int i)
+{
+	return i < 0 ? -1 : i > 0 ? 1 : 0;
+}
+
+void
+strval_sort_keys()
+{
+	test_group("Sort keys");
+
+	const char*	words[] = {
+		"file10", "file2", "File2", "file02", "file", "file2a", "file1", "a", "",
+		"été", "Été", "ÉTÉ", "z", "Z", "9", "10", "x100y2", "x100y10", "x99y",
+		"0", "000", "a\x01b", "12345678901234567890", "2345678901234567890",
+		"\xFF" "bad", "\xC3", "٣", "١٢", "file 7 a", "file 007 b", "1a", "01a", "a\x01", "a\x02"
+	};
+	const int	num_words = sizeof(words)/sizeof(words[0]);
+
+	int		wrong = 0;
+	for (int i = 0; i < num_words; i++)
+		for (int j = 0; j < num_words; j++)
+		{
+			StrVal	a(words[i]);
+			StrVal	b(words[j]);
+			if (sign(a.sortKey().compare(b.sortKey())) != sign(a.compare(b))
+			 || sign(a.sortKey(StrVal::CompareCI).compare(b.sortKey(StrVal::CompareCI))) != sign(a.compare(b, StrVal::CompareCI))
+			 || sign(a.sortKey(StrVal::CompareNatural).compare(b.sortKey(StrVal::CompareNatural))) != sign(a.compare(b, StrVal::CompareNatural)))
+				wrong++;
+		}
+	expect("keys order like compare", wrong, 0);
+
+	auto		natural = [](const char* a, const char* b)
+			{ return StrVal(a).compare(b, StrVal::CompareNatural); };
+	expect("numbers by value", natural("file2", "file10") < 0 && natural("file10", "file9") > 0);
+	expect("several numbers", natural("x100y2", "x100y10") < 0 && natural("x99y", "x100y2") < 0);
+	expect("long numbers", natural("12345678901234567890", "2345678901234567890") > 0);
+	expect("prefix first", natural("file", "file1") < 0 && natural("file2", "file2a") < 0);
+	expect("text order", natural("file2", "File2") > 0 && natural("a", "b") < 0);
+	expect("numbers before letters", natural("9", "a") < 0);
+	expect("leading zeroes differ", natural("file02", "file2") != 0 && natural("file02", "file3") < 0);
+	expect("zero", natural("0", "1") < 0 && natural("000", "1") < 0);
+	expect("other digits", natural("١٢", "3") > 0 && natural("٣", "12") < 0);
+	expect("equal", natural("file10", "file10"), 0);
+	expect("escaped", natural("a\x01b", "a") > 0 && natural("a\x01b", "a2") < 0);
+	StrVal		many_digits = StrVal("9")*300;
+	StrVal		more_digits = "1"+StrVal("0")*300;
+	expect("numbers of hundreds of digits", (many_digits+"x").compare(more_digits, StrVal::CompareNatural) < 0
+		&& sign(many_digits.sortKey(StrVal::CompareNatural).compare(more_digits.sortKey(StrVal::CompareNatural))) < 0);
+#if !defined(MEMCHECK)
+	StrVal		photo12("photo 4721 from album 12.jpeg");
+	StrVal		photo3("photo 4721 from album 3.jpeg");
+	long		before = allocations();
+	int		cmp = photo12.compare(photo3, StrVal::CompareNatural);
+	expect("compares in place", cmp > 0 && allocations() == before);
+#endif
+
+	Array<StrSortKey>	sorted;
+	const char*	names[] = { "img12.png", "img10.png", "IMG2.png", "img1.png", "img2.png" };
+	for (int i = 0; i < 5; i++)
+		sorted.push(StrSortKey(names[i], StrVal::CompareNatural));
+	StrSortKey*	sp = &sorted.elem_mut(0);
+	std::sort(sp, sp+sorted.length());
+	expect("sorted naturally",
+		sorted[0].value() == "IMG2.png" && sorted[1].value() == "img1.png" && sorted[2].value() == "img2.png"
+		&& sorted[3].value() == "img10.png" && sorted[4].value() == "img12.png");
+
+	CowMap<int, StrSortKey>	map;
+	for (int i = 0; i < 5; i++)
+		map.insert(StrSortKey(names[i], StrVal::CompareCI), i);
+	StrVal		order;
+	for (auto it = map.begin(); it != map.end(); it++)
+		order += StrVal((UCS4)('0'+it->second));
+	expect("CowMap in key order", order == "3102");	// IMG2 and img2 are the same key
+}
+
+void
+strval_case()
+{
+	test_group("Case conversion");
+
+	StrVal		mixed("The Quick Brown Fox Jumps Over The Lazy Dog, Ève Ἀθῆναι");
+	StrVal		copy(mixed);
+	mixed.toUpper();
+	expect("toUpper", mixed == "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG, ÈVE ἈΘῆΝΑΙ");	// ῆ has no single upper case
+	expect("copy unchanged", copy[4] == 'Q' && copy[45] == 0xC8);
+	expect("toLower", copy.asLower() == "the quick brown fox jumps over the lazy dog, ève ἀθῆναι");
+	expect("length kept", mixed.length() == copy.length());
+
+	// Some characters change length:
+	StrVal		dotless("ıstanbul, ıslands and plenty more text");
+	dotless.toUpper();
+	expect("shorter character", dotless == "ISTANBUL, ISLANDS AND PLENTY MORE TEXT");
+	expect("indexing after", dotless[10] == 'I' && dotless[dotless.length()-1] == 'T');
+	StrVal		kelvin("100 \u212A and 200 \u212A");
+	expect("Kelvin sign", kelvin.asLower() == "100 k and 200 k" && kelvin.asLower().length() == kelvin.length());
+
+	// A large indexed body:
+	UCS4		samples[] = { 'a', 0xE9, 0x131, 0x4E2A, 'Z', ' ' };
+	char*		buf = new char[5000*4+1];
+	char*		op = buf;
+	for (int i = 0; i < 5000; i++)
+		UTF8Put(op, samples[i*7%6]);
+	StrVal		big(buf, op-buf);
+	delete[] buf;
+	UCS4		before = big[4000];	// Builds the index
+	big.toUpper();
+	int		wrong = 0;
+	for (int i = 0; i < 5000; i += 7)
+		if (big[i] != UCS4ToUpper(samples[i*7%6]))
+			wrong++;
+	expect("large body", wrong == 0 && big.length() == 5000 && UCS4ToUpper(before) == big[4000]);
+
+	StrVal		substring = StrVal("Hello, World. This string is long enough").substr(7, 5);
+	substring.toLower();
+	expect("substring", substring == "world");
+
+#if !defined(MEMCHECK)
+	StrVal		inline_string("Short Ève");
+	StrVal		body_string("A string that's too long to store inline");
+	long		allocs = allocations();
+	inline_string.toUpper();
+	body_string.toLower();
+	expect("no allocation", allocations() == allocs && inline_string == "SHORT ÈVE" && body_string == "a string that's too long to store inline");
+#endif
+}
+
+void
+strval_transform()
+{
+	test_group("Transforms");
+
+	// Streaming into a sink, consuming one or more characters each time:
+	StrVal		text("a-b--c é- d");
+	text.transform(
+		[](const char*& cp, const char* ep, StrSink& sink)
+		{
+			if (*cp != '-')
+				sink.appendChar(UTF8Get(cp));
+			else
+			{
+				while (cp < ep && *cp == '-')
+					cp++;
+				sink.appendBytes(" – ", 5);	// An en-dash between spaces
+			}
+		});
+	expect("streaming transform", text == "a – b – c é –  d" && text.length() == 16);
+
+	StrVal		skipped("a-b-c-d");
+	skipped.transform([](const char*& cp, const char* ep, StrSink& sink) { cp++; sink.appendChar('+'); }, 2);
+	expect("transform after", skipped == "a-b++++");
+
+	// Stopping leaves the rest, but keeps the final output:
+	StrVal		stopped("one two three");
+	stopped.transform(
+		[](const char*& cp, const char* ep, StrSink& sink)
+		{
+			if (*cp == ' ')
+				sink.append(StrVal("_"));	// Not advancing cp
+			else
+				sink.appendChar(UCS4ToUpper(UTF8Get(cp)));
+		});
+	expect("stop transform", stopped == "ONE_ two three");
+
+	// Direct writes into the sink:
+	StrVal		hex("Zé");
+	hex.transform(
+		[](const char*& cp, const char* ep, StrSink& sink)
+		{
+			char*	op = sink.reserve(8);
+			op += sprintf(op, "<%X>", (unsigned)UTF8Get(cp));
+			sink.commit(op);
+		});
+	expect("reserve and commit", hex == "<5A><E9>");
+
+	// The std::function form is a wrapper, and returns whole replacements:
+	StrVal		doubled("Ève was here, ");
+	for (int i = 0; i < 7; i++)
+		doubled += doubled;
+	StrVal		expected_doubled;
+	for (int i = 0; i < doubled.length(); i++)
+		expected_doubled += StrVal(doubled[i]) + StrVal(doubled[i]);
+	doubled.transform([](const char*& cp, const char* ep) -> StrVal { UCS4 ch = UTF8Get(cp); return StrVal(ch)+StrVal(ch); });
+	expect("std::function transform of a rope", doubled == expected_doubled && doubled.length() == 14*128*2);
+
+	StrVal		original("Shared and not changed");
+	StrVal		shared(original);
+	shared.transform([](const char*& cp, const char* ep, StrSink& sink) { sink.appendChar(UCS4ToLower(UTF8Get(cp))); });
+	expect("unshared first", original == "Shared and not changed" && shared == "shared and not changed");
+
+	StrVal		json("Tab\t \"quoted\" é\x01");
+	expect("toJSON on the sink", json.asJSON() == "Tab\\t \\\"quoted\\\" é\\u0001");
+}
+
+void
+strval_builder()
+{
+	test_group("StrBuilder");
+
+	StrBuilder	builder;
+	StrVal		empty = builder.take();
+	expect("empty", empty.length() == 0 && empty == "");
+
+	builder.appendChar('x');
+	builder.appendChar(0xE9);
+	builder += ' ';
+	builder.appendInt(0);
+	builder.appendBytes(" ", 1);
+	builder.appendInt(-9223372036854775807LL-1);
+	StrVal		pieces = builder.take();
+	expect("pieces", pieces == "xé 0 -9223372036854775808" && pieces.length() == 25);
+	expect("empty after take", builder.length() == 0 && builder.take() == "");
+
+	builder.appendInt(42);
+	StrVal		inline_built = builder.take();
+	builder += "Reused";
+	expect("inline result", inline_built == "42" && builder.take() == "Reused");
+
+	// Many appends grow the buffer geometrically, and the result has the right length and index:
+	StrVal		word("Ève ");
+	for (int i = 0; i < 10000; i++)
+	{
+		builder += word;
+		builder.appendInt(i%10);
+	}
+	StrVal		big = builder.take();
+	expect("large result", big.length() == 50000 && big[49995] == 0xC8 && big[49999] == '9');
+	big += "!";
+	expect("large result is mutable", big.length() == 50001 && big.find("Ève 9!") == 49995);
+
+#if !defined(MEMCHECK)
+	StrBuilder	sized(100);
+	for (int i = 0; i < 20; i++)
+		sized += "abcd";
+	long		allocs = allocations();
+	StrVal		taken = sized.take();
+	expect("take allocates only a Body", allocations() == allocs+1 && taken.length() == 80);
+#endif
+}
+
+// Escape one character at a time, for comparison:
+StrVal
+slow_json(StrVal s, bool ascii_only = false)
+{
+	StrBuilder	json;
+	char		buf[8];
+	for (StrValIndex i = 0; i < s.length(); i++)
+	{
+		UCS4	ch = s[i];
+		const char*	named = strchr("\"\"\\\\//\bb\ff\nn\rr\tt", ch);
+		if (ch != 0 && named && (named-"\"\"\\\\//\bb\ff\nn\rr\tt")%2 == 0)
+		{
+			json.appendChar('\\');
+			json.appendChar(named[1]);
+		}
+		else if (ch >= ' ' && (ascii_only ? ch < 0x80 : ch <= 0xFFFF && !UTF16IsSurrogate(ch)))
+			json.appendChar(ch);
+		else if (ch > 0xFFFF && UCS4IsUnicode(ch))
+		{
+			snprintf(buf, sizeof(buf), "\\u%04X", UCS4HighSurrogate(ch));
+			json.append(buf);
+			snprintf(buf, sizeof(buf), "\\u%04X", UCS4LowSurrogate(ch));
+			json.append(buf);
+		}
+		else
+		{
+			snprintf(buf, sizeof(buf), "\\u%04X", UCS4IsUnicode(ch) ? (unsigned)ch : 0xFFFD);
+			json.append(buf);
+		}
+	}
+	return json.take();
+}
+
+void
+strval_json()
+{
+	test_group("JSON escaping");
+
+	expect("clean", StrVal("Plain text, é and 講").asJSON() == "Plain text, é and 講");
+	expect("named escapes", StrVal("\"a/b\\c\"\b\f\n\r\t").asJSON() == "\\\"a\\/b\\\\c\\\"\\b\\f\\n\\r\\t");
+	expect("controls", StrVal("\x01\x1F\x7F", 3).asJSON() == "\\u0001\\u001F\x7F");
+	expect("NUL", StrVal("a\0b", 3).asJSON() == "a\\u0000b");
+	expect("surrogate pair", StrVal("🎉").asJSON() == "\\uD83C\\uDF89");
+	expect("illegal byte", StrVal("a\xFF" "b").asJSON() == "a\\uFFFDb");
+	expect("ASCII only", StrVal("é講🎉").asJSON(true) == "\\u00E9\\u8B1B\\uD83C\\uDF89");
+
+	// Escapes at every position around the vector blocks:
+	int		wrong = 0;
+	for (int at = 0; at < 70; at++)
+		for (const char* special: { "\"", "\n", "é", "🎉", "\x7F" })
+		{
+			StrVal	text = StrVal("x")*at + special + StrVal("y")*(70-at);
+			if (text.asJSON() != slow_json(text) || text.asJSON(true) != slow_json(text, true))
+				wrong++;
+		}
+	expect("escapes at each position", wrong == 0);
+
+	StrVal		big;
+	for (int i = 0; i < 2000; i++)
+		big += (i%7 == 0) ? "line \"é\"\n" : "plain ASCII ";
+	StrVal		slice = big.substr(100, 5000);
+	expect("large rope", big.asJSON() == slow_json(big));
+	expect("slice", slice.asJSON() == slow_json(slice) && slice.length() == 5000);
+
+	StrBuilder	json;
+	json.appendChar('"');
+	StrVal("tab\there").appendJSON(json);
+	json.appendChar('"');
+	expect("appendJSON", json.take() == "\"tab\\there\"");
+
+#if !defined(MEMCHECK)
+	StrVal		clean("A string that's too long to store inline, and needs no escapes");
+	long		allocs = allocations();
+	clean.toJSON();
+	expect("clean string unchanged without allocation", allocations() == allocs);
+	StrVal		dirty("A string that's too long to store inline, and \"needs\" escapes");
+	StrVal		unshared(dirty.asUTF8());
+	allocs = allocations();
+	unshared.toJSON();
+	expect("one allocation for the escaped data", allocations() == allocs+1 && unshared.length() == dirty.length()+2);
+#endif
+}
+
+
+void
+strval_numbers()
+{
+	test_group("Number conversion");
+
+	ErrNum		e;
+	StrValIndex	scanned;
+
+	expect("int32", StrVal(" -2147483648 ").asInt32(&e, 10, &scanned) == INT32_MIN && !e && scanned == 13);
+	expect("int32 overflow", (StrVal("2147483648").asInt32(&e), e == STRERR_NUMBER_OVERFLOW));
+	expect("int64 limits", StrVal("9223372036854775807").asInt64(&e) == INT64_MAX && !e
+		&& StrVal("-9223372036854775808").asInt64(&e) == INT64_MIN && !e);
+	expect("int64 overflow", (StrVal("9223372036854775808").asInt64(&e), e == STRERR_NUMBER_OVERFLOW));
+	expect("uint64 limit", StrVal("18446744073709551615").asUInt64(&e) == UINT64_MAX && !e);
+	expect("uint64 overflow", StrVal("18446744073709551616 ").asUInt64(&e, 0, &scanned) == 0
+		&& e == STRERR_NUMBER_OVERFLOW && scanned == 20);
+	expect("uint64 negative", (StrVal("-1").asUInt64(&e), e == STRERR_NUMBER_OVERFLOW));
+	expect("hexadecimal", StrVal("0xFFFFffffFFFFffff").asUInt64(&e) == UINT64_MAX && !e);
+	expect("binary", StrVal("-0b101").asInt64(&e) == -5 && !e);
+	expect("octal", StrVal("0777").asInt64(&e) == 511 && !e);
+	expect("zero", StrVal("0").asInt64(&e) == 0 && !e);
+	expect("radix 36", StrVal("zz").asInt64(&e, 36) == 36*36-1 && !e);
+	expect("illegal radix", (StrVal("1").asInt64(&e, 37), e == STRERR_ILLEGAL_RADIX));
+	expect("no digits", (StrVal(" - ").asInt64(&e), e == STRERR_NO_DIGITS));
+	expect("no digits after prefix", (StrVal("0x").asInt64(&e), e == STRERR_NO_DIGITS));
+	expect("not a number", (StrVal(" +x").asInt64(&e), e == STRERR_NOT_NUMBER));
+	expect("trailing text", StrVal("　٤٢ é").asInt64(&e, 0, &scanned) == 42 && e == STRERR_TRAIL_TEXT && scanned == 4);
+	expect("digits of other scripts", StrVal("١٢٣٤٥٦٧٨٩٠").asInt64(&e) == 1234567890 && !e);
+	expect("substring", StrVal("12345678901234567890").substr(1, 17).asInt64(&e) == 23456789012345678 && !e);
+
+	expect("double", StrVal(" -1.5e3 ").asDouble(&e, &scanned) == -1500 && !e && scanned == 8);
+	expect("double fraction", StrVal(".125").asDouble(&e) == 0.125 && !e);
+	expect("double exponent needs digits", StrVal("2e+").asDouble(&e, &scanned) == 2 && e == STRERR_TRAIL_TEXT && scanned == 1);
+	expect("double overflow", StrVal("1e309").asDouble(&e) == HUGE_VAL && e == STRERR_NUMBER_OVERFLOW);
+	expect("double infinity", StrVal("-Infinity").asDouble(&e) == -HUGE_VAL && !e);
+	expect("double nan", std::isnan(StrVal("nan").asDouble(&e)) && !e);
+	expect("double not a number", (StrVal("e5").asDouble(&e), e == STRERR_NOT_NUMBER));
+	expect("double halfway rounds to even", StrVal("9007199254740993").asDouble() == 9007199254740992.0);
+	expect("double many digits", StrVal("0.1000000000000000055511151231257827021181583404541015625").asDouble() == 0.1);
+	expect("double subnormal", StrVal("4.9406564584124654e-324").asDouble() == 4.9406564584124654e-324);
+
+	// Compare with strtod on random doubles, printed in full and with extra digits:
+	uint64_t	x = 88172645463325252ULL;
+	int		wrong = 0;
+	for (int i = 0; i < 20000; i++)
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		double	d;
+		memcpy(&d, &x, sizeof(d));
+		if (std::isnan(d))
+			continue;
+		char	buf[64];
+		snprintf(buf, sizeof(buf), i%2 ? "%.17g" : "%.30g", d);
+		if (StrVal(buf).asDouble() != strtod(buf, 0))
+			wrong++;
+	}
+	expect("random doubles match strtod", wrong == 0);
+}
+
+void
+strval_formatting()
+{
+	test_group("Number formatting");
+
+	expect("int", StrVal::fromInt(-42) == "-42" && StrVal::fromInt(0) == "0");
+	expect("int64 limits", StrVal::fromInt(INT64_MAX) == "9223372036854775807"
+		&& StrVal::fromInt(INT64_MIN) == "-9223372036854775808");
+	expect("uint64 limit", StrVal::fromUInt(UINT64_MAX) == "18446744073709551615");
+	int		wrong = 0;
+	for (uint64_t n = 1; n <= UINT64_MAX/3; n *= 3)
+	{
+		char	buf[24];
+		snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+		if (StrVal::fromUInt(n) != buf || StrVal::fromUInt(n-1).asUInt64() != n-1)
+			wrong++;
+	}
+	expect("powers of three and one less", wrong == 0);
+
+	expect("double integer", StrVal::fromDouble(100) == "100" && StrVal::fromDouble(-0.0) == "-0");
+	expect("double shortest", StrVal::fromDouble(0.1) == "0.1" && StrVal::fromDouble(0.1+0.2) == "0.30000000000000004");
+	expect("double fixed range", StrVal::fromDouble(1e20) == "100000000000000000000" && StrVal::fromDouble(1e-6) == "0.000001");
+	expect("double scientific", StrVal::fromDouble(1e21) == "1e+21" && StrVal::fromDouble(-1.5e-7) == "-1.5e-7");
+	expect("double limits", StrVal::fromDouble(1.7976931348623157e308) == "1.7976931348623157e+308"
+		&& StrVal::fromDouble(5e-324) == "5e-324");
+	expect("double specials", StrVal::fromDouble(HUGE_VAL) == "inf" && StrVal::fromDouble(-HUGE_VAL) == "-inf"
+		&& StrVal::fromDouble(NAN) == "nan");
+
+	// Every double must convert back exactly:
+	uint64_t	x = 88172645463325252ULL;
+	wrong = 0;
+	for (int i = 0; i < 20000; i++)
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		double	d;
+		uint64_t	bits = i%3 ? x : x & 0x801FFFFFFFFFFFFFULL;	// Include subnormals
+		memcpy(&d, &bits, sizeof(d));
+		if (std::isnan(d))
+			continue;
+		if (StrVal::fromDouble(d).asDouble() != d)
+			wrong++;
+	}
+	expect("random doubles round-trip", wrong == 0);
+
+	StrBuilder	b;
+	b.appendInt(-7);
+	b.appendChar(' ');
+	b.appendDouble(2.5);
+	expect("StrBuilder", b.take() == "-7 2.5");
+}
+
+void
+strval_format()
+{
+	test_group("Formatting with StrFormat");
+
+	expect("strings and integers", StrVal::format("Value: '%s', length %d", Variant("param1") << 6) == "Value: 'param1', length 6");
+	expect("width", StrVal::format("[%5d|%-5d|%5s|%-5s]", Variant(42) << -42 << "é" << "ab") == "[   42|-42  |    é|ab   ]");
+	expect("zero padding", StrVal::format("%05d %05d %08x %X %o", Variant(42) << -42 << 48879 << 48879 << 8) == "00042 -0042 0000beef BEEF 10");
+	expect("precision", StrVal::format("%.3s %.4d %6.3d", Variant("abcdef") << 7 << -7) == "abc 0007   -007");
+	expect("star", StrVal::format("%*d|%-*s|%.*s", Variant(4) << 1 << 3 << "x" << 2 << "abc") == "   1|x  |ab");
+	expect("numbered arguments", StrVal::format("%2$s %1$s %2$05d", Variant("world") << 12) == "12 world 00012");
+	expect("percent", StrVal::format("100%% %s%%", Variant("sure")) == "100% sure%");
+	expect("character", StrVal::format("%c%c", Variant(0x8B1B) << "xyz") == "講x");
+	expect("64-bit", StrVal::format("%d %x", Variant(-9223372036854775807LL-1) << -1LL) == "-9223372036854775808 ffffffffffffffff");
+	expect("other types as JSON", StrVal::format("%d %s", Variant("q") << Variant(Variant(1) << 2)) == "\"q\" [ 1, 2 ]");
+	expect("missing arguments", StrVal::format("a%sb%d", VariantArray()) == "ab");
+	expect("unknown conversion", StrVal::format("%q %5.2q %", Variant(1)) == "%q %5.2q %");
+	expect("no floating point conversions yet", StrVal::format("%f %.2e %g", Variant(1)) == "%f %.2e %g");
+	StrVal		quotes = StrVal("\"\n")*30;
+	expect("JSON bytes are counted", quotes.jsonBytes() == 120 && StrVal("plain").jsonBytes() == 5);
+	expect("escaped as JSON", StrVal::format("%d", Variant(quotes)) == StrVal("\"") + quotes.asJSON() + "\"");
+
+	StrFormat	fmt("%s=%04d; ");
+	StrBuilder	out;
+	for (int i = 0; i < 3; i++)
+		fmt.appendTo(out, Variant("x") << i);
+	expect("reused", out.take() == "x=0000; x=0001; x=0002; ");
+
+#if !defined(MEMCHECK)
+	VariantArray	args = Variant("a long string argument, too long to be inline") << 12345;
+	long		allocs = allocations();
+	StrVal		result = fmt(args);
+	expect("the buffer is sized once, and adopted by the Body", allocations() == allocs+2 && result.length() == 53);
+#endif
+}
+
+
+void
+strval_hash()
+{
+	test_group("Hashing");
+
+	StrVal		body("A string that's too long to be stored inline");
+	StrVal		copy(body.asUTF8());
+	StrVal		slice = body.substr(2, 6);
+	StrVal		rope = StrVal("x")*5000 + StrVal("y")*5000;
+	expect("equal strings hash equal", body.hash() == copy.hash());
+	expect("slice hashes like its text", slice.hash() == StrVal("string").hash());
+	expect("rope hashes like its text", rope.hash() == StrVal(rope.asUTF8()).hash());
+	expect("different strings hash differently", body.hash() != StrVal("A string that's too long to be stored inlinE").hash()
+		&& StrVal("").hash() != StrVal(" ").hash());
+	expect("std::hash", std::hash<StrVal>()(copy) == body.hash() && std::hash<StrRef>()(StrRef(body)) == body.hash());
+
+	StrVal		changing(body.asUTF8());
+	size_t		before = changing.hash();
+	changing.toUpper();
+	expect("case change rehashes", changing.hash() != before && changing.hash() == StrVal(changing.asUTF8()).hash());
+	changing += "!";
+	expect("append rehashes", changing.hash() == StrVal(changing.asUTF8()).hash());
+
+	std::unordered_map<StrVal, int>	counts;
+	for (const char* w: { "apple", "pear", "apple", "fig", "apple" })
+		counts[StrVal(w)]++;
+	expect("unordered_map", counts.size() == 3 && counts[StrVal("apple")] == 3);
+
+	CowHashMap<int>	map;
+	map.insert("one", 1);
+	map.insert(body, 2);
+	CowHashMap<int>	shared = map;
+	shared.insert("three", 3);
+	expect("CowHashMap", map[copy] == 2 && map.size() == 2 && shared.size() == 3 && shared["three"] == 3);
+}
+
+#if !defined(MEMCHECK)
+void
+strval_inline()
+{
+	test_group("Short strings are stored inline");
+
+	long		before = allocations();
+	StrVal		hello("Hello");
+	StrVal		copy(hello);
+	StrVal		greeting = hello + ", you";
+	greeting += 0x1F389;		// 4 bytes of UTF-8, 14 in all
+	StrVal		sub = greeting.substr(7, 3);
+	expect("no allocations", allocations()-before, 0);
+	expect("inline", hello.isInline() && copy.isInline() && greeting.isInline() && sub.isInline());
+	expect("concatenated length", greeting.length(), 11);
+	expect("concatenated value", greeting == StrVal("Hello, you🎉"));
+	expect("last character", greeting[10], 0x1F389);
+	expect("substring", sub == "you");
+	expect("NUL terminated", strcmp(greeting.asUTF8(), "Hello, you🎉") == 0);
+
+	greeting += '!';		// Too long now, so it moves to a Body
+	expect("grown into a body", !greeting.isInline());
+	expect("grown length", greeting.length(), 12);
+	expect("grown value", strcmp(greeting.asUTF8(), "Hello, you🎉!") == 0);
+	expect("copy unchanged", copy == "Hello" && hello.isInline());
+
+	StrRef		ref(hello);	// A StrRef needs a Body
+	StrVal		back(ref);
+	expect("via StrRef", back == hello);
+	const StrVal&	cref = hello;
+	ref = StrRef(cref);
+	StrVal		shorts[] = { "one", "two", "a string too long to be inline" };
+	StringArray	array(shorts, 3);
+	expect("StrRef from a const StrVal", StrVal(ref) == "Hello" && hello.isInline());
+	expect("StringArray of StrVals", array.length() == 3 && array[1] == "two" && array.join(",").length() == 38);
+
+	StrVal		lower = hello.asLower();
+	expect("asLower", lower == "hello" && hello == "Hello");
+	expect("empty", StrVal("").length() == 0 && !StrVal("").isInline());
+}
+#endif
+
+#if !defined(MEMCHECK)
+void
+strval_allocation()
+{
+	test_group("A Body and its data are allocated together");
+
+	const char*	text = "A string that's too long to store inline";
+	long		before = allocations();
+	{
+		StrVal		s(text);
+		expect("one allocation", allocations()-before, 1);
+		expect("content", strcmp(s.asUTF8(), text) == 0);
+	}
+
+	before = allocations();
+	StrVal		grown(text, strlen(text), 256);		// Room to grow
+	for (int i = 0; i < 100; i++)
+		grown += StrVal("xy");
+	expect("growth within allocation", allocations()-before, 1);
+	expect("grown length", grown.length(), strlen(text)+200);
+
+	for (int i = 0; i < 100; i++)
+		grown += StrVal("xy");
+	expect("grown again", grown.length(), strlen(text)+400);
+	expect("grown content", grown[strlen(text)+399], 'y');
+
+	Array<int>	ints((const int*)0, 0, 10);
+	before = allocations();
+	for (int i = 0; i < 10; i++)
+		ints += i;
+	expect("array elements within allocation", allocations()-before, 0);
+	expect("array contents", ints[9], 9);
+}
+#endif
+
+#if !defined(MEMCHECK)
+void
+strval_move()
+{
+	test_group("Moving values takes their references");
+
+	const char*	text = "A string that's too long to store inline";
+	StrVal		original(text);
+	StrVal		copy = original;
+	long		before = allocations();
+	copy.toUpper();
+	expect("a shared Body is copied before change", allocations()-before, 1);
+
+	StrVal		moved = original.pass();
+	before = allocations();
+	moved.toUpper();
+	expect("a moved Body is changed in place", allocations()-before, 0);
+	expect("moved content", moved == copy);
+	expect("moved-from is empty", original.length() == 0 && strcmp(original.asUTF8(), "") == 0 && original == StrVal());
+	original = "reused";
+	original += StrVal(" after the move");
+	expect("moved-from is reusable", original == "reused after the move");
+
+	StrVal		short_str("short");
+	StrVal		short_moved = short_str.pass();
+	expect("inline strings are copied", short_moved == "short" && short_str == "short");
+
+	StrVal		empty = StrVal(text).pass();
+	StrVal		emptied(text);
+	empty = emptied.pass();
+	expect("move assignment", empty == text && emptied.isEmpty() && emptied.substr(0) == "" && StrRef(emptied).length() == 0);
+
+	StrRef		ref = moved.pass();
+	StrVal		back = ref.pass();
+	expect("StrRef moves", back == copy && moved.isEmpty() && ref.isEmpty() && StrVal(ref).isEmpty());
+
+	Array<int>	ints((const int*)0, 0, 10);
+	for (int i = 0; i < 10; i++)
+		ints += i;
+	Array<int>	taken = ints.pass();
+	before = allocations();
+	taken += 10;
+	expect("a moved Array is appended in place", allocations()-before, 0);
+	expect("moved Array", taken.length() == 11 && ints.length() == 0);
+
+	CowMap<int>	map;
+	map.insert("one", 1);
+	CowMap<int>	map_moved = map.pass();
+	expect("moved CowMap", map_moved["one"] == 1 && map.size() == 0 && !map.contains("one"));
+	map.insert("two", 2);
+	expect("moved-from CowMap is reusable", map.size() == 1 && map["two"] == 2);
+
+	StrVal		value(text);
+	before = allocations();
+	Variant		v(value.pass());
+	expect("a Variant takes its StrVal", allocations()-before, 0);
+	expect("Variant content", v.as_strval() == text && value.isEmpty());
+}
+#endif
+
+struct	Counted
+: public RefCounted
+{
+	static std::atomic<int>	deleted;
+	~Counted() { deleted++; }
+};
+std::atomic<int>	Counted::deleted;
+
+Ref<Counted>	handed;			// Passed between threads
+
+void*
+copy_many(void* arg)
+{
+	Ref<Counted>	mine = handed;
+	for (int i = 0; i < 100000; i++)
+	{
+		Ref<Counted>	copy = mine;
+		Ref<Counted>	another = copy;
+	}
+	StrVal		text = *(StrVal*)arg;
+	for (int i = 0; i < 1000; i++)
+		StrVal	copy = text;
+	return 0;
+}
+
+void*
+keep_one(void* arg)
+{
+	*(Ref<Counted>*)arg = handed;	// Counted by this thread, released by the main thread
+	return 0;
+}
+
+void*
+release_unshared(void* arg)
+{
+	Ref<Counted>	taken(std::move(*(Ref<Counted>*)arg));	// Counted by the main thread, released here
+	return 0;
+}
+
+void*
+make_and_end(void* arg)
+{
+	*(Ref<Counted>*)arg = new Counted;	// Counted by this thread, which ends first
+	return 0;
+}
+
+void*
+release_array(void* arg)
+{
+	Array<Ref<Counted>>	taken(std::move(*(Array<Ref<Counted>>*)arg));
+	return 0;
+}
+
+void
+strval_refcount()
+{
+	test_group("Biased reference counts");
+
+	Counted::deleted = 0;
+	{
+		Ref<Counted>	r1 = new Counted;
+		Ref<Counted>	r2 = r1;
+		expect("owner counts", r1.GetRefCount() == 2 && !r1->isMerged());
+	}
+	expect("owner's last release deletes", Counted::deleted, 1);
+
+	handed = new Counted;
+	handed.share();
+	StrVal		text = StrVal("x")*200 + StrVal("y")*200;	// A rope, whose pieces are shared too
+	text.share();
+	const int	num_threads = 4;
+	pthread_t	threads[num_threads];
+	for (int t = 0; t < num_threads; t++)
+		pthread_create(&threads[t], 0, copy_many, &text);
+	for (int t = 0; t < num_threads; t++)
+		pthread_join(threads[t], 0);
+	expect("shared counts", handed.GetRefCount() == 1 && handed->isMerged() && text.length() == 400);
+	handed = 0;
+	expect("shared object deleted", Counted::deleted, 2);
+
+	handed = new Counted;
+	Ref<Counted>	kept;
+	pthread_t	keeper;
+	pthread_create(&keeper, 0, keep_one, &kept);
+	pthread_join(keeper, 0);
+	expect("both counts", kept.GetRefCount() == 2);
+	handed = 0;
+	expect("merged when the owner is done", Counted::deleted == 2 && kept->isMerged());
+	kept = 0;
+	expect("other thread's reference deletes", Counted::deleted, 3);
+
+	Ref<Counted>	moving = new Counted;
+	pthread_t	releaser;
+	pthread_create(&releaser, 0, release_unshared, &moving);
+	pthread_join(releaser, 0);
+	expect("an unshared reference released by another thread waits for the owner", Counted::deleted, 3);
+	{
+		Ref<Counted>	other = new Counted;
+	}
+	expect("the owner's next release merges and deletes it", Counted::deleted, 5);
+
+	Ref<Counted>	orphan;
+	pthread_t	maker;
+	pthread_create(&maker, 0, make_and_end, &orphan);
+	pthread_join(maker, 0);
+	expect("an ended thread's object", orphan.GetRefCount() == 1 && !orphan->isMerged());
+	orphan = 0;
+	expect("is merged and deleted by the releasing thread", Counted::deleted, 6);
+
+	Array<Ref<Counted>>	counted;
+	for (int i = 0; i < 3; i++)
+		counted.append(new Counted);
+	counted.share();
+	bool		all_merged = true;
+	for (int i = 0; i < 3; i++)
+	{
+		Ref<Counted>	element = counted[i];
+		all_merged &= element && element->isMerged();
+	}
+	expect("sharing an Array shares its elements", all_merged);
+	pthread_create(&releaser, 0, release_array, &counted);
+	pthread_join(releaser, 0);
+	expect("so another thread deletes them", Counted::deleted, 9);
+}
+
+void*
+free_blocks(void* arg)
+{
+	void**		blocks = (void**)arg;
+	for (int i = 0; i < 5000; i++)
+		SlabFree(blocks[i], 1000);
+	return 0;
+}
+
+void
+strval_slab()
+{
+	test_group("Slab allocation");
+
+	int		wrong = 0;
+	for (size_t bytes = 1; bytes <= SlabMaxSize; bytes++)
+	{
+		int	size_class = SlabSizeClass(bytes);
+		if (size_class < 0 || size_class >= SlabClasses
+		 || SlabClassSize(size_class) < bytes
+		 || (size_class > 0 && SlabClassSize(size_class-1) >= bytes))
+			wrong++;
+	}
+	expect("size classes", wrong, 0);
+
+	void*		p1 = SlabAllocate(100);
+	SlabFree(p1, 100);
+	void*		p2 = SlabAllocate(112);
+	expect("a freed block is reused", p1 == p2 && ((uintptr_t)p2 & 15) == 0);
+	SlabFree(p2, 112);
+
+	char*		large = (char*)SlabAllocate(100000);
+	memset(large, 'x', 100000);
+	expect("large blocks", large[99999] == 'x' && ((uintptr_t)large & 15) == 0);
+	SlabFree(large, 100000);
+
+	static void*	blocks[5000];
+	for (int i = 0; i < 5000; i++)
+		blocks[i] = SlabAllocate(1000);
+	pthread_t	freer;
+	pthread_create(&freer, 0, free_blocks, blocks);
+	pthread_join(freer, 0);
+	std::sort(blocks, blocks+5000);
+	int		reused = 0;
+	void*		again[5000];
+	for (int i = 0; i < 5000; i++)
+	{
+		again[i] = SlabAllocate(1000);
+		reused += std::binary_search(blocks, blocks+5000, again[i]);
+	}
+	expect("blocks freed by another thread are reused", reused > 4000);
+	for (int i = 0; i < 5000; i++)
+		SlabFree(again[i], 1000);
+}
+
+void*
+drop_escaped(void* arg)
+{
+	*(StrVal*)arg = StrVal("");
+	return 0;
+}
+
+// Just enough of JSON to parse some in an arena, with no spaces
+const char*	json_top_captures[] = { "value", 0 };
+const char*	json_value_captures[] = { "object", "array", "string", "number", 0 };
+const char*	json_object_captures[] = { "member", 0 };
+const char*	json_member_captures[] = { "string", "value", 0 };
+const char*	json_array_captures[] = { "value", 0 };
+
+class	JsonParser
+: public Peg<PegMemorySource, PegMatch, PegContext>
+{
+	static	Rule	rules[];
+public:
+	JsonParser() : Peg(rules, 7) {}
+};
+
+JsonParser::Rule	JsonParser::rules[] =
+{
+	{ "TOP", "<value>!.", json_top_captures },
+	{ "value", "|<object>|<array>|<string>|<number>|true|false|null", json_value_captures },
+	{ "object", "\\{?(<member>*(,<member>))\\}", json_object_captures },
+	{ "member", "<string>\\:<value>", json_member_captures },
+	{ "array", "\\[?(<value>*(,<value>))\\]", json_array_captures },
+	{ "string", "\"*[^\"]\"", 0 },
+	{ "number", "?-+\\d?(.+\\d)", 0 }
+};
+
+// "name" is captured, and a label it's only a prefix of must be captured under its own name
+const char*	qualified_top_captures[] = { "name", 0 };
+
+class	QualifiedNameParser
+: public Peg<PegMemorySource, PegMatch, PegContext>
+{
+	static	Rule	rules[];
+public:
+	QualifiedNameParser() : Peg(rules, 2) {}
+};
+
+QualifiedNameParser::Rule	QualifiedNameParser::rules[] =
+{
+	{ "TOP", "<word>:namespace\\.<word>:name!.", qualified_top_captures },
+	{ "word", "+[a-z]", 0 }
+};
+
+StrVal
+parse_json_in_arena(const char* json, long& live)
+{
+	ArenaScope	arena;
+	StrVal		rendered;
+	{
+		JsonParser	parser;
+		PegMemorySource	source(json);
+		PegMatch	match = parser.parse(source);
+		StrVal		greeting = StrValLiteral("in an arena");
+		rendered = match.var.as_json(-2) + greeting;
+		live = arena.live();
+		ArenaScope::Pause	pause;
+		rendered = StrVal(rendered.asUTF8(), rendered.numBytes());	// Copy the result out
+	}
+	return rendered;
+}
+
+void
+strval_arena()
+{
+	test_group("Arena allocation");
+#if	defined(SLAB_ALLOC)
+	char		buf[100];
+	memset(buf, 'a', sizeof(buf));
+	{
+		ArenaScope	arena;
+		StrVal		s1(buf, 50);
+		{
+			StrVal		s2(buf, 60);
+			expect("strings in the arena", arena.live(), 2);
+		}
+		expect("freeing is counted", arena.live(), 1);
+
+		void*		p1 = SlabAllocate(100);
+		SlabFree(p1, 100);
+		void*		p2 = SlabAllocate(100);
+		expect("freed arena blocks aren't reused", p1 != p2 && ((uintptr_t)p2 & 15) == 0);
+		SlabFree(p2, 100);
+
+		{
+			ArenaScope::Pause	pause;
+			StrVal		outside(buf, 70);
+			expect("a pause allocates normally", arena.live(), 1);
+		}
+
+		{
+			ArenaScope	inner;
+			StrVal		s3(buf, 80);
+			expect("a nested arena", inner.live() == 1 && arena.live() == 1);
+		}
+
+		VariantArray	values;
+		for (int i = 0; i < 1000; i++)
+			values += Variant(StrVal(buf, 20+i%80));
+		StrVal		json = Variant(values).as_json();
+		expect("more than one chunk of values", json.numBytes() > 60000 && arena.live() > 1000);
+	}
+
+	StrVal		escaped;
+	StrVal		copied;
+	{
+		ArenaScope	arena(true);
+		StrVal		made(buf, 90);
+		escaped = made;
+		ArenaScope::Pause	pause;
+		copied = StrVal(made.asUTF8(), made.numBytes());
+	}
+	expect("an escaped string survives", escaped.length() == 90 && escaped[89] == 'a');
+	expect("a copied string survives", copied.length() == 90 && copied == escaped);
+
+	escaped.share();	// Drop it in another thread, which releases the arena chunk
+	pthread_t	dropper;
+	pthread_create(&dropper, 0, drop_escaped, &escaped);
+	pthread_join(dropper, 0);
+	expect("dropped in another thread", escaped.length(), 0);
+
+	long		live;
+	StrVal		parsed = parse_json_in_arena("{\"list\":[1,-2.5,\"three\"],\"ok\":true}", live);
+	expect("a parse in an arena", live > 10 && parsed.find("three") > 0 && parsed.find("in an arena") > 0);
+	size_t		interned = StrIntern::size();
+	StrVal		again = parse_json_in_arena("{\"list\":[4,5]}", live);
+	expect("another parse interns nothing", again.find("list") > 0 && StrIntern::size() == interned);
+#endif
+}
+
+void
+strval_peg()
+{
+	test_group("Peg captures");
+	JsonParser	parser;
+	PegMemorySource	source("{\"key\":[1,{\"x\":\"y\"}]}");
+	size_t		interned = StrIntern::size();
+	PegMatch	match = parser.parse(source);
+	StrVal		json = match.var.as_json(-2);
+	expect("a parse", json.find("member") > 0 && json.find("number") > 0);
+	expect("captures intern nothing", StrIntern::size(), interned);
+
+	StrVariantMap	top = match.var.as_variant_map();
+	StrVal		key = top.begin()->first;
+	expect("capture names are interned", key == "value" && key.isInterned());
+
+	QualifiedNameParser	qualified;
+	PegMemorySource	qualified_source("std.string");
+	StrVariantMap	names = qualified.parse(qualified_source).var.as_variant_map();
+	expect("a label isn't captured under a name it starts with",
+		names.contains("namespace") && names["namespace"].as_strval() == "std"
+		&& names.contains("name") && names["name"].as_strval() == "string");
+	expect("only listed capture names are interned", names.size() == 2
+		&& names.begin()->first.isInterned() != (++names.begin())->first.isInterned());
+}
+
+void
+strval_index16()
+{
+	test_group("16-bit indices");
+	typedef	StrValB<16>	StrVal16;
+
+	StrVal16	s("Hello, 世界!");
+	expect("a short string", s.length() == 10 && s.find(',') == 5 && s[7] == 0x4E16);
+	StrVal16	longer("Good morning, 世界!");
+	expect("a longer string", longer.length() == 17 && longer.substr(14, 2) == StrVal16("世界"));
+	expect("append", (s + longer).length() == 27);
+
+	static char	buf[40000];
+	memset(buf, 'x', sizeof(buf));
+	StrVal16	big(buf, 30000);
+	StrVal16	bigger = big + big;		// A rope
+	expect("a 16-bit rope", bigger.length() == 60000 && bigger[59999] == 'x' && bigger.isRope());
+	expect("a 16-bit rope flattened", StrVal16(bigger.asUTF8()).length() == 60000);
+
+	bool		thrown = false;
+	try {
+		StrVal16	too_big = bigger + big;
+	} catch (std::length_error&) {
+		thrown = true;
+	}
+	expect("a rope too long for 16 bits throws", thrown);
+
+	thrown = false;
+	try {
+		StrVal16	too_big(buf, 65535);		// Leaves no room for a NUL
+	} catch (std::length_error&) {
+		thrown = true;
+	}
+	expect("a string too long for 16 bits throws", thrown);
+
+	thrown = false;
+	StrVal16	grown(buf, 40000);
+	try {
+		grown.append(big);
+	} catch (std::length_error&) {
+		thrown = true;
+	}
+	expect("appending too much throws", thrown && grown.length() == 40000);
+
+	ArrayB<int, 16>	a;
+	for (int i = 0; i < 65535; i++)
+		a += i;
+	thrown = false;
+	try {
+		a += 65535;
+	} catch (std::length_error&) {
+		thrown = true;
+	}
+	expect("an Array too long for 16 bits throws", thrown && a.length() == 65535 && a[65534] == 65534);
+
+	expect("16-bit values are smaller", sizeof(StrVal16) < sizeof(StrValB<32>) && sizeof(StrBookmark<uint16_t>) < sizeof(StrBookmark<uint32_t>));
+}
+
+StrVal
+greeting()
+{
+	return StrValLiteral("Hello, 世界!");
+}
+
+void*
+copy_literal(void* arg)
+{
+	long		total = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		StrVal	copy = greeting();
+		total += copy.length();
+	}
+	*(long*)arg = total;
+	return 0;
+}
+
+void
+strval_literal()
+{
+	test_group("String literals");
+
+	static_assert(StrLiteralChars("Hello, 世界!", sizeof("Hello, 世界!")-1) == 10, "Characters are counted at compile time");
+	StrVal		hello = greeting();
+	expect("a literal", hello.isLiteral() && hello.length() == 10 && hello == StrVal("Hello, 世界!") && hello[8] == 0x754C);
+
+	long		before = allocations();
+	StrVal		again = greeting();
+	StrVal		copy(hello);
+	StrVal		assigned;
+	assigned = copy;
+	StrVal		moved(std::move(assigned));
+	StrVal		sub = hello.substr(7);
+	expect("literals and their copies allocate nothing", allocations()-before, 0);
+	expect("copies share the literal", again.isLiteral() && copy.isLiteral() && moved.isLiteral() && sub.isLiteral());
+	expect("substring of a literal", sub == "世界!");
+
+	copy += '?';
+	copy.toUpper();
+	expect("changing a copy copies it", !copy.isLiteral() && copy == "HELLO, 世界!?" && hello == "Hello, 世界!");
+
+	StrVal		empty;
+	before = allocations();
+	StrVal		empty_copy = empty;
+	empty_copy = StrVal();
+	expect("copies of an empty StrVal allocate nothing", allocations()-before, 0);
+
+	long		total;
+	pthread_t	copier;
+	pthread_create(&copier, 0, copy_literal, &total);
+	pthread_join(copier, 0);
+	expect("copied in another thread", total, 10000);
+	expect("still a literal", greeting().isLiteral() && greeting() == hello);
+}
+
+bool
+is_mapped_page(const char* data)
+{
+	return msync((void*)data, sysconf(_SC_PAGESIZE), MS_ASYNC) == 0;
+}
+
+void
+strval_map()
+{
+	test_group("Memory-mapped files");
+
+	char		path[] = "/tmp/strval_mapXXXXXX";
+	int		fd = mkstemp(path);
+	size_t		page = sysconf(_SC_PAGESIZE);
+	std::string	contents;
+	while (contents.size() < page-15)
+		contents += "Hello, 世界!\n";	// 15 bytes
+	contents.resize(page-17);
+	contents += "Goodbye, 世界!\n";	// 17 bytes and 13 chars, so the page is full with no room for a NUL
+	contents.resize(page);
+	int		chars = 0;
+	for (char c : contents)
+		chars += (c & 0xC0) != 0x80;
+	expect("wrote the file", fd >= 0 && write(fd, contents.data(), page) == (ssize_t)page);
+	close(fd);
+
+	ErrNum		e;
+	StrVal		file = StrMapFile(path, &e, StrMapSequential);
+	expect("mapped the file", e == ErrNum() && file.isMapped());
+	expect("with all its data", file.numBytes(), page);
+	StrValIndex	bytes;
+	const char*	data = file.asUTF8(bytes);
+	expect("a whole page of data is terminated in place", file.asUTF8() == data && strlen(data) == page);
+	expect("chars counted", file.length(), chars);
+
+	StrVal		line = file.substr(file.length()-13, 8);
+	StrVal		copy = file;
+	expect("slices and copies share the mapping", line.isMapped() && copy.isMapped() && line == "Goodbye,");
+	expect("advice on a slice", StrMapAdvise(line, StrMapWillNeed) == ErrNum());
+	expect("advice on a string not mapped is ignored", StrMapAdvise(StrVal("not mapped"), StrMapRandom) == ErrNum());
+
+	copy.toUpper();
+	expect("changing a copy copies it", !copy.isMapped() && copy.substr(0, 5) == "HELLO" && file.substr(0, 5) == "Hello");
+	StrVal		appended = file + "!";
+	expect("appending copies too", appended.numBytes(), page+1);
+
+	file = StrVal();
+	appended = StrVal();
+	expect("the mapping lasts while a slice uses it", is_mapped_page(data) && line == "Goodbye,");
+	line = StrVal();
+	expect("the last slice unmaps it", !is_mapped_page(data));
+
+	file = StrMapFile("/nonexistent/file", &e);
+	expect("a missing file", file.length() == 0 && e == ErrNum(0, ENOENT));
+	file = StrMapFile("/tmp", &e);
+	expect("a directory", file.length() == 0 && e == ErrNum(0, EISDIR));
+
+	fd = open(path, O_WRONLY|O_TRUNC);
+	close(fd);
+	file = StrMapFile(path, &e);
+	expect("an empty file", file.length() == 0 && !file.isMapped() && e == ErrNum());
+	unlink(path);
 }
@@ -1,6 +1,8 @@
 #include	<cstdio>
+#include	<utility>
 
 #include	<lockfree.h>
+#include	<refcount.h>
 #include	<thread.h>
 
 #define	FANOUT	25	// This many primary threads will each create this many again. total of N*(N+1)
@@ -31,6 +33,57 @@ public:
 	}
 };
 
+class	Counted
+: public RefCounted
+{
+public:
+	static int	deleted;
+	~Counted() { deleted++; }
+};
+int	Counted::deleted;
+
+// Given two of the owner's references without share(), release one, then make two for the owner
+class	SwapThread
+: public Thread
+{
+public:
+	Ref<Counted>	given[2];
+	Ref<Counted>	made[2];
+
+	SwapThread(Ref<Counted>&& first, Ref<Counted>&& second)
+	{
+		given[0] = std::move(first);
+		given[1] = std::move(second);
+		resume();
+	}
+
+	int	run()
+	{
+		given[1] = 0;		// Below zero, so it's queued for the owner
+		made[0] = given[0];
+		made[1] = given[0];
+		given[0] = 0;
+		return 0;
+	}
+};
+
+// The owner's last release of an object that's in its queue must not touch it after collecting it
+bool
+release_queued()
+{
+	Ref<Counted>	first = new Counted;
+	Ref<Counted>	second = first;
+	SwapThread*	swapper = new SwapThread(std::move(first), std::move(second));
+	swapper->join();
+	Ref<Counted>	made[2] = { std::move(swapper->made[0]), std::move(swapper->made[1]) };
+	delete swapper;
+
+	made[0] = 0;
+	bool		waiting = Counted::deleted == 0;
+	made[1] = 0;		// The owner's count reaches zero, and collecting deletes it
+	return waiting && Counted::deleted == 1;
+}
+
 int
 main(int argc, const char** argv)
 {
@@ -43,6 +96,9 @@ main(int argc, const char** argv)
 		(long long)Thread::main()->id()
 	);
 
+	bool		released = release_queued();
+	printf("Releasing a queued object: %s\n", released ? "ok" : "FAIL");
+
 	for (int i = 0; i < FANOUT; i++)
                 (void)new HelloThread(FANOUT);
 
@@ -55,5 +111,5 @@ main(int argc, const char** argv)
         }
 
 	// REVISIT: Show any outstanding errors on the main program
-	return 0;
+	return released ? 0 : 1;
 }